@@ -0,0 +1,519 @@
+#ifndef CHIP8_H
+#define CHIP8_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define die(fmt, args...) do { fprintf(stderr, fmt, ##args); exit(1); } while(0)
+
+#define FONT_MEM	0x000
+#define BIGFONT_MEM	0x050
+#define PROGRAM_MEM	0x200
+#define MEM_SIZE	0x10000
+#define ADDR_MASK	(MEM_SIZE - 1)
+#define MEM_PAGE_SHIFT	10
+#define MEM_PAGE_SIZE	(1 << MEM_PAGE_SHIFT)
+#define MEM_PAGE_MASK	(MEM_PAGE_SIZE - 1)
+#define MEM_PAGES	(MEM_SIZE >> MEM_PAGE_SHIFT)	/* at most 64, see mem_private */
+#define STACK_DEPTH	48
+#define SCREEN_WIDTH	128
+#define SCREEN_HEIGHT	64
+#define LORES_WIDTH	64
+#define LORES_HEIGHT	32
+#define PLANES		2
+
+#define opC	((op>>12)&0x000f)
+#define opX	((op>>8)&0x000f)
+#define opY	((op>>4)&0x000f)
+#define opN	(op&0x000f)
+#define opNN	(op&0x00ff)
+#define opNNN	(op&0x0fff)
+
+/*
+ * Behaviour that differs between CHIP-8 variants. Cores build one
+ * instance per profile and test quirks through QUIRKS() with a constant
+ * profile, so the tests fold away at compile time.
+ */
+enum chip8_profile {
+	C8_MODERN = 0,	/* what this emulator has always done */
+	C8_VIP,		/* original COSMAC VIP interpreter */
+	C8_SCHIP,	/* SUPER-CHIP 1.1 */
+	C8_XOCHIP,	/* XO-CHIP, as implemented by Octo */
+	C8_NPROFILES,
+};
+
+#define Q_SHIFT_VY	0x01	/* 8XY6/8XYE shift VY into VX */
+#define Q_MEM_INC	0x02	/* FX55/FX65 leave I at I + X + 1 */
+#define Q_JUMP_VX	0x04	/* BXNN jumps to XNN + VX */
+#define Q_CLIP		0x08	/* sprites are clipped at the screen edges */
+#define Q_VF_RESET	0x10	/* 8XY1/8XY2/8XY3 clear VF */
+#define Q_HIRES		0x20	/* SUPER-CHIP: 00CN 00FB-00FF, DXY0, FX30, FX75/FX85 */
+#define Q_XO		0x40	/* XO-CHIP: 00DN, 5XY2/5XY3, F000 NNNN, FN01, F002, FX3A */
+
+#define QUIRKS(p)	((p) == C8_VIP ? Q_SHIFT_VY | Q_MEM_INC | Q_CLIP | Q_VF_RESET : \
+			 (p) == C8_SCHIP ? Q_JUMP_VX | Q_CLIP | Q_HIRES : \
+			 (p) == C8_XOCHIP ? Q_SHIFT_VY | Q_MEM_INC | Q_HIRES | Q_XO : 0)
+
+/* why a core stopped, kept in chip8_state.fault */
+enum chip8_fault {
+	C8_OK = 0,
+	C8_BAD_OP,
+	C8_STACK_OVERFLOW,
+	C8_STACK_UNDERFLOW,
+	C8_EXIT,	/* 00FD */
+	C8_HALT,	/* hlt (00FF outside SUPER-CHIP) or a jump to itself, see chip8_jump_halts() */
+	C8_STUCK,	/* set by chip8_watchdog() */
+};
+
+/*
+ * A display row, bit 127 is x = 0. In low resolution only the top 64
+ * bits and the first LORES_HEIGHT rows are used.
+ */
+typedef unsigned __int128 fb_row_t;
+
+struct chip8_state {
+	uint8_t v[16];
+
+	uint16_t ip;
+	uint16_t mp;
+	int16_t sp;
+
+	uint8_t dt;
+	uint8_t st;
+
+	uint8_t key[16];
+
+	uint8_t fault;
+	uint8_t fb_dirty;
+	uint16_t fault_op;
+
+	uint8_t profile;
+	uint8_t hires;
+	uint8_t planes;		/* bitplanes selected by FN01 */
+	uint8_t pitch;
+
+	uint32_t rng;
+
+	uint16_t stack[STACK_DEPTH];
+	uint8_t flags[16];	/* FX75/FX85 */
+	uint8_t pattern[16];	/* F002 audio pattern */
+
+	fb_row_t fb[PLANES][SCREEN_HEIGHT];
+
+	/*
+	 * Memory, in pages that machines forked from each other share until
+	 * one of them writes: the first write to a page not in mem_private
+	 * copies it unless this machine holds its only reference. Read and
+	 * write it with chip8_peek() and chip8_poke().
+	 */
+	uint64_t mem_private;
+	uint8_t *page[MEM_PAGES];
+};
+
+/*
+ * An execution core runs up to n instructions and returns how many it
+ * executed; it returns early only when the machine faults. report, if
+ * set, prints core specific statistics. Cores that translate code can
+ * keep what they translated for a program in a directory: cache_open,
+ * if set, picks up what an earlier run of the program c8 has loaded
+ * left there and cache_save writes back what this thread translated.
+ * release, if set, frees what the core keeps for the calling thread;
+ * threads that ran the core call it before they exit.
+ */
+struct chip8_core {
+	const char *name;
+	unsigned (*run)(struct chip8_state *c8, unsigned n);
+	void (*report)(FILE *fp);
+	int (*cache_open)(const struct chip8_state *c8, const char *dir);
+	int (*cache_save)(int profile);
+	void (*release)(void);
+};
+
+extern const struct chip8_core chip8_cores[];
+
+const struct chip8_core *chip8_find_core(const char *name);
+
+void chip8_init(struct chip8_state *c8, uint32_t seed);
+void chip8_release(struct chip8_state *c8);
+void chip8_fork(struct chip8_state *dst, struct chip8_state *src);
+void chip8_own_page(struct chip8_state *c8, unsigned n);
+void chip8_read(const struct chip8_state *c8, unsigned addr, void *buf, size_t len);
+void chip8_write(struct chip8_state *c8, unsigned addr, const void *buf, size_t len);
+int chip8_mem_cmp_slow(const struct chip8_state *c8, unsigned addr, const void *buf, size_t len);
+uint64_t chip8_hash(const struct chip8_state *c8);
+uint64_t chip8_hash_output(const struct chip8_state *c8);
+uint64_t chip8_hash_mem(const struct chip8_state *c8);
+int chip8_find_profile(const char *name);
+const char *chip8_profile_name(int profile);
+int chip8_load(struct chip8_state *c8, const void *prog, size_t len);
+void chip8_load_prog(struct chip8_state *c8, const char *file);
+void chip8_tick(struct chip8_state *c8);
+
+/*
+ * Catches programs that are stuck without halting, waiting for a key
+ * that never comes or looping forever: zero it, set limit and call
+ * chip8_watchdog() once a frame.
+ */
+struct chip8_watchdog {
+	unsigned limit;		/* frames without progress to allow, 0 for no limit */
+	unsigned idle;
+	uint64_t hash;
+};
+
+int chip8_watchdog(struct chip8_watchdog *wd, struct chip8_state *c8);
+void chip8_dump(const struct chip8_state *c8);
+const char *chip8_fault_str(const struct chip8_state *c8);
+
+/* runtime shared by all cores */
+void chip8_clear_screen(struct chip8_state *c8);
+int chip8_draw(struct chip8_state *c8, uint8_t x, uint8_t y, uint8_t n);
+int chip8_draw_clip(struct chip8_state *c8, uint8_t x, uint8_t y, uint8_t n);
+int chip8_draw16(struct chip8_state *c8, uint8_t x, uint8_t y);
+int chip8_draw16_clip(struct chip8_state *c8, uint8_t x, uint8_t y);
+void chip8_set_hires(struct chip8_state *c8, int hires);
+void chip8_scroll_down(struct chip8_state *c8, unsigned n);
+void chip8_scroll_up(struct chip8_state *c8, unsigned n);
+void chip8_scroll_left(struct chip8_state *c8);
+void chip8_scroll_right(struct chip8_state *c8);
+uint8_t chip8_wait_input(struct chip8_state *c8);
+uint16_t chip8_rand16(struct chip8_state *c8);
+void chip8_sub_call(struct chip8_state *c8, uint16_t addr);
+void chip8_sub_return(struct chip8_state *c8);
+
+static inline uint8_t chip8_peek(const struct chip8_state *c8, unsigned addr)
+{
+	addr &= ADDR_MASK;
+	return c8->page[addr >> MEM_PAGE_SHIFT][addr & MEM_PAGE_MASK];
+}
+static inline void chip8_poke(struct chip8_state *c8, unsigned addr, uint8_t v)
+{
+	addr &= ADDR_MASK;
+	if (!((c8->mem_private >> (addr >> MEM_PAGE_SHIFT)) & 1))
+		chip8_own_page(c8, addr >> MEM_PAGE_SHIFT);
+	c8->page[addr >> MEM_PAGE_SHIFT][addr & MEM_PAGE_MASK] = v;
+}
+/* like memcmp(), against len bytes of memory from addr */
+static inline int chip8_mem_cmp(const struct chip8_state *c8, unsigned addr, const void *buf, size_t len)
+{
+	if ((addr & MEM_PAGE_MASK) + len <= MEM_PAGE_SIZE && addr + len <= MEM_SIZE)
+		return memcmp(&c8->page[addr >> MEM_PAGE_SHIFT][addr & MEM_PAGE_MASK], buf, len);
+	return chip8_mem_cmp_slow(c8, addr, buf, len);
+}
+static inline uint16_t chip8_fetch(const struct chip8_state *c8)
+{
+	unsigned ip = c8->ip & ADDR_MASK;
+	const uint8_t *p = &c8->page[ip >> MEM_PAGE_SHIFT][ip & MEM_PAGE_MASK];
+
+	if ((ip & MEM_PAGE_MASK) != MEM_PAGE_MASK)
+		return (p[0] << 8) | p[1];
+	return (p[0] << 8) | chip8_peek(c8, ip + 1);
+}
+/* bytes a taken skip jumps over: F000 NNNN is a single instruction on XO-CHIP */
+static inline uint16_t chip8_skip_size(const struct chip8_state *c8, const int q)
+{
+	if ((QUIRKS(q) & Q_XO) && chip8_peek(c8, c8->ip + 2) == 0xf0 &&
+			chip8_peek(c8, c8->ip + 3) == 0x00)
+		return 4;
+	return 2;
+}
+static inline void chip8_set_fault(struct chip8_state *c8, int fault, uint16_t op)
+{
+	c8->fault = fault;
+	c8->fault_op = op;
+}
+/*
+ * Whether jump op at ip halts the machine: it jumps to itself and no
+ * timer is running, so nothing it could observe will ever change.
+ */
+static inline int chip8_jump_halts(const struct chip8_state *c8, uint16_t op)
+{
+	return opNNN == c8->ip && !c8->dt && !c8->st;
+}
+
+/* COSMAC VIP timing, chip8vip.c */
+#define VIP_FRAME_CYCLES	3668	/* machine cycles in a 60 Hz frame */
+#define VIP_DISPLAY_CYCLES	1832	/* of those, taken by the display */
+
+/*
+ * Zero it and set vblank if draws should wait for the next frame, then
+ * run frames with chip8_vip_frame(). cycles counts the machine cycles
+ * of the instructions run, frames / 60 is the emulated time.
+ */
+struct chip8_vip {
+	int vblank;
+	int budget;		/* cycles left in the frame, negative after an overrun */
+	uint64_t cycles;
+	uint64_t frames;
+};
+
+unsigned chip8_vip_cycles(const struct chip8_state *c8, uint16_t op);
+unsigned chip8_vip_frame(struct chip8_vip *vip, struct chip8_state *c8, const struct chip8_core *core);
+
+/* instruction kinds, chip8_decode_table[op] */
+enum chip8_insn_kind {
+	I_BAD = 0,
+	I_CLS, I_RET, I_SCD, I_SCU, I_SCR, I_SCL, I_EXIT, I_LORES, I_HIRES, I_HLT,
+	I_JP, I_CALL, I_SE, I_SNE, I_SER, I_SAVE, I_RESTORE, I_LD, I_ADD,
+	I_MOV, I_OR, I_AND, I_XOR, I_ADDR, I_SUB, I_SHR, I_SUBN, I_SHL,
+	I_SNER, I_LDI, I_JP0, I_RND, I_DRW, I_SKP, I_SKNP,
+	I_LDI16, I_PLANE, I_AUDIO, I_LDDT, I_WAITK, I_SETDT, I_SETST, I_ADDI,
+	I_FONT, I_BIGFONT, I_BCD, I_PITCH, I_STORE, I_LOAD, I_SAVEFLAGS, I_LOADFLAGS,
+	I_NKINDS,
+};
+
+/* operand layouts, in chip8as order: A_NN_X is "add 5 v3" */
+enum {
+	A_NONE,
+	A_N,		/* 00CN */
+	A_NNN,
+	A_X,		/* a register */
+	A_N_X,		/* X as a number, FX55 is "store 3" */
+	A_NN_X,
+	A_X_NN,
+	A_X_Y,
+	A_Y_X,
+	A_X_Y_N,
+	A_NLAYOUTS,
+};
+
+#define IF_SKIP		0x01	/* skips the next instruction */
+
+struct chip8_insn {
+	const char *name;	/* chip8as mnemonic, NULL if it has none */
+	uint16_t op;		/* with the operands 0 */
+	uint8_t layout;
+	uint8_t quirks;		/* Q_HIRES or Q_XO if only those profiles have it */
+	uint8_t flags;
+};
+
+extern const uint8_t chip8_decode_table[0x10000];
+extern const struct chip8_insn chip8_insns[I_NKINDS];
+extern const uint16_t chip8_operand_mask[A_NLAYOUTS];
+
+/* kind of op in profile, I_BAD where the profile does not have it */
+static inline int chip8_insn_kind(uint16_t op, int profile)
+{
+	int kind = chip8_decode_table[op];
+
+	/* 00FF halts where it is not hires */
+	if (kind == I_HIRES && !(QUIRKS(profile) & Q_HIRES))
+		return I_HLT;
+	if (chip8_insns[kind].quirks & ~QUIRKS(profile))
+		return I_BAD;
+	return kind;
+}
+
+/* assembler library, chip8asm.c */
+
+/* part of the chip8as build cache key, bump when the same source assembles differently */
+#define CHIP8_ASM_VERSION	"4"
+
+/* first line of a relocatable module, chip8_asm_write_object() */
+#define CHIP8_OBJ_MAGIC		"c8obj 1"
+
+struct chip8_asm_diag {
+	int line;
+	char msg[96];
+};
+
+/*
+ * Assembler context. Feed it lines with chip8_asm_line() or a whole
+ * source with chip8_assemble(); code[0..len) is the program and diag[]
+ * lists the problems found, by line. Setting optimize after
+ * chip8_asm_init() runs the peephole pass, symbols keeps what
+ * chip8_asm_write_symbols() needs and relocatable makes a module for
+ * chip8_asm_write_object(). Members after relocatable are private.
+ */
+struct chip8_asm {
+	uint8_t *code;
+	size_t len, cap;
+	int lineno;
+	struct chip8_asm_diag *diag;
+	int ndiags;
+	int optimize;
+	int symbols;
+	int relocatable;
+
+	size_t diag_cap;
+	int fixed, overflow, line_failed;
+	struct c8asm_label *labels, *ltail, **lhash;
+	unsigned lhash_size, nlabels;
+	struct c8asm_fixup *fixups;
+	size_t nfixups, fixups_cap;
+	char **tok;
+	size_t tok_cap;
+	char *linebuf;
+	size_t linebuf_cap;
+	struct c8asm_label *ref;	/* label used by the current line */
+	int wflags;
+	struct c8asm_word *words;	/* with optimize, one per word of code */
+	size_t words_cap;
+	struct c8asm_macro *macros, *defining;
+	int nesting, depth;
+	unsigned expansions;
+	struct c8asm_section *sections;
+	size_t nsections, sections_cap;
+	struct c8asm_reloc *relocs;
+	size_t nrelocs, relocs_cap;
+};
+
+void chip8_asm_init(struct chip8_asm *as, uint8_t *buf, size_t cap);
+void chip8_asm_line(struct chip8_asm *as, char *line);
+int chip8_asm_finish(struct chip8_asm *as);
+int chip8_assemble(struct chip8_asm *as, const char *src, size_t len);
+void chip8_asm_free(struct chip8_asm *as);
+int chip8_asm_write_symbols(struct chip8_asm *as, FILE *fp, const char *src);
+int chip8_asm_write_object(struct chip8_asm *as, FILE *fp, const char *src);
+int chip8_load_source(struct chip8_state *c8, const char *file);
+
+/* debug symbols of the loaded program, chip8sym.c */
+int chip8_sym_load(const char *file);
+int chip8_sym_read(FILE *fp);
+void chip8_sym_clear(void);
+int chip8_sym_loaded(void);
+int chip8_sym_addr(const char *name);
+const char *chip8_sym_str(uint16_t addr, char *buf, size_t len);
+const char *chip8_sym_source(void);
+uint16_t chip8_sym_end(void);
+int chip8_sym_line(uint16_t addr);
+int chip8_sym_is_data(uint16_t addr);
+
+/*
+ * Instruction coverage, chip8cov.c: the cover core sets a bit per
+ * address an instruction ran at and, for skips, a bit for each way they
+ * went. Bits are only ever set, so machines on any number of threads can
+ * share the maps and runs merge by or-ing them.
+ */
+#define C8_COV_WORDS	(MEM_SIZE / 64)
+
+extern uint64_t chip8_cov_exec[C8_COV_WORDS];
+extern uint64_t chip8_cov_taken[C8_COV_WORDS];
+extern uint64_t chip8_cov_not_taken[C8_COV_WORDS];
+
+/* the atomic or only happens the first time, after that it is a load */
+static inline void chip8_cov_mark(uint64_t *map, unsigned addr)
+{
+	uint64_t bit = (uint64_t)1 << (addr & 63);
+
+	addr = (addr & ADDR_MASK) >> 6;
+	if (!(__atomic_load_n(&map[addr], __ATOMIC_RELAXED) & bit))
+		__atomic_fetch_or(&map[addr], bit, __ATOMIC_RELAXED);
+}
+
+void chip8_cov_clear(void);
+int chip8_cov_read(FILE *fp);
+int chip8_cov_load(const char *file);
+int chip8_cov_write(FILE *fp);
+int chip8_cov_save(const char *file);
+int chip8_cov_merge(const char *file);
+void chip8_cov_report(FILE *fp, const struct chip8_state *c8, uint16_t start, uint16_t end);
+
+/*
+ * Live metrics, chip8metrics.c: counters and latency histograms an
+ * emulator updates with relaxed atomics as it runs, read from any thread
+ * by chip8_metrics_write() in Prometheus text format and by
+ * chip8_metrics_summary(). An instance is registered under a name for
+ * as long as it is updated.
+ */
+#define C8_HIST_MIN	4	/* first bucket: under 2^4 us */
+#define C8_HIST_BUCKETS	18	/* up to 2^20 us, about a second, then the rest */
+
+struct chip8_hist {
+	uint64_t bucket[C8_HIST_BUCKETS];	/* not cumulative, the last one is +Inf */
+	uint64_t count;
+	uint64_t sum;			/* us */
+};
+
+struct chip8_metrics {
+	const char *name;
+	uint64_t insns;			/* instructions run */
+	uint64_t frames;		/* 60 Hz frames run */
+	uint64_t dropped;		/* frames run late, more than one frame behind */
+	uint64_t presents;		/* frames shown */
+	uint64_t resets;		/* machines reset */
+	struct chip8_hist frame;	/* wall time of a frame or, for environments, a step */
+	struct chip8_hist present;	/* time to show a frame */
+	struct chip8_hist poll;		/* time to poll input */
+	struct chip8_hist input;	/* key event to the next frame shown */
+
+	/* private */
+	struct chip8_metrics *next;
+	uint64_t last_insns, last_frames, last_time;
+};
+
+static inline void chip8_metrics_add(uint64_t *counter, uint64_t n)
+{
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+static inline void chip8_hist_add(struct chip8_hist *h, uint64_t us)
+{
+	int b = us >> C8_HIST_MIN ? 64 - C8_HIST_MIN - __builtin_clzll(us) : 0;
+
+	if (b >= C8_HIST_BUCKETS)
+		b = C8_HIST_BUCKETS - 1;
+	__atomic_fetch_add(&h->bucket[b], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum, us, __ATOMIC_RELAXED);
+}
+
+uint64_t chip8_metrics_now(void);
+void chip8_metrics_register(struct chip8_metrics *m, const char *name);
+void chip8_metrics_unregister(struct chip8_metrics *m);
+int chip8_metrics_write(FILE *fp);
+void chip8_metrics_summary(FILE *fp);
+int chip8_metrics_serve(const char *path, unsigned summary_secs);
+
+/* vectorised environments for batch stepping, chip8env.c */
+#define C8_OBS_BITS	0	/* a bit per pixel, MSB leftmost, rows of bytes, plane after plane */
+#define C8_OBS_BYTES	1	/* a byte per pixel holding its plane bits */
+#define C8_ENV_V(x)	(MEM_SIZE + (x))	/* a reward read from VX rather than memory */
+
+/*
+ * The display observed is 64x32 or, for profiles with high resolution,
+ * 128x64 with a low resolution picture in its top left quarter. XO-CHIP
+ * observes both bitplanes.
+ */
+struct chip8_env_config {
+	int profile;
+	const struct chip8_core *core;	/* NULL for the switch core */
+	unsigned insns_per_frame;	/* 0 for 10 */
+	int obs;			/* C8_OBS_BITS or C8_OBS_BYTES */
+	const uint32_t *reward;		/* bytes reported after each step: addresses or C8_ENV_V() */
+	unsigned nreward;
+	unsigned threads;		/* 0 or 1 steps on the caller's thread only */
+	uint32_t seed;
+	unsigned watchdog;		/* frames without progress that end an episode, 0 never */
+	int vip_timing;			/* 1: frames are VIP frames, chip8_vip_frame(), not insns_per_frame;
+					   2: and draws wait for the next frame */
+	const char *cache_dir;		/* for the core's translations, see struct chip8_core */
+	const char *metrics;		/* registers the environment's metrics under this name */
+};
+
+struct chip8_env;
+
+struct chip8_env *chip8_env_new(unsigned n, const void *rom, size_t len, const struct chip8_env_config *cfg);
+void chip8_env_free(struct chip8_env *env);
+size_t chip8_env_obs_size(const struct chip8_env *env);
+uint64_t chip8_env_cycles(const struct chip8_env *env, uint64_t *frames);
+struct chip8_state *chip8_env_machine(struct chip8_env *env, unsigned i);
+void chip8_env_set_snapshot(struct chip8_env *env, struct chip8_state *c8);
+void chip8_env_step(struct chip8_env *env, const uint16_t *keys, uint8_t *obs, uint8_t *reward, uint8_t *done);
+void chip8_env_reset(struct chip8_env *env, const uint8_t *which, uint8_t *obs);
+
+/* SDL frontend, chip8sdl.c */
+void chip8_sdl_run(struct chip8_state *c8, const struct chip8_core *core, unsigned watchdog,
+		struct chip8_vip *vip);
+
+unsigned chip8_run_optables(struct chip8_state *c8, unsigned n);
+unsigned chip8_run_switch(struct chip8_state *c8, unsigned n);
+unsigned chip8_run_cover(struct chip8_state *c8, unsigned n);
+unsigned chip8_run_fused(struct chip8_state *c8, unsigned n);
+void chip8_fused_report(FILE *fp);
+int chip8_fused_open(const struct chip8_state *c8, const char *dir);
+int chip8_fused_save(int profile);
+void chip8_fused_release(void);
+
+#endif
@@ -0,0 +1,498 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "chip8.h"
+
+/*
+ * Ahead-of-time recompiler: walks the control flow of a ROM from
+ * PROGRAM_MEM, splits it into basic blocks at jump, call and skip targets
+ * and writes C with one label per block. The generated core checks each
+ * block against the ROM bytes it was compiled from before running it, so
+ * self-modified code, computed BNNN jumps and anything that was not
+ * reached statically fall back to the reference interpreter.
+ */
+
+#define F_CODE		1	/* translated instruction starts here */
+#define F_LEADER	2	/* a basic block starts here */
+
+static int profile = C8_MODERN;
+static uint8_t rom[MEM_SIZE];
+static size_t rom_len;
+static uint8_t flags[MEM_SIZE];
+static uint16_t worklist[MEM_SIZE];
+static int nwork;
+
+static int in_rom(unsigned addr)
+{
+	return addr >= PROGRAM_MEM && addr + 1 < PROGRAM_MEM + rom_len;
+}
+static uint16_t rom_op(unsigned addr)
+{
+	return (rom[addr - PROGRAM_MEM] << 8) | rom[addr - PROGRAM_MEM + 1];
+}
+static int is_skip(uint16_t op)
+{
+	return chip8_insns[chip8_decode_table[op]].flags & IF_SKIP;
+}
+/* instructions that are left to the interpreter */
+static int is_translatable(uint16_t op)
+{
+	switch (chip8_insn_kind(op, profile)) {
+		case I_BAD:
+		case I_EXIT:
+		case I_HLT:
+		case I_JP0:
+		case I_WAITK:
+		case I_LDI16:
+			return 0;
+	}
+	return 1;
+}
+/* stores end their block so code they overwrite is checked again */
+static int is_store(uint16_t op)
+{
+	if (opC == 0x5)
+		return opN == 2;
+	return opC == 0xf && (opNN == 0x33 || opNN == 0x55);
+}
+static int translatable_at(unsigned addr)
+{
+	uint16_t op = rom_op(addr);
+
+	if (!is_translatable(op))
+		return 0;
+	/* may halt, chip8_jump_halts() */
+	if (opC == 0x1 && opNNN == addr)
+		return 0;
+	/*
+	 * On XO-CHIP a skip over F000 NNNN jumps 4 bytes, so skips are only
+	 * translated when the next word is known and is not F000.
+	 */
+	if ((QUIRKS(profile) & Q_XO) && is_skip(op))
+		return in_rom(addr + 2) && rom_op(addr + 2) != 0xf000;
+	return 1;
+}
+
+static void add_leader(unsigned addr)
+{
+	addr &= ADDR_MASK;
+	if (!in_rom(addr) || (flags[addr] & F_LEADER))
+		return;
+	flags[addr] |= F_LEADER;
+	worklist[nwork++] = addr;
+}
+/* mark everything reachable from the leaders in the worklist */
+static void explore(void)
+{
+	unsigned addr;
+	uint16_t op;
+
+	while (nwork) {
+		addr = worklist[--nwork];
+		while (in_rom(addr) && !(flags[addr] & F_CODE)) {
+			op = rom_op(addr);
+			if (!translatable_at(addr)) {
+				/* the interpreter runs these, translated code goes on after them */
+				if (op == 0xf000 && (QUIRKS(profile) & Q_XO))
+					add_leader(addr + 4);
+				else if (opC == 0xf && opNN == 0x0a)
+					add_leader(addr + 2);
+				else if (is_skip(op)) {
+					add_leader(addr + 2);
+					add_leader(addr + 4);
+					add_leader(addr + 6);
+				}
+				break;
+			}
+			flags[addr] |= F_CODE;
+			if (is_skip(op)) {
+				add_leader(addr + 2);
+				add_leader(addr + 4);
+				break;
+			}
+			if (opC == 0x1) {
+				add_leader(opNNN);
+				break;
+			}
+			if (opC == 0x2) {
+				add_leader(opNNN);
+				add_leader(addr + 2);
+				break;
+			}
+			if (op == 0x00ee)
+				break;
+			if (is_store(op)) {
+				add_leader(addr + 2);
+				break;
+			}
+			addr += 2;
+		}
+	}
+}
+
+static int is_block(unsigned addr)
+{
+	addr &= ADDR_MASK;
+	return in_rom(addr) && (flags[addr] & (F_LEADER | F_CODE)) == (F_LEADER | F_CODE);
+}
+/* leave the block and continue at addr */
+static void emit_goto(FILE *fp, unsigned addr)
+{
+	if (is_block(addr))
+		fprintf(fp, "\tc8->ip = 0x%03x; goto B_%03x;\n", addr & ADDR_MASK, addr & ADDR_MASK);
+	else
+		fprintf(fp, "\tc8->ip = 0x%03x; goto dispatch;\n", addr);
+}
+static void emit_skip(FILE *fp, unsigned addr, const char *cond)
+{
+	fprintf(fp, "\tif (%s) {\n\t", cond);
+	emit_goto(fp, addr + 4);
+	fprintf(fp, "\t}\n");
+	emit_goto(fp, addr + 2);
+}
+static void emit_alu(FILE *fp, uint16_t op)
+{
+	unsigned x = opX, y = opY;
+	int q = QUIRKS(profile);
+
+	if ((q & Q_VF_RESET) && opN >= 1 && opN <= 3) {
+		fprintf(fp, "\tv[%u] %s= v[%u];\n\tv[15] = 0;\n", x, opN == 1 ? "|" : opN == 2 ? "&" : "^", y);
+		return;
+	}
+	if ((q & Q_SHIFT_VY) && (opN == 6 || opN == 0xe)) {
+		if (opN == 6)
+			fprintf(fp, "\t{\n\t\tuint8_t src = v[%u];\n\t\tv[%u] = src >> 1;\n\t\tv[15] = src & 0x1;\n\t}\n", y, x);
+		else
+			fprintf(fp, "\t{\n\t\tuint8_t src = v[%u];\n\t\tv[%u] = src << 1;\n\t\tv[15] = (src & 0x80) >> 7;\n\t}\n", y, x);
+		return;
+	}
+
+	switch (opN) {
+		case 0:
+			fprintf(fp, "\tv[%u] = v[%u];\n", x, y);
+			break;
+		case 1:
+			fprintf(fp, "\tv[%u] |= v[%u];\n", x, y);
+			break;
+		case 2:
+			fprintf(fp, "\tv[%u] &= v[%u];\n", x, y);
+			break;
+		case 3:
+			fprintf(fp, "\tv[%u] ^= v[%u];\n", x, y);
+			break;
+		case 4:
+			fprintf(fp, "\tv[%u] += v[%u];\n\tv[15] = v[%u] < v[%u];\n", x, y, x, y);
+			break;
+		case 5:
+			fprintf(fp, "\tv[15] = v[%u] < v[%u];\n\tv[%u] -= v[%u];\n", x, y, x, y);
+			break;
+		case 6:
+			fprintf(fp, "\tv[15] = v[%u] & 0x1;\n\tv[%u] >>= 1;\n", x, x);
+			break;
+		case 7:
+			fprintf(fp, "\tv[15] = v[%u] < v[%u];\n\tv[%u] = v[%u] - v[%u];\n", y, x, x, y, x);
+			break;
+		case 0xe:
+			fprintf(fp, "\tv[15] = (v[%u] & 0x80) >> 7;\n\tv[%u] <<= 1;\n", x, x);
+			break;
+	}
+}
+static void emit_misc(FILE *fp, uint16_t op)
+{
+	unsigned x = opX;
+
+	switch (opNN) {
+		case 0x07:
+			fprintf(fp, "\tv[%u] = c8->dt;\n", x);
+			break;
+		case 0x15:
+			fprintf(fp, "\tc8->dt = v[%u];\n", x);
+			break;
+		case 0x18:
+			fprintf(fp, "\tc8->st = v[%u];\n", x);
+			break;
+		case 0x1e:
+			fprintf(fp, "\tc8->mp += v[%u];\n", x);
+			break;
+		case 0x29:
+			fprintf(fp, "\tc8->mp = v[%u] * 5;\n", x);
+			break;
+		case 0x30:
+			fprintf(fp, "\tc8->mp = BIGFONT_MEM + v[%u] * 10;\n", x);
+			break;
+		case 0x01:
+			fprintf(fp, "\tc8->planes = %u;\n", x);
+			break;
+		case 0x02:
+			fprintf(fp, "\tfor (int j = 0; j < 16; j++)\n\t\tc8->pattern[j] = chip8_peek(c8, c8->mp + j);\n");
+			break;
+		case 0x3a:
+			fprintf(fp, "\tc8->pitch = v[%u];\n", x);
+			break;
+		case 0x75:
+			fprintf(fp, "\tmemcpy(c8->flags, v, %u);\n", x + 1);
+			break;
+		case 0x85:
+			fprintf(fp, "\tmemcpy(v, c8->flags, %u);\n", x + 1);
+			break;
+		case 0x33:
+			fprintf(fp, "\tchip8_poke(c8, c8->mp, v[%u] / 100);\n", x);
+			fprintf(fp, "\tchip8_poke(c8, c8->mp + 1, (v[%u] %% 100) / 10);\n", x);
+			fprintf(fp, "\tchip8_poke(c8, c8->mp + 2, v[%u] %% 10);\n", x);
+			break;
+		case 0x55:
+			fprintf(fp, "\tfor (int j = 0; j <= %u; j++)\n\t\tchip8_poke(c8, c8->mp + j, v[j]);\n", x);
+			if (QUIRKS(profile) & Q_MEM_INC)
+				fprintf(fp, "\tc8->mp += %u;\n", x + 1);
+			break;
+		case 0x65:
+			fprintf(fp, "\tfor (int j = 0; j <= %u; j++)\n\t\tv[j] = chip8_peek(c8, c8->mp + j);\n", x);
+			if (QUIRKS(profile) & Q_MEM_INC)
+				fprintf(fp, "\tc8->mp += %u;\n", x + 1);
+			break;
+	}
+}
+/* SUPER-CHIP and XO-CHIP scrolling and resolution changes */
+static void emit_display(FILE *fp, uint16_t op)
+{
+	if ((op & 0xfff0) == 0x00c0)
+		fprintf(fp, "\tchip8_scroll_down(c8, %u);\n", opN);
+	else if ((op & 0xfff0) == 0x00d0)
+		fprintf(fp, "\tchip8_scroll_up(c8, %u);\n", opN);
+	else if (op == 0x00fb)
+		fprintf(fp, "\tchip8_scroll_right(c8);\n");
+	else if (op == 0x00fc)
+		fprintf(fp, "\tchip8_scroll_left(c8);\n");
+	else
+		fprintf(fp, "\tchip8_set_hires(c8, %u);\n", op & 1);
+}
+/* XO-CHIP 5XY2/5XY3, unrolled since the register range is known */
+static void emit_save_load(FILE *fp, uint16_t op)
+{
+	int d = opX <= opY ? 1 : -1;
+	int r, i;
+
+	for (i = 0, r = opX; r != opY + d; i++, r += d) {
+		if (opN == 2)
+			fprintf(fp, "\tchip8_poke(c8, c8->mp + %d, v[%d]);\n", i, r);
+		else
+			fprintf(fp, "\tv[%d] = chip8_peek(c8, c8->mp + %d);\n", r, i);
+	}
+}
+/* emit the instruction at addr, returns 1 if it ends the block */
+static int emit_insn(FILE *fp, unsigned addr, uint16_t op)
+{
+	char cond[64];
+
+	fprintf(fp, "\t/* %03x: %04x */\n", addr, op);
+	switch (opC) {
+		case 0x0:
+			if (op == 0x00e0) {
+				fprintf(fp, "\tchip8_clear_screen(c8);\n");
+				return 0;
+			}
+			if (op != 0x00ee) {
+				emit_display(fp, op);
+				return 0;
+			}
+			fprintf(fp, "\tc8->ip = 0x%03x;\n\tchip8_sub_return(c8);\n\tif (c8->fault)\n\t\treturn i;\n\tgoto dispatch;\n",
+				addr);
+			return 1;
+		case 0x1:
+			emit_goto(fp, opNNN);
+			return 1;
+		case 0x2:
+			fprintf(fp, "\tc8->ip = 0x%03x;\n\tchip8_sub_call(c8, 0x%03x);\n\tif (c8->fault)\n\t\treturn i;\n",
+				addr, opNNN);
+			emit_goto(fp, opNNN);
+			return 1;
+		case 0x3:
+			snprintf(cond, sizeof(cond), "v[%u] == 0x%02x", opX, opNN);
+			emit_skip(fp, addr, cond);
+			return 1;
+		case 0x4:
+			snprintf(cond, sizeof(cond), "v[%u] != 0x%02x", opX, opNN);
+			emit_skip(fp, addr, cond);
+			return 1;
+		case 0x5:
+			if (opN) {
+				emit_save_load(fp, op);
+				return 0;
+			}
+			snprintf(cond, sizeof(cond), "v[%u] == v[%u]", opX, opY);
+			emit_skip(fp, addr, cond);
+			return 1;
+		case 0x6:
+			fprintf(fp, "\tv[%u] = 0x%02x;\n", opX, opNN);
+			return 0;
+		case 0x7:
+			fprintf(fp, "\tv[%u] += 0x%02x;\n", opX, opNN);
+			return 0;
+		case 0x8:
+			emit_alu(fp, op);
+			return 0;
+		case 0x9:
+			snprintf(cond, sizeof(cond), "v[%u] != v[%u]", opX, opY);
+			emit_skip(fp, addr, cond);
+			return 1;
+		case 0xa:
+			fprintf(fp, "\tc8->mp = 0x%03x;\n", opNNN);
+			return 0;
+		case 0xc:
+			fprintf(fp, "\tv[%u] = 0x%02x & chip8_rand16(c8);\n", opX, opNN);
+			return 0;
+		case 0xd:
+			if ((QUIRKS(profile) & Q_HIRES) && opN == 0) {
+				fprintf(fp, "\tv[15] = chip8_draw16%s(c8, v[%u], v[%u]);\n",
+					QUIRKS(profile) & Q_CLIP ? "_clip" : "", opX, opY);
+				return 0;
+			}
+			fprintf(fp, "\tv[15] = chip8_draw%s(c8, v[%u], v[%u], %u);\n",
+				QUIRKS(profile) & Q_CLIP ? "_clip" : "", opX, opY, opN);
+			return 0;
+		case 0xe:
+			snprintf(cond, sizeof(cond), "%sc8->key[v[%u] & 0xf]", opNN == 0x9e ? "" : "!", opX);
+			emit_skip(fp, addr, cond);
+			return 1;
+		case 0xf:
+			emit_misc(fp, op);
+			return 0;
+	}
+	return 1;
+}
+static unsigned block_len(unsigned addr)
+{
+	unsigned n = 0;
+	uint16_t op;
+
+	do {
+		op = rom_op(addr);
+		if (!translatable_at(addr))
+			break;
+		n++;
+		if (is_skip(op) || opC == 0x1 || opC == 0x2 || op == 0x00ee || is_store(op))
+			break;
+		addr += 2;
+	} while (in_rom(addr) && !(flags[addr] & F_LEADER) && (flags[addr] & F_CODE));
+	return n;
+}
+static void emit_block(FILE *fp, unsigned addr)
+{
+	unsigned n = block_len(addr);
+	unsigned check = 2 * n;
+	uint16_t op;
+
+	/* an XO-CHIP skip depends on the word after it too */
+	if ((QUIRKS(profile) & Q_XO) && is_skip(rom_op(addr + 2 * (n - 1))))
+		check += 2;
+	fprintf(fp, "B_%03x:\n", addr);
+	fprintf(fp, "\tif (n - i < %u || chip8_mem_cmp(c8, 0x%03x, &c8aot_rom[0x%03x], %u))\n\t\tgoto interp;\n",
+		n, addr, addr - PROGRAM_MEM, check);
+	fprintf(fp, "\ti += %u;\n", n);
+	while (n--) {
+		op = rom_op(addr);
+		if (emit_insn(fp, addr, op))
+			return;
+		addr += 2;
+		if (is_store(op))
+			break;
+	}
+	emit_goto(fp, addr);
+}
+
+static void emit(FILE *fp, const char *name)
+{
+	unsigned addr;
+	size_t i;
+
+	fprintf(fp, "/* generated by c8aot from %s for the %s profile, do not edit */\n",
+		name, chip8_profile_name(profile));
+	fprintf(fp, "#include <stdio.h>\n#include <stdlib.h>\n#include <string.h>\n#include <stdint.h>\n#include <time.h>\n\n");
+	fprintf(fp, "#include \"chip8.h\"\n\n");
+
+	fprintf(fp, "static const uint8_t c8aot_rom[%zu] = {", rom_len);
+	for (i = 0; i < rom_len; i++)
+		fprintf(fp, "%s0x%02x,", i % 12 ? " " : "\n\t", rom[i]);
+	fprintf(fp, "\n};\n\n");
+
+	fprintf(fp, "unsigned c8aot_run(struct chip8_state *c8, unsigned n)\n{\n");
+	fprintf(fp, "\tunsigned i = 0;\n\tuint8_t *v = c8->v;\n\n");
+	fprintf(fp, "dispatch:\n\tif (i >= n || c8->fault)\n\t\treturn i;\n\tswitch (c8->ip) {\n");
+	for (addr = PROGRAM_MEM; addr < MEM_SIZE; addr++) {
+		if (is_block(addr))
+			fprintf(fp, "\t\tcase 0x%03x: goto B_%03x;\n", addr, addr);
+	}
+	fprintf(fp, "\t}\ninterp:\n\tif (i >= n)\n\t\treturn i;\n\ti += chip8_run_optables(c8, 1);\n\tgoto dispatch;\n\n");
+	for (addr = PROGRAM_MEM; addr < MEM_SIZE; addr++) {
+		if (is_block(addr))
+			emit_block(fp, addr);
+	}
+	fprintf(fp, "}\n\n");
+
+	fprintf(fp, "#ifndef C8AOT_NO_MAIN\n");
+	fprintf(fp, "int main(int argc, char **argv)\n{\n");
+	fprintf(fp, "\tstatic struct chip8_state c8;\n");
+	fprintf(fp, "\tstatic const struct chip8_core core = {\"aot\", c8aot_run};\n\n");
+	fprintf(fp, "\tchip8_init(&c8, time(NULL));\n");
+	fprintf(fp, "\tc8.profile = %d;\n", profile);
+	fprintf(fp, "\tchip8_load(&c8, c8aot_rom, sizeof(c8aot_rom));\n");
+	fprintf(fp, "\tchip8_sdl_run(&c8, &core, 0, NULL);\n\n\treturn 0;\n}\n#endif\n");
+}
+
+static void usage(void)
+{
+	die("usage: c8aot [-q profile] [-o out.c] romfile\n");
+}
+int main(int argc, char **argv)
+{
+	const char *out = NULL;
+	FILE *fp;
+	unsigned addr, blocks = 0, insns = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "q:o:")) != -1) {
+		switch (opt) {
+			case 'q':
+				profile = chip8_find_profile(optarg);
+				if (profile < 0)
+					die("unknown profile: %s\n", optarg);
+				break;
+			case 'o':
+				out = optarg;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+
+	fp = fopen(argv[optind], "rb");
+	if (!fp)
+		die("cannot open %s\n", argv[optind]);
+	rom_len = fread(rom, 1, MEM_SIZE - PROGRAM_MEM, fp);
+	fclose(fp);
+
+	flags[PROGRAM_MEM] |= F_LEADER;
+	worklist[nwork++] = PROGRAM_MEM;
+	explore();
+
+	fp = out ? fopen(out, "w") : stdout;
+	if (!fp)
+		die("cannot open %s\n", out);
+	emit(fp, argv[optind]);
+	if (out)
+		fclose(fp);
+
+	for (addr = PROGRAM_MEM; addr < MEM_SIZE; addr++) {
+		if (is_block(addr))
+			blocks++;
+		if (flags[addr] & F_CODE)
+			insns++;
+	}
+	fprintf(stderr, "%s: %u blocks, %u instructions translated\n", argv[optind], blocks, insns);
+	return 0;
+}
@@ -3,659 +3,491 @@
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
-#include <arpa/inet.h>
-
-/* only support lower case */
-
-typedef uint16_t	u16;
-typedef uint8_t		u8;
-
-#define die(fmt, args...) do { fprintf(stderr, fmt, ##args); exit(1); } while(0)
-
-struct elem {
-	char *str;
-	struct elem *next;
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "chip8.h"
+
+/*
+ * Command line front end to the assembler library in chip8asm.c.
+ *
+ * Given several sources it builds them in parallel on a pool of threads.
+ * Built ROMs are kept in a cache directory under a hash of the source
+ * and the assembler version, so sources that did not change are copied
+ * from the cache instead of being assembled again, and outputs that
+ * already hold the right bytes are not rewritten at all. With -g the
+ * debug symbols go to <out>.sym and are cached alongside. With -c each
+ * source becomes a relocatable module, <src>.obj, for chip8ld.
+ */
+
+#define CACHE_DIR	".c8cache"
+
+/* one source to build, filled in by whichever worker picks it up */
+struct job {
+	const char *src;
+	char *out;
+	struct chip8_asm as;
+	int failed;
+	int cached;	/* ROM came from the cache */
+	int unchanged;	/* output already up to date */
+	char err[128];	/* I/O trouble, diagnostics are in as.diag */
+	double ms;
 };
 
-typedef u16 (*op_fun_t) (struct elem *);
-
-struct op {
-	const char *name;
-	op_fun_t fun;
-};
+static struct job *jobs;
+static int njobs;
+static int next_job;	/* handed out with __atomic_fetch_add */
+static const char *cache_dir;
+static int optimize;
+static int symbols;
+static int object;
 
-struct label {
-	char *str;
-	u16 insn;
-	u16 lineno;
-	struct label *next;
-};
-struct label *ltable;
-
-static int is_raw_label(const char *str)
+static double now_ms(void)
 {
-	if (!strncasecmp(str, "L_", 2) && str[strlen(str)-1] == ':')
-		return 1;
-	return 0;
-}
-static int is_cooked_label(const char *str)
-{
-	if (!strncasecmp(str, "L_", 2))
-		return 1;
-	return 0;
-}
-static void add_label(const char *str, int lineno, int insno)
-{
-	struct label *lbl, *head;
-
-	lbl = (struct label *)malloc(sizeof(*lbl));
-	assert(lbl);
-	/* strip ':' */
-	lbl->str = strndup(str, strlen(str)-1);
-	assert(lbl->str);
-	lbl->insn = insno;
-	lbl->lineno = lineno;
-	lbl->next = NULL;
-	if (!ltable) {
-		ltable = lbl;
-	} else {
-		head = ltable;
-		while (head->next) {
-			head = head->next;
-		}
-		head->next = lbl;
-	}
-}
-static void dump_ltable()
-{
-	struct label *head;
+	struct timespec ts;
 
-	head = ltable;
-	while (head) {
-		printf("label: str %s insn 0x%x line %d\n", head->str, head->insn, head->lineno);
-		head = head->next;
-	}
-}
-static void free_ltable()
-{
-	struct label *lbl, *head;
-
-	head = ltable;
-	ltable = NULL;
-	while (head) {
-		lbl = head->next;
-		free(head->str);
-		free(head);
-		head = lbl;
-	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
 }
 
-static int is_register(const char *str)
-{
-	assert(str);
-	if (strlen(str) != 2)
-		return 0;
-	if (str[0] != 'v')
-		return 0;
-	if ((str[1] >= '0' && str[1] <= '9') || (str[1] >= 'a' && str[1] <= 'f'))
-		return 1;
-	return 0;
-}
-/* FIXME */
-static int is_int(const char *str)
-{
-	if (isdigit(str[0]))
-		return 1;
-	return 0;
-}
-/* FIXME */
-static unsigned get_int(const char *str)
+/* "-" is stdout, no name means <src>.rom, or <src>.obj for a module */
+static char *out_name(const char *src, const char *out)
 {
-	assert(str);
-	return strtoul(str, NULL, 0);
-}
-static int get_reg(const char *str)
-{
-	assert(str);
-	if (isdigit(str[1]))
-		return (str[1] - '0');
-	else
-		return (str[1] - 'a' + 10);
-}
-static unsigned get_insn(const char *str)
-{
-	struct label *head;
+	const char *ext = object ? ".obj" : ".rom";
+	char *fout;
+	size_t len;
 
-	head = ltable;
-	while (head) {
-		if (!strcmp(str, head->str))
-			return head->insn;
-		head = head->next;
-	}
-	die("undefined label: %s", str);
-}
-static unsigned get_address(const char *str)
-{
-	if (is_int(str)) {
-		return get_int(str);
-	} else if (is_cooked_label(str)) {
-		//printf("lable %s resolved: %d\n", str, get_insn(str));
-		return get_insn(str);
-	} else
-		die("bad jmp/call target: %s\n", str);
-}
-static u16 make2(int op, int arg)
-{
-	u16 res;
-	arg &= 0x0fff;
-	res = op;
-	res = (res << 4) | (arg >> 8);
-	res = (res << 8) | (arg & 0x0ff);
-	return htons(res);
-}
-static u16 make3(int op, int arg1, int arg2)
-{
-	u16 res;
-	res = op;
-	res = (res << 4) | arg1;
-	res = (res << 8) | arg2;
-	return htons(res);
-}
-static u16 make4(int op, int arg1, int arg2, int arg3)
-{
-	u16 res;
-	res = op;
-	res = (res << 4) | arg1;
-	res = (res << 8) | ((arg2 << 4) | arg3);
-	return htons(res);
-}
-static u16 make_bytes(int arg1, int arg2)
-{
-	u16 res;
-	res = arg1;
-	res = (res << 8) | arg2;
-	return htons(res);
-}
-u16 do_add(struct elem *e)
-{
-	char *arg1, *arg2;
-	u8 v1, v2;
-
-	arg1 = e->str;
-	arg2 = e->next->str;
-	assert(e->next->next == NULL);
-	assert(is_register(arg2));
-	v2 = get_reg(arg2);
-	if (!is_register(arg1)) {
-		v1 = get_int(arg1);
-		return make3(7, v2, v1);
-	} else {
-		v1 = get_reg(arg1);
-		return make4(8, v2, v1, 4);
-	}
-}
-u16 do_and(struct elem *e)
-{
-	char *arg1, *arg2;
-	u8 v1, v2;
-
-	arg1 = e->str;
-	arg2 = e->next->str;
-	assert(e->next->next == NULL);
-	assert(is_register(arg1));
-	assert(is_register(arg2));
-	v1 = get_reg(arg1);
-	v2 = get_reg(arg2);
-	return make4(8, v2, v1, 2);
-}
-u16 do_or(struct elem *e)
-{
-	char *arg1, *arg2;
-	arg1 = e->str;
-	arg2 = e->next->str;
-	assert(e->next->next == NULL);
-	assert(is_register(arg1));
-	assert(is_register(arg2));
-	return make4(8, get_reg(arg2), get_reg(arg1), 1);
-}
-u16 do_xor(struct elem *e)
-{
-	char *arg1, *arg2;
-	arg1 = e->str;
-	arg2 = e->next->str;
-	assert(e->next->next == NULL);
-	assert(is_register(arg1));
-	assert(is_register(arg2));
-	return make4(8, get_reg(arg2), get_reg(arg1), 3);
-}
-u16 do_cs(struct elem *e)
-{
-	assert(e == NULL);
-	return make4(0, 0, 0xe, 0);
-}
-u16 do_j(struct elem *e)
-{
-	assert(e->next == NULL);
-	assert(!is_register(e->str));
-	return make2(1, get_address(e->str));
-}
-u16 do_j0(struct elem *e)
-{
-	assert(e->next == NULL);
-	assert(!is_register(e->str));
-	return make2(0xb, get_address(e->str));
-}
-u16 do_je(struct elem *e)
-{
-	char *arg1, *arg2;
-
-	arg1 = e->str;
-	arg2 = e->next->str;
-	assert(e->next->next == NULL);
-	if (is_register(arg1)) {
-		if (is_register(arg2)) {
-			return make4(5, get_reg(arg1), get_reg(arg2), 0);
-		} else {
-			return make3(3, get_reg(arg1), get_int(arg2));
-		}
-	} else {
-		assert(is_register(arg2));
-		return make3(3, get_reg(arg2), get_int(arg1));
-	}
-}
-u16 do_jne(struct elem *e)
-{
-	char *arg1, *arg2;
-
-	arg1 = e->str;
-	arg2 = e->next->str;
-	assert(e->next->next == NULL);
-	if (is_register(arg1)) {
-		if (is_register(arg2)) {
-			return make4(9, get_reg(arg1), get_reg(arg2), 0);
-		} else {
-			return make3(4, get_reg(arg1), get_int(arg2));
+	if (out)
+		return strdup(out);
+	len = strlen(src) + strlen(ext) + 1;
+	fout = (char *)malloc(len);
+	if (fout)
+		snprintf(fout, len, "%s%s", src, ext);
+	return fout;
+}
+/* symbols of out go to <out>.sym */
+static char *sym_name(const char *out)
+{
+	size_t len = strlen(out) + strlen(".sym") + 1;
+	char *name = (char *)malloc(len);
+
+	if (name)
+		snprintf(name, len, "%s.sym", out);
+	return name;
+}
+/* pipes and terminals are read a line at a time, lines of any length */
+static int assemble_stream(struct chip8_asm *as, FILE *fp)
+{
+	char *line = NULL;
+	size_t cap = 0;
+
+	while (getline(&line, &cap, fp) != -1)
+		chip8_asm_line(as, line);
+	free(line);
+	return ferror(fp) ? -1 : 0;
+}
+/*
+ * Regular files are mapped privately and assembled in place: the lexer
+ * only writes the pages of the lines it splits, newlines become
+ * terminators.
+ */
+static void assemble_mapped(struct chip8_asm *as, char *buf, size_t len)
+{
+	char *p = buf, *end = buf + len, *nl, *last;
+
+	while (p < end) {
+		nl = memchr(p, '\n', end - p);
+		if (!nl) {
+			/* no room for a terminator after an unfinished last line */
+			last = strndup(p, end - p);
+			if (!last) {
+				/* copies the line itself, or records running out */
+				chip8_assemble(as, p, end - p);
+				break;
+			}
+			chip8_asm_line(as, last);
+			free(last);
+			break;
 		}
-	} else {
-		assert(is_register(arg2));
-		return make3(4, get_reg(arg2), get_int(arg1));
+		*nl = '\0';
+		chip8_asm_line(as, p);
+		p = nl + 1;
 	}
 }
-u16 do_jk(struct elem *e)
-{
-	assert(e->next == NULL);
-	assert(is_register(e->str));
-	return make3(0xe, get_reg(e->str), 0x9e);
-}
-u16 do_jnk(struct elem *e)
-{
-	assert(e->next == NULL);
-	assert(is_register(e->str));
-	return make3(0xe, get_reg(e->str), 0xa1);
-}
-u16 do_wait(struct elem *e)
-{
-	assert(e->next == NULL);
-	assert(is_register(e->str));
-	return make3(0xf, get_reg(e->str), 0x0a);
-}
-u16 do_call(struct elem *e)
-{
-	assert(e->next == NULL);
-	assert(!is_register(e->str));
-	return make2(2, get_address(e->str));
-}
-u16 do_ret(struct elem *e)
-{
-	assert(e == NULL);
-	return make4(0, 0, 0xe, 0xe);
-}
-u16 do_bcd(struct elem *e)
-{
-	assert(e->next == NULL);
-	assert(is_register(e->str));
-	return make3(0xf, get_reg(e->str), 0x33);
-}
-u16 do_mov(struct elem *e)
-{
-	char *arg1, *arg2;
-	arg1 = e->str;
-	arg2 = e->next->str;
-	assert(e->next->next == NULL);
-	assert(is_register(arg2));
-	if (is_register(arg1)) {
-		return make4(8, get_reg(arg2), get_reg(arg1), 0);
-	} else {
-		assert(get_int(arg1) < 0x100);
-		return make3(6, get_reg(arg2), get_int(arg1));
-	}
-}
-u16 do_rand(struct elem *e)
-{
-	char *arg1, *arg2;
-	arg1 = e->str;
-	arg2 = e->next->str;
-	assert(e->next->next == NULL);
-	assert(!is_register(arg1));
-	assert(is_register(arg2));
-	return make3(0xc, get_reg(arg2), get_int(arg1));
-}
-u16 do_i(struct elem *e)
-{
-	assert(e->next == NULL);
-	assert(!is_register(e->str));
 
-	if (is_int(e->str))
-		return make2(0xa, get_int(e->str));
-	else if (is_cooked_label(e->str))
-		return make2(0xa, get_insn(e->str));
-}
-u16 do_ix(struct elem *e)
-{
-	assert(e->next == NULL);
-	assert(is_register(e->str));
-	return make3(0xf, get_reg(e->str), 0x1e);
-}
-u16 do_is(struct elem *e)
-{
-	assert(e->next == NULL);
-	assert(is_register(e->str));
-	return make3(0xf, get_reg(e->str), 0x29);
-}
-u16 do_sound(struct elem *e)
-{
-	assert(e->next == NULL);
-	assert(is_register(e->str));
-	return make3(0xf, get_reg(e->str), 0x18);
-}
-u16 do_delay(struct elem *e)
-{
-	assert(e->next == NULL);
-	assert(is_register(e->str));
-	return make3(0xf, get_reg(e->str), 0x15);
-}
-u16 do_ldelay(struct elem *e)
-{
-	assert(e->next == NULL);
-	assert(is_register(e->str));
-	return make3(0xf, get_reg(e->str), 0x7);
-}
-u16 do_sub(struct elem *e)
-{
-	assert(e->next->next == NULL);
-	assert(is_register(e->str));
-	assert(is_register(e->next->str));
-	return make4(8, get_reg(e->next->str), get_reg(e->str), 5);
-}
-u16 do_subv(struct elem *e)
-{
-	assert(e->next->next == NULL);
-	assert(is_register(e->str));
-	assert(is_register(e->next->str));
-	return make4(8, get_reg(e->next->str), get_reg(e->str), 7);
-}
-u16 do_shl(struct elem *e)
-{
-	assert(e->next == NULL);
-	assert(is_register(e->str));
-	return make3(8, get_reg(e->str), 0xe);
-}
-u16 do_shr(struct elem *e)
-{
-	assert(e->next == NULL);
-	assert(is_register(e->str));
-	return make3(8, get_reg(e->str), 6);
-}
-u16 do_load(struct elem *e)
-{
-	assert(e->next == NULL);
-	assert(!is_register(e->str));
-	return make3(0xf, get_int(e->str), 0x65);
-}
-u16 do_store(struct elem *e)
-{
-	assert(e->next == NULL);
-	assert(!is_register(e->str));
-	return make3(0xf, get_int(e->str), 0x55);
-}
-u16 do_draw(struct elem *e)
-{
-	assert(e->next->next->next == NULL);
-	assert(is_register(e->str));
-	assert(is_register(e->next->str));
-	assert(!is_register(e->next->next->str));
-	return make4(0xd, get_reg(e->str), get_reg(e->next->str), get_int(e->next->next->str));
-}
-u16 do_hlt(struct elem *e)
+/*
+ * 64-bit FNV-1a, seeded with the assembler version and options. Symbols
+ * and modules name their source, so then the name is part of the key too.
+ */
+static uint64_t hash_source(const char *src, const char *buf, size_t len)
 {
-	assert(e == NULL);
-	return make3(0x0, 0, 0xff);
+	const char *ver = CHIP8_ASM_VERSION;
+	uint64_t h = 14695981039346656037ull;
+
+	while (*ver)
+		h = (h ^ (uint8_t)*ver++) * 1099511628211ull;
+	h = (h ^ (optimize | symbols << 1 | object << 2)) * 1099511628211ull;
+	while ((symbols || object) && *src)
+		h = (h ^ (uint8_t)*src++) * 1099511628211ull;
+	h = (h ^ len) * 1099511628211ull;
+	while (len--)
+		h = (h ^ (uint8_t)*buf++) * 1099511628211ull;
+	return h;
 }
-u16 do_byte(struct elem *e)
+static char *cache_name(uint64_t key, const char *ext)
 {
-	assert(e->next->next == NULL);
-	return make_bytes(get_int(e->str), get_int(e->next->str));
-}
-struct op optables[] = {
-	{"add", do_add},
-	{"and", do_and},
-	{"bcd", do_bcd},
-	{"call", do_call},
-	{"cs", do_cs},
-	{"draw", do_draw},
-	{"i", do_i},
-	{"j0", do_j0},
-	{"ix", do_ix},
-	{"is", do_is},
-	{"j", do_j},
-	{"je", do_je},
-	{"jne", do_jne},
-	{"jk", do_jk},
-	{"jnk", do_jnk},
-	{"ldelay", do_ldelay},
-	{"load", do_load},
-	{"mov", do_mov},
-	{"rand", do_rand},
-	{"or", do_or},
-	{"ret", do_ret},
-	{"delay", do_delay},
-	{"shl", do_shl},
-	{"shr", do_shr},
-	{"sound", do_sound},
-	{"store", do_store},
-	{"sub", do_sub},
-	{"subv", do_subv},
-	{"wait", do_wait},
-	{"xor", do_xor},
-	{"hlt", do_hlt},
-	/* pesudo op */
-	{".byte", do_byte},
-};
+	size_t len = strlen(cache_dir) + strlen(ext) + 20;
+	char *name = (char *)malloc(len);
 
-FILE *openfile_in(const char *f)
-{
-	FILE *fp;
-	assert(f);
-	fp = fopen(f, "r");
-	assert(fp);
-	return fp;
+	if (name)
+		snprintf(name, len, "%s/%016llx%s", cache_dir, (unsigned long long)key, ext);
+	return name;
 }
-FILE *openfile_out(const char *f)
+/* whole file into a malloc'd buffer, NULL if it cannot be read */
+static uint8_t *read_file(const char *name, size_t *len)
 {
-	char *fout;
+	uint8_t *buf = NULL, *nbuf;
+	size_t cap = 0, rc;
 	FILE *fp;
-	size_t len;
 
-	len = strlen(f) + strlen(".rom") + 1;
-	fout = (char *)malloc(len);
-	assert(fout);
-	snprintf(fout, len, "%s.rom", f);
-	fp = fopen(fout, "wb");
-	assert(fp);
-	return fp;
+	*len = 0;
+	fp = fopen(name, "rb");
+	if (!fp)
+		return NULL;
+	do {
+		if (*len == cap) {
+			cap = cap ? 2 * cap : 4096;
+			nbuf = (uint8_t *)realloc(buf, cap);
+			if (!nbuf)
+				goto fail;
+			buf = nbuf;
+		}
+		rc = fread(buf + *len, 1, cap - *len, fp);
+		*len += rc;
+	} while (rc);
+	if (ferror(fp))
+		goto fail;
+	fclose(fp);
+	return buf;
+fail:
+	fclose(fp);
+	free(buf);
+	return NULL;
 }
-static void free_elem(struct elem *e)
+/* written under a temporary name and renamed so readers never see half a file */
+static int write_file(const char *name, const uint8_t *buf, size_t len)
 {
-	struct elem *n;
-	while (n = e) {
-		e = e->next;
-		free(n->str);
-		free(n);
+	size_t tlen = strlen(name) + 40;
+	char *tmp = (char *)malloc(tlen);
+	FILE *fp;
+	int rc = -1;
+
+	if (!tmp)
+		return -1;
+	snprintf(tmp, tlen, "%s.%ld.%lx.tmp", name, (long)getpid(), (unsigned long)pthread_self());
+	fp = fopen(tmp, "wb");
+	if (fp) {
+		if (len && fwrite(buf, 1, len, fp) != len)
+			rc = -2;
+		if (fclose(fp))
+			rc = -2;
+		if (rc != -2)
+			rc = rename(tmp, name);
+		if (rc)
+			unlink(tmp);
 	}
+	free(tmp);
+	return rc;
+}
+/* leaves name alone when it already holds buf: 1 if so, -1 on errors */
+static int update_output(const char *name, const uint8_t *buf, size_t len)
+{
+	uint8_t *old;
+	size_t olen;
+	int same;
+
+	if (!strcmp(name, "-"))
+		return (len && fwrite(buf, 1, len, stdout) != len) || fflush(stdout) ? -1 : 0;
+	old = read_file(name, &olen);
+	same = old && olen == len && !memcmp(old, buf, len);
+	free(old);
+	if (same)
+		return 1;
+	return write_file(name, buf, len) ? -1 : 0;
 }
-static void dump_elem(struct elem *e)
+/* the sidecar symbol file, or the module, of a successful build */
+static uint8_t *as_text(struct chip8_asm *as, const char *src, size_t *len,
+		int (*write)(struct chip8_asm *, FILE *, const char *))
 {
-	while (e) {
-		fprintf(stderr, "%s ", e->str);
-		e = e->next;
+	char *buf = NULL;
+	FILE *fp = open_memstream(&buf, len);
+
+	if (!fp)
+		return NULL;
+	if (write(as, fp, src) | fclose(fp)) {
+		free(buf);
+		return NULL;
 	}
-	fprintf(stderr, "\n");
-}
-static struct elem *lex(char *line, int lineno)
-{
-	char *s, *n;
-	struct elem *e, *p;
-
-	e = NULL;
-	p = NULL;
-	s = line;
-redo:
-	while (*s == ' ' || *s == '\t') {
-		s++;
-		continue;
+	return (uint8_t *)buf;
+}
+
+static void build(struct job *j)
+{
+	struct stat st;
+	uint8_t *rom = NULL, *sym = NULL;
+	size_t rom_len = 0, sym_len = 0;
+	char *cname = NULL, *csname = NULL, *sname = NULL, *buf;
+	uint64_t key;
+	int fd, rc, rs;
+
+	chip8_asm_init(&j->as, NULL, 0);
+	j->as.optimize = optimize;
+	j->as.symbols = symbols;
+	j->as.relocatable = object;
+	fd = open(j->src, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		snprintf(j->err, sizeof(j->err), "cannot open %s", j->src);
+		if (fd >= 0)
+			close(fd);
+		j->failed = 1;
+		return;
 	}
-	if (*s == '\n' || *s == '\0')
-		return e;
-	n = s;
-	while (*n != ' ' && *n != '\t' && *n != '\n' && *n != '\0') {
-		n++;
+	buf = NULL;
+	if (st.st_size) {
+		buf = (char *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (buf == MAP_FAILED) {
+			snprintf(j->err, sizeof(j->err), "cannot map %s: %s", j->src, strerror(errno));
+			close(fd);
+			j->failed = 1;
+			return;
+		}
 	}
-	if (*n != '\0') {
-		*n = 0;
-		n++;
+	close(fd);
+
+	if (cache_dir) {
+		key = hash_source(j->src, buf, st.st_size);
+		cname = cache_name(key, ".rom");
+		csname = symbols ? cache_name(key, ".sym") : NULL;
+		if (cname && (!symbols || csname))
+			rom = read_file(cname, &rom_len);
+		if (rom && symbols && !(sym = read_file(csname, &sym_len))) {
+			free(rom);
+			rom = NULL;
+		}
+		j->cached = rom != NULL;
 	}
-	if (!p) {
-		p = (struct elem *)malloc(sizeof(*p));
-		assert(p);
-	} else {
-		p->next = (struct elem *)malloc(sizeof(*p));
-		assert(p->next);
-		p = p->next;
+	if (!j->cached) {
+		assemble_mapped(&j->as, buf, st.st_size);
+		if (chip8_asm_finish(&j->as))
+			j->failed = 1;
+		rom = j->as.code;
+		rom_len = j->as.len;
+		if (!j->failed && object && !(rom = as_text(&j->as, j->src, &rom_len, chip8_asm_write_object))) {
+			snprintf(j->err, sizeof(j->err), "cannot make a module of %s", j->src);
+			j->failed = 1;
+		}
+		if (!j->failed && symbols && !(sym = as_text(&j->as, j->src, &sym_len, chip8_asm_write_symbols))) {
+			snprintf(j->err, sizeof(j->err), "cannot make symbols for %s", j->src);
+			j->failed = 1;
+		}
+		/* a cache that cannot be written only costs speed */
+		if (!j->failed && cname && (!symbols || !write_file(csname, sym, sym_len)))
+			write_file(cname, rom, rom_len);
 	}
-	p->next = NULL;
-	p->str = strdup(s);
-	assert(p->str);
-	s = n;
-	if (!e) {
-		e = p;
+	if (st.st_size)
+		munmap(buf, st.st_size);
+
+	if (!j->failed) {
+		rc = update_output(j->out, rom, rom_len);
+		if (rc >= 0 && symbols) {
+			sname = sym_name(j->out);
+			rs = sname ? update_output(sname, sym, sym_len) : -1;
+			rc = rs < 0 ? -1 : rc == 1 && rs == 1;
+		}
+		if (rc < 0) {
+			snprintf(j->err, sizeof(j->err), "cannot write %s%s", j->out, symbols ? " or its symbols" : "");
+			j->failed = 1;
+		}
+		j->unchanged = rc == 1;
 	}
-	goto redo;
-	return NULL;
+	if (j->cached || (object && rom != j->as.code))
+		free(rom);
+	free(sym);
+	free(cname);
+	free(csname);
+	free(sname);
 }
-static op_fun_t find_op(char *str)
+static void *worker(void *arg)
 {
+	struct job *j;
+	double t;
 	int i;
-	struct op *ope;
-#define ARRAY_SIZE(a)	(sizeof(a) / sizeof(a[0]))
-	for (i = 0; i < ARRAY_SIZE(optables); i++) {
-		ope = &optables[i];
-		if (!strcmp(ope->name, str))
-			return ope->fun;
+
+	while ((i = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED)) < njobs) {
+		j = &jobs[i];
+		t = now_ms();
+		build(j);
+		j->ms = now_ms() - t;
 	}
 	return NULL;
 }
-static void assemble(char *line, int lineno, FILE *fp)
+static int report(struct job *j, int timings)
 {
-	struct elem *e;
-	op_fun_t handler;
-	uint16_t opcode;
+	int i;
 
-	assert(line);
-	assert(fp);
+	if (j->err[0])
+		fprintf(stderr, "%s\n", j->err);
+	for (i = 0; i < j->as.ndiags; i++)
+		fprintf(stderr, "%s:%d: %s\n", j->src, j->as.diag[i].line, j->as.diag[i].msg);
+	if (timings)
+		fprintf(stderr, "%s: %.3f ms%s%s%s\n", j->src, j->ms,
+				j->failed ? " failed" : "",
+				j->cached ? " cached" : "",
+				j->unchanged ? " unchanged" : "");
+	return j->failed;
+}
+/* assembling from stdin writes to stdout unless told otherwise */
+static int build_stdin(const char *out)
+{
+	struct chip8_asm as;
+	FILE *fpout;
+	char *name;
+	int i;
 
-	e = lex(line, lineno);
-	if (!e) {
-		return;
+	chip8_asm_init(&as, NULL, 0);
+	as.optimize = optimize;
+	as.symbols = symbols;
+	as.relocatable = object;
+	if (assemble_stream(&as, stdin))
+		die("cannot read stdin\n");
+	if (chip8_asm_finish(&as)) {
+		for (i = 0; i < as.ndiags; i++)
+			fprintf(stderr, "-:%d: %s\n", as.diag[i].line, as.diag[i].msg);
+		return 1;
 	}
-	//dump_elem(e);
-	if (is_raw_label(e->str))
-		return;
-
-	handler = find_op(e->str);
-	if (!handler) {
-		die("line %d: bad op: %s\n", lineno, e->str);
+	fpout = out && strcmp(out, "-") ? fopen(out, "wb") : stdout;
+	if (!fpout)
+		die("cannot open %s\n", out);
+	if (object ? chip8_asm_write_object(&as, fpout, "-") :
+			as.len && fwrite(as.code, 1, as.len, fpout) != as.len)
+		die("cannot write %s\n", object ? "module" : "rom");
+	if (fclose(fpout))
+		die("cannot write %s\n", object ? "module" : "rom");
+	if (symbols) {
+		name = sym_name(out);
+		fpout = name ? fopen(name, "w") : NULL;
+		if (!fpout)
+			die("cannot open symbols for %s\n", out);
+		if (chip8_asm_write_symbols(&as, fpout, "-") | fclose(fpout))
+			die("cannot write symbols\n");
+		free(name);
 	}
-	opcode = handler(e->next);
-	free_elem(e);
-	assert(fwrite(&opcode, 1, 2, fp) == 2);
+	chip8_asm_free(&as);
+	return 0;
 }
-static void preprocess(char *line, int lineno, int *insno)
-{
-	struct elem *e;
-
-	assert(line);
-
-	e = lex(line, lineno);
-	if (!e) {
-		return;
-	}
-	if (is_raw_label(e->str)) {
-		assert(e->next == NULL);
-		add_label(e->str, lineno, *insno);
-	} else { /* opcode */
-		*insno += 2;
-	}
 
-	free_elem(e);
+static void usage(void)
+{
+	die("usage: chip8as [-O] [-g] [-c] [-o out.rom] [-C cachedir] srcfile\n"
+	    "       chip8as [-O] [-g] [-c] [-j jobs] [-C cachedir] srcfile...\n");
 }
 int main(int argc, char **argv)
 {
-	assert(argc == 2);
-	FILE *fpin, *fpout;
-	#define LINE_LEN	128
-	char line[LINE_LEN];
-	char *s;
-	int lineno;
-	int insno;
-
-	fpin = openfile_in(argv[1]);
-	fpout = openfile_out(argv[1]);
-
-	/* first pass to collect labels */
-	lineno = 1;
-	insno = 0x200;
-	while (!feof(fpin)) {
-		if (!fgets(line, LINE_LEN - 1, fpin)) {
-			if (feof(fpin)) {
+	const char *out = NULL;
+	pthread_t *tids;
+	int opt, i, nthreads = 0, batch, failed = 0, cached = 0;
+	double t;
+
+	while ((opt = getopt(argc, argv, "Ogco:j:C:")) != -1) {
+		switch (opt) {
+			case 'O':
+				optimize = 1;
 				break;
-			} else {
-				die("cannot read file\n");
-			}
-		}
-		preprocess(line, lineno, &insno);
-		lineno++;
-	}
-	//dump_ltable();
-
-	assert(0 == fseek(fpin, 0, SEEK_SET));
-	/* second pass */
-	lineno = 1;
-	while (!feof(fpin)) {
-		if (!fgets(line, LINE_LEN - 1, fpin)) {
-			if (feof(fpin)) {
+			case 'g':
+				symbols = 1;
 				break;
-			} else {
-				die("cannot read file\n");
-			}
+			case 'c':
+				object = 1;
+				break;
+			case 'o':
+				out = optarg;
+				break;
+			case 'j':
+				nthreads = atoi(optarg);
+				if (nthreads < 1)
+					usage();
+				break;
+			case 'C':
+				cache_dir = optarg;
+				break;
+			default:
+				usage();
 		}
-		assemble(line, lineno, fpout);
-		lineno++;
+	}
+	if (optind == argc)
+		usage();
+	if (symbols && object)
+		die("-g is for ROMs, not modules\n");
+	njobs = argc - optind;
+	batch = njobs > 1 || nthreads;
+	if (batch && out)
+		die("-o takes a single srcfile\n");
+	/* symbols are written next to the ROM, so it has to have a name */
+	if (symbols && (out ? !strcmp(out, "-") : !strcmp(argv[optind], "-")))
+		die("-g needs the ROM written to a named file\n");
+
+	if (njobs == 1 && !strcmp(argv[optind], "-"))
+		return build_stdin(out);
+
+	if (batch && !cache_dir)
+		cache_dir = CACHE_DIR;
+	if (cache_dir && mkdir(cache_dir, 0777) && errno != EEXIST)
+		die("cannot create %s\n", cache_dir);
+	if (!nthreads)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > njobs)
+		nthreads = njobs;
+	if (nthreads < 1)
+		nthreads = 1;
+
+	jobs = (struct job *)calloc(njobs, sizeof(*jobs));
+	tids = (pthread_t *)calloc(nthreads, sizeof(*tids));
+	assert(jobs && tids);
+	for (i = 0; i < njobs; i++) {
+		jobs[i].src = argv[optind + i];
+		if (!strcmp(jobs[i].src, "-"))
+			die("stdin cannot be part of a batch\n");
+		jobs[i].out = out_name(jobs[i].src, out);
+		assert(jobs[i].out);
 	}
 
-	fclose(fpin);
-	fclose(fpout);
-
-	free_ltable();
+	/* the main thread is worker 0 */
+	t = now_ms();
+	for (i = 1; i < nthreads; i++)
+		if (pthread_create(&tids[i], NULL, worker, NULL))
+			die("cannot create thread\n");
+	worker(NULL);
+	for (i = 1; i < nthreads; i++)
+		pthread_join(tids[i], NULL);
+	t = now_ms() - t;
+
+	/* in command line order whatever order they finished in */
+	for (i = 0; i < njobs; i++) {
+		failed += report(&jobs[i], batch);
+		cached += jobs[i].cached;
+		chip8_asm_free(&jobs[i].as);
+		free(jobs[i].out);
+	}
+	if (batch)
+		fprintf(stderr, "%d files, %d cached, %d failed, %d threads, %.3f ms\n",
+				njobs, cached, failed, nthreads, t);
+	free(jobs);
+	free(tids);
 
-	return 0;
+	return failed ? 1 : 0;
 }
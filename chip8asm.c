@@ -0,0 +1,1785 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+
+#include "chip8.h"
+
+/*
+ * Assembler library, used by chip8as and by c8emu to load .c8 sources.
+ * Single pass: labels are defined as they are met and references to
+ * labels not seen yet are patched by chip8_asm_finish(). Nothing here
+ * exits or asserts on bad input, every problem becomes a diagnostic with
+ * the line it was found on and assembly carries on with the next line.
+ *
+ * Operands are constant expressions over numbers, .equ/.define names,
+ * labels and $ (the address of the instruction), written without
+ * spaces. .macro and .rept bodies are kept as text and fed back through
+ * the line assembler when expanded.
+ *
+ * With relocatable set the program is a module for chip8ld: assembled
+ * as if loaded at PROGRAM_MEM, every use of an address is kept as a
+ * relocation, and labels it does not define are imported from other
+ * modules instead of being errors.
+ */
+
+/* only support lower case */
+
+typedef uint16_t	u16;
+typedef uint8_t		u8;
+
+typedef u16 (*op_fun_t) (struct chip8_asm *, char **);
+
+struct op {
+	const char *name;
+	op_fun_t fun;
+	int nargs;
+};
+
+/* labels and, flagged constant, .equ/.define names share one table */
+struct c8asm_label {
+	char *str;
+	u16 insn;
+	u16 lineno;	/* of the definition, or of the first reference */
+	u8 defined;
+	u8 constant;
+	u8 global;	/* .global, exported from a module */
+	long value;	/* of a constant */
+	struct c8asm_label *next;
+};
+
+/*
+ * A reference to a label that was not defined yet, patched at the end:
+ * either the label itself or an expression using it, into the low bits
+ * of the word given by max.
+ */
+struct c8asm_fixup {
+	struct c8asm_label *lbl;
+	char *expr;
+	unsigned max;
+	u16 pc;
+	size_t off;
+	int lineno;
+};
+
+/* a .macro, or a .rept while its body is collected */
+struct c8asm_macro {
+	char *name;		/* NULL for .rept */
+	char **params;
+	int nparams;
+	long count;		/* .rept */
+	char **lines;
+	size_t nlines, lines_cap;
+	int lineno;
+	int broken;		/* bad header, the body is dropped */
+	struct c8asm_macro *next;
+};
+#define MACRO_DEPTH	64
+
+/* .section, a unit the linker keeps or drops as a whole */
+struct c8asm_section {
+	char *name;
+	u16 addr;
+};
+
+/*
+ * A word of a module the linker patches: under mask goes the address of
+ * the import sym plus addend, or without sym addend itself, an address
+ * in this module that moves with it.
+ */
+struct c8asm_reloc {
+	u16 addr;
+	unsigned mask;
+	struct c8asm_label *sym;
+	long addend;
+};
+
+/* per word of code, recorded for the optimizer and debug symbols */
+struct c8asm_word {
+	struct c8asm_label *ref;	/* label in the low 12 bits */
+	int lineno;
+	u8 flags;
+};
+#define W_DATA	0x01	/* .byte, maybe never executed, maybe code we do not know */
+#define W_ABS	0x02	/* numeric address into the program, code must not move */
+
+/* grow *p to hold at least n elements of size bytes */
+static int grow(void *p, size_t *cap, size_t n, size_t size)
+{
+	size_t ncap = *cap ? *cap : 16;
+	void *np;
+
+	if (n <= *cap)
+		return 0;
+	while (ncap < n)
+		ncap *= 2;
+	np = realloc(*(void **)p, ncap * size);
+	if (!np)
+		return -1;
+	*(void **)p = np;
+	*cap = ncap;
+	return 0;
+}
+
+/* records a diagnostic for line, only the first error of a line is kept */
+static void diag_at(struct chip8_asm *as, int line, const char *fmt, ...)
+{
+	struct chip8_asm_diag *d;
+	va_list ap;
+
+	if (line == as->lineno) {
+		if (as->line_failed)
+			return;
+		as->line_failed = 1;
+	}
+	if (grow(&as->diag, &as->diag_cap, as->ndiags + 1, sizeof(*as->diag)))
+		return;
+	d = &as->diag[as->ndiags++];
+	d->line = line;
+	va_start(ap, fmt);
+	vsnprintf(d->msg, sizeof(d->msg), fmt, ap);
+	va_end(ap);
+}
+#define error(as, fmt, args...)	diag_at(as, (as)->lineno, fmt, ##args)
+
+static unsigned hash_str(const char *str, size_t len)
+{
+	unsigned h = 2166136261u;	/* FNV-1a */
+
+	while (len--)
+		h = (h ^ (u8)*str++) * 16777619u;
+	return h;
+}
+/* the slot holding str, or the empty slot where it belongs */
+static struct c8asm_label **lhash_slot(struct chip8_asm *as, const char *str, size_t len)
+{
+	unsigned i = hash_str(str, len) & (as->lhash_size - 1);
+	struct c8asm_label *lbl;
+
+	while ((lbl = as->lhash[i])) {
+		if (!strncmp(lbl->str, str, len) && lbl->str[len] == '\0')
+			break;
+		i = (i + 1) & (as->lhash_size - 1);
+	}
+	return &as->lhash[i];
+}
+static int lhash_grow(struct chip8_asm *as)
+{
+	unsigned size = as->lhash_size ? 2 * as->lhash_size : 256;
+	struct c8asm_label **lhash, *lbl;
+
+	lhash = (struct c8asm_label **)calloc(size, sizeof(*lhash));
+	if (!lhash)
+		return -1;
+	free(as->lhash);
+	as->lhash = lhash;
+	as->lhash_size = size;
+	for (lbl = as->labels; lbl; lbl = lbl->next)
+		*lhash_slot(as, lbl->str, strlen(lbl->str)) = lbl;
+	return 0;
+}
+
+static int is_raw_label(const char *str)
+{
+	if (!strncasecmp(str, "L_", 2) && str[strlen(str)-1] == ':')
+		return 1;
+	return 0;
+}
+static int is_cooked_label(const char *str)
+{
+	if (!strncasecmp(str, "L_", 2))
+		return 1;
+	return 0;
+}
+/* finds str, entering it as not yet defined if it is new */
+static struct c8asm_label *intern_label(struct chip8_asm *as, const char *str, size_t len)
+{
+	struct c8asm_label *lbl, **slot;
+
+	if (2 * (as->nlabels + 1) > as->lhash_size && lhash_grow(as))
+		goto oom;
+	slot = lhash_slot(as, str, len);
+	if (*slot)
+		return *slot;
+
+	lbl = (struct c8asm_label *)malloc(sizeof(*lbl));
+	if (!lbl)
+		goto oom;
+	lbl->str = strndup(str, len);
+	if (!lbl->str) {
+		free(lbl);
+		goto oom;
+	}
+	lbl->insn = 0;
+	lbl->lineno = as->lineno;
+	lbl->defined = 0;
+	lbl->constant = 0;
+	lbl->global = 0;
+	lbl->value = 0;
+	lbl->next = NULL;
+	if (!as->labels)
+		as->labels = lbl;
+	else
+		as->ltail->next = lbl;
+	as->ltail = lbl;
+	*slot = lbl;
+	as->nlabels++;
+	return lbl;
+oom:
+	error(as, "out of memory");
+	return NULL;
+}
+static void add_label(struct chip8_asm *as, const char *str, int insno)
+{
+	/* strip ':' */
+	struct c8asm_label *lbl = intern_label(as, str, strlen(str) - 1);
+
+	if (!lbl)
+		return;
+	if (lbl->defined) {
+		error(as, "label %s already defined at line %d", lbl->str, lbl->lineno);
+		return;
+	}
+	lbl->insn = insno;
+	lbl->lineno = as->lineno;
+	lbl->defined = 1;
+}
+static void free_labels(struct chip8_asm *as)
+{
+	struct c8asm_label *lbl, *next;
+
+	for (lbl = as->labels; lbl; lbl = next) {
+		next = lbl->next;
+		free(lbl->str);
+		free(lbl);
+	}
+	as->labels = as->ltail = NULL;
+	free(as->lhash);
+	as->lhash = NULL;
+	as->lhash_size = as->nlabels = 0;
+}
+
+static int is_register(const char *str)
+{
+	if (strlen(str) != 2)
+		return 0;
+	if (str[0] != 'v')
+		return 0;
+	if ((str[1] >= '0' && str[1] <= '9') || (str[1] >= 'a' && str[1] <= 'f'))
+		return 1;
+	return 0;
+}
+static int is_ident(const char *str)
+{
+	if (!isalpha((u8)*str) && *str != '_')
+		return 0;
+	while (isalnum((u8)*str) || *str == '_')
+		str++;
+	return !*str;
+}
+static struct c8asm_label *find_sym(struct chip8_asm *as, const char *str, size_t len)
+{
+	if (!as->lhash_size)
+		return NULL;
+	return *lhash_slot(as, str, len);
+}
+
+/*
+ * Expressions, C operators and precedence: unary - ~ ! +, then * / %,
+ * + -, << >>, &, ^, |. Numbers are decimal, octal or 0x hex. A label
+ * that is not defined yet reads as 0 and marks the result unresolved.
+ * bias moves the module and ext_bias its imports, see relocate().
+ */
+struct expr {
+	struct chip8_asm *as;
+	const char *p;
+	u16 pc;
+	const char *str;	/* the whole expression, for messages */
+	int labels;	/* uses a label or $ */
+	int unresolved;	/* uses a label not defined yet */
+	int final;	/* at the end, where that is an error */
+	int imports;	/* at the end of a module, where that is an import */
+	int error;
+	long bias, ext_bias;
+	struct c8asm_label *ext;	/* the import used */
+	int exts;	/* how many different ones */
+};
+
+/* odd, so that masking or shifting an address cannot hide the move */
+#define RELOC_PROBE	0x12345
+
+static long expr_or(struct expr *e);
+
+static void expr_error(struct expr *e, const char *msg)
+{
+	if (!e->error)
+		error(e->as, "%s in %s", msg, e->str);
+	e->error = 1;
+}
+static long expr_primary(struct expr *e)
+{
+	struct c8asm_label *sym;
+	const char *start = e->p;
+	char *end;
+	long v;
+
+	switch (*e->p) {
+		case '(':
+			e->p++;
+			v = expr_or(e);
+			if (*e->p != ')') {
+				expr_error(e, "missing )");
+				return 0;
+			}
+			e->p++;
+			return v;
+		case '-':
+			e->p++;
+			return -expr_primary(e);
+		case '+':
+			e->p++;
+			return expr_primary(e);
+		case '~':
+			e->p++;
+			return ~expr_primary(e);
+		case '!':
+			e->p++;
+			return !expr_primary(e);
+		case '$':
+			e->p++;
+			e->labels = 1;
+			return e->pc + e->bias;
+	}
+	if (isdigit((u8)*e->p)) {
+		v = strtol(e->p, &end, 0);
+		if (isalnum((u8)*end) || *end == '_') {
+			expr_error(e, "bad number");
+			return 0;
+		}
+		e->p = end;
+		return v;
+	}
+	if (!isalpha((u8)*e->p) && *e->p != '_') {
+		expr_error(e, "bad expression");
+		return 0;
+	}
+	while (isalnum((u8)*e->p) || *e->p == '_')
+		e->p++;
+	if (is_cooked_label(start)) {
+		e->labels = 1;
+		sym = intern_label(e->as, start, e->p - start);
+		if (!sym) {
+			e->error = 1;
+			return 0;
+		}
+		if (!sym->defined && e->imports) {
+			if (sym != e->ext)
+				e->exts++;
+			e->ext = sym;
+			return e->ext_bias;
+		}
+		if (!sym->defined) {
+			if (e->final) {
+				if (!e->error)
+					error(e->as, "undefined label: %s", sym->str);
+				e->error = 1;
+			}
+			e->unresolved = 1;
+			return 0;
+		}
+		return sym->insn + e->bias;
+	}
+	sym = find_sym(e->as, start, e->p - start);
+	if (!sym || !sym->constant) {
+		expr_error(e, "undefined name");
+		return 0;
+	}
+	return sym->value;
+}
+static long expr_mul(struct expr *e)
+{
+	long v = expr_primary(e), r;
+	char op;
+
+	while (*e->p == '*' || *e->p == '/' || *e->p == '%') {
+		op = *e->p++;
+		r = expr_primary(e);
+		if (op == '*') {
+			v *= r;
+		} else if (!r) {
+			/* a label still to come may be what makes it 0 */
+			if (!e->unresolved)
+				expr_error(e, "division by zero");
+			v = 0;
+		} else {
+			v = op == '/' ? v / r : v % r;
+		}
+	}
+	return v;
+}
+static long expr_add(struct expr *e)
+{
+	long v = expr_mul(e);
+
+	while (*e->p == '+' || *e->p == '-') {
+		if (*e->p++ == '+')
+			v += expr_mul(e);
+		else
+			v -= expr_mul(e);
+	}
+	return v;
+}
+static long expr_shift(struct expr *e)
+{
+	long v = expr_add(e), r;
+	int left;
+
+	while ((e->p[0] == '<' && e->p[1] == '<') || (e->p[0] == '>' && e->p[1] == '>')) {
+		left = *e->p == '<';
+		e->p += 2;
+		r = expr_add(e);
+		if (r < 0 || r > 31) {
+			expr_error(e, "bad shift");
+			return 0;
+		}
+		v = left ? v << r : v >> r;
+	}
+	return v;
+}
+static long expr_and(struct expr *e)
+{
+	long v = expr_shift(e);
+
+	while (*e->p == '&') {
+		e->p++;
+		v &= expr_shift(e);
+	}
+	return v;
+}
+static long expr_xor(struct expr *e)
+{
+	long v = expr_and(e);
+
+	while (*e->p == '^') {
+		e->p++;
+		v ^= expr_and(e);
+	}
+	return v;
+}
+static long expr_or(struct expr *e)
+{
+	long v = expr_xor(e);
+
+	while (*e->p == '|') {
+		e->p++;
+		v |= expr_xor(e);
+	}
+	return v;
+}
+static long eval(struct expr *e)
+{
+	long v;
+
+	e->str = e->p;
+	v = expr_or(e);
+	if (*e->p && !e->error)
+		expr_error(e, "junk");
+	return v;
+}
+/* negative values wrap, so add -1 v0 is add 0xff */
+static unsigned in_range(struct chip8_asm *as, const char *str, long v, unsigned max)
+{
+	if (v > (long)max || v < -(long)max - 1) {
+		error(as, "%s out of range, at most %#x", str, max);
+		return 0;
+	}
+	return v & max;
+}
+static int add_fixup(struct chip8_asm *as, struct c8asm_label *lbl, const char *expr, unsigned max)
+{
+	struct c8asm_fixup *f;
+
+	if (grow(&as->fixups, &as->fixups_cap, as->nfixups + 1, sizeof(*as->fixups)))
+		goto oom;
+	f = &as->fixups[as->nfixups];
+	f->expr = NULL;
+	if (expr && !(f->expr = strdup(expr)))
+		goto oom;
+	as->nfixups++;
+	f->lbl = lbl;
+	f->max = max;
+	f->pc = PROGRAM_MEM + as->len;
+	f->off = as->len;
+	f->lineno = as->lineno;
+	return 0;
+oom:
+	error(as, "out of memory");
+	return -1;
+}
+/*
+ * An operand no larger than max that lands in the low bits of the
+ * instruction, so labels defined further on are patched in later.
+ */
+static unsigned get_int(struct chip8_asm *as, const char *str, unsigned max)
+{
+	struct expr e = { as, str, PROGRAM_MEM + as->len };
+	long v = eval(&e);
+
+	if (e.error)
+		return 0;
+	/* the optimizer cannot follow a label inside an expression */
+	if (e.labels)
+		as->wflags |= W_ABS;
+	/* in a module, addresses are only known once it is linked */
+	if (e.unresolved || (e.labels && as->relocatable)) {
+		add_fixup(as, NULL, str, max);
+		return 0;
+	}
+	return in_range(as, str, v, max);
+}
+/*
+ * A value that has to be known on the spot: no labels defined further
+ * on and, in a module, nothing that changes when the module moves.
+ */
+static int eval_const(struct chip8_asm *as, const char *str, long *v)
+{
+	struct expr e = { as, str, PROGRAM_MEM + as->len };
+
+	*v = eval(&e);
+	if (e.error)
+		return -1;
+	if (e.unresolved) {
+		error(as, "%s uses a label not defined yet", str);
+		return -1;
+	}
+	if (e.labels && as->relocatable) {
+		memset(&e, 0, sizeof(e));
+		e.as = as;
+		e.p = str;
+		e.pc = PROGRAM_MEM + as->len;
+		e.bias = RELOC_PROBE;
+		if (eval(&e) != *v) {
+			error(as, "%s depends on where the module is linked", str);
+			return -1;
+		}
+	}
+	return 0;
+}
+static unsigned get_const(struct chip8_asm *as, const char *str, unsigned max)
+{
+	long v;
+
+	if (eval_const(as, str, &v))
+		return 0;
+	return in_range(as, str, v, max);
+}
+static int get_reg(struct chip8_asm *as, const char *str)
+{
+	if (!is_register(str)) {
+		error(as, "expected a register: %s", str);
+		return 0;
+	}
+	if (isdigit((u8)str[1]))
+		return (str[1] - '0');
+	else
+		return (str[1] - 'a' + 10);
+}
+/*
+ * Address of a label for the instruction being assembled. Forward
+ * references are recorded as fixups and read as 0 for now, every user
+ * puts the address in the low 12 bits of the opcode.
+ */
+static unsigned get_insn(struct chip8_asm *as, const char *str)
+{
+	struct c8asm_label *lbl = intern_label(as, str, strlen(str));
+
+	if (!lbl)
+		return 0;
+	as->ref = lbl;
+	if (lbl->defined && !as->relocatable)
+		return lbl->insn;
+	add_fixup(as, lbl, NULL, 0xfff);
+	return lbl->defined ? lbl->insn : 0;
+}
+static unsigned get_address(struct chip8_asm *as, const char *str)
+{
+	unsigned addr;
+
+	if (!is_cooked_label(str) || !is_ident(str)) {
+		addr = get_int(as, str, 0xfff);
+		if (addr >= PROGRAM_MEM)
+			as->wflags |= W_ABS;
+		return addr;
+	}
+	addr = get_insn(as, str);
+	if (addr > 0xfff)
+		error(as, "label %s at %#x is out of reach", str, addr);
+	return addr;
+}
+static u16 make2(int op, int arg)
+{
+	u16 res;
+	arg &= 0x0fff;
+	res = op;
+	res = (res << 4) | (arg >> 8);
+	res = (res << 8) | (arg & 0x0ff);
+	return htons(res);
+}
+static u16 make3(int op, int arg1, int arg2)
+{
+	u16 res;
+	res = op;
+	res = (res << 4) | arg1;
+	res = (res << 8) | arg2;
+	return htons(res);
+}
+static u16 make4(int op, int arg1, int arg2, int arg3)
+{
+	u16 res;
+	res = op;
+	res = (res << 4) | arg1;
+	res = (res << 8) | ((arg2 << 4) | arg3);
+	return htons(res);
+}
+static u16 make_bytes(int arg1, int arg2)
+{
+	u16 res;
+	res = arg1;
+	res = (res << 8) | arg2;
+	return htons(res);
+}
+
+/* handlers get exactly the number of operands listed in optables */
+static u16 do_add(struct chip8_asm *as, char **arg)
+{
+	if (!is_register(arg[0]))
+		return make3(7, get_reg(as, arg[1]), get_int(as, arg[0], 0xff));
+	return make4(8, get_reg(as, arg[1]), get_reg(as, arg[0]), 4);
+}
+static u16 do_and(struct chip8_asm *as, char **arg)
+{
+	return make4(8, get_reg(as, arg[1]), get_reg(as, arg[0]), 2);
+}
+static u16 do_or(struct chip8_asm *as, char **arg)
+{
+	return make4(8, get_reg(as, arg[1]), get_reg(as, arg[0]), 1);
+}
+static u16 do_xor(struct chip8_asm *as, char **arg)
+{
+	return make4(8, get_reg(as, arg[1]), get_reg(as, arg[0]), 3);
+}
+static u16 do_cs(struct chip8_asm *as, char **arg)
+{
+	return make4(0, 0, 0xe, 0);
+}
+static u16 do_j(struct chip8_asm *as, char **arg)
+{
+	return make2(1, get_address(as, arg[0]));
+}
+static u16 do_j0(struct chip8_asm *as, char **arg)
+{
+	return make2(0xb, get_address(as, arg[0]));
+}
+/* je/jne compare a register with a register or a byte, in either order */
+static u16 do_cond(struct chip8_asm *as, char **arg, int op_reg, int op_imm)
+{
+	if (is_register(arg[0])) {
+		if (is_register(arg[1]))
+			return make4(op_reg, get_reg(as, arg[0]), get_reg(as, arg[1]), 0);
+		return make3(op_imm, get_reg(as, arg[0]), get_int(as, arg[1], 0xff));
+	}
+	return make3(op_imm, get_reg(as, arg[1]), get_int(as, arg[0], 0xff));
+}
+static u16 do_je(struct chip8_asm *as, char **arg)
+{
+	return do_cond(as, arg, 5, 3);
+}
+static u16 do_jne(struct chip8_asm *as, char **arg)
+{
+	return do_cond(as, arg, 9, 4);
+}
+static u16 do_jk(struct chip8_asm *as, char **arg)
+{
+	return make3(0xe, get_reg(as, arg[0]), 0x9e);
+}
+static u16 do_jnk(struct chip8_asm *as, char **arg)
+{
+	return make3(0xe, get_reg(as, arg[0]), 0xa1);
+}
+static u16 do_wait(struct chip8_asm *as, char **arg)
+{
+	return make3(0xf, get_reg(as, arg[0]), 0x0a);
+}
+static u16 do_call(struct chip8_asm *as, char **arg)
+{
+	return make2(2, get_address(as, arg[0]));
+}
+static u16 do_ret(struct chip8_asm *as, char **arg)
+{
+	return make4(0, 0, 0xe, 0xe);
+}
+static u16 do_bcd(struct chip8_asm *as, char **arg)
+{
+	return make3(0xf, get_reg(as, arg[0]), 0x33);
+}
+static u16 do_mov(struct chip8_asm *as, char **arg)
+{
+	if (is_register(arg[0]))
+		return make4(8, get_reg(as, arg[1]), get_reg(as, arg[0]), 0);
+	return make3(6, get_reg(as, arg[1]), get_int(as, arg[0], 0xff));
+}
+static u16 do_rand(struct chip8_asm *as, char **arg)
+{
+	return make3(0xc, get_reg(as, arg[1]), get_int(as, arg[0], 0xff));
+}
+static u16 do_i(struct chip8_asm *as, char **arg)
+{
+	return make2(0xa, get_address(as, arg[0]));
+}
+static u16 do_ix(struct chip8_asm *as, char **arg)
+{
+	return make3(0xf, get_reg(as, arg[0]), 0x1e);
+}
+static u16 do_is(struct chip8_asm *as, char **arg)
+{
+	return make3(0xf, get_reg(as, arg[0]), 0x29);
+}
+static u16 do_sound(struct chip8_asm *as, char **arg)
+{
+	return make3(0xf, get_reg(as, arg[0]), 0x18);
+}
+static u16 do_delay(struct chip8_asm *as, char **arg)
+{
+	return make3(0xf, get_reg(as, arg[0]), 0x15);
+}
+static u16 do_ldelay(struct chip8_asm *as, char **arg)
+{
+	return make3(0xf, get_reg(as, arg[0]), 0x7);
+}
+static u16 do_sub(struct chip8_asm *as, char **arg)
+{
+	return make4(8, get_reg(as, arg[1]), get_reg(as, arg[0]), 5);
+}
+static u16 do_subv(struct chip8_asm *as, char **arg)
+{
+	return make4(8, get_reg(as, arg[1]), get_reg(as, arg[0]), 7);
+}
+static u16 do_shl(struct chip8_asm *as, char **arg)
+{
+	return make3(8, get_reg(as, arg[0]), 0xe);
+}
+static u16 do_shr(struct chip8_asm *as, char **arg)
+{
+	return make3(8, get_reg(as, arg[0]), 6);
+}
+static u16 do_load(struct chip8_asm *as, char **arg)
+{
+	return make3(0xf, get_const(as, arg[0], 0xf), 0x65);
+}
+static u16 do_store(struct chip8_asm *as, char **arg)
+{
+	return make3(0xf, get_const(as, arg[0], 0xf), 0x55);
+}
+static u16 do_draw(struct chip8_asm *as, char **arg)
+{
+	return make4(0xd, get_reg(as, arg[0]), get_reg(as, arg[1]), get_int(as, arg[2], 0xf));
+}
+static u16 do_hlt(struct chip8_asm *as, char **arg)
+{
+	return make3(0x0, 0, 0xff);
+}
+static u16 do_byte(struct chip8_asm *as, char **arg)
+{
+	as->wflags |= W_DATA;
+	return make_bytes(get_const(as, arg[0], 0xff), get_int(as, arg[1], 0xff));
+}
+/*
+ * Mnemonics are looked up through a perfect hash of the first two
+ * characters, the last one and the length, collision free for this set.
+ * The slots are computed at compile time from character constants; a
+ * new mnemonic must not land on a used slot (gcc -Woverride-init warns),
+ * otherwise pick new multipliers.
+ */
+#define OP_HASH_SIZE	64
+#define OP_HASH(c0, c1, cn, len)	(((c0) + 9 * (c1) + 7 * (cn) + 6 * (len)) & (OP_HASH_SIZE - 1))
+
+static const struct op optables[OP_HASH_SIZE] = {
+	[OP_HASH('a', 'd', 'd', 3)] = {"add", do_add, 2},
+	[OP_HASH('a', 'n', 'd', 3)] = {"and", do_and, 2},
+	[OP_HASH('b', 'c', 'd', 3)] = {"bcd", do_bcd, 1},
+	[OP_HASH('c', 'a', 'l', 4)] = {"call", do_call, 1},
+	[OP_HASH('c', 's', 's', 2)] = {"cs", do_cs, 0},
+	[OP_HASH('d', 'r', 'w', 4)] = {"draw", do_draw, 3},
+	[OP_HASH('i', 0, 'i', 1)] = {"i", do_i, 1},
+	[OP_HASH('j', '0', '0', 2)] = {"j0", do_j0, 1},
+	[OP_HASH('i', 'x', 'x', 2)] = {"ix", do_ix, 1},
+	[OP_HASH('i', 's', 's', 2)] = {"is", do_is, 1},
+	[OP_HASH('j', 0, 'j', 1)] = {"j", do_j, 1},
+	[OP_HASH('j', 'e', 'e', 2)] = {"je", do_je, 2},
+	[OP_HASH('j', 'n', 'e', 3)] = {"jne", do_jne, 2},
+	[OP_HASH('j', 'k', 'k', 2)] = {"jk", do_jk, 1},
+	[OP_HASH('j', 'n', 'k', 3)] = {"jnk", do_jnk, 1},
+	[OP_HASH('l', 'd', 'y', 6)] = {"ldelay", do_ldelay, 1},
+	[OP_HASH('l', 'o', 'd', 4)] = {"load", do_load, 1},
+	[OP_HASH('m', 'o', 'v', 3)] = {"mov", do_mov, 2},
+	[OP_HASH('r', 'a', 'd', 4)] = {"rand", do_rand, 2},
+	[OP_HASH('o', 'r', 'r', 2)] = {"or", do_or, 2},
+	[OP_HASH('r', 'e', 't', 3)] = {"ret", do_ret, 0},
+	[OP_HASH('d', 'e', 'y', 5)] = {"delay", do_delay, 1},
+	[OP_HASH('s', 'h', 'l', 3)] = {"shl", do_shl, 1},
+	[OP_HASH('s', 'h', 'r', 3)] = {"shr", do_shr, 1},
+	[OP_HASH('s', 'o', 'd', 5)] = {"sound", do_sound, 1},
+	[OP_HASH('s', 't', 'e', 5)] = {"store", do_store, 1},
+	[OP_HASH('s', 'u', 'b', 3)] = {"sub", do_sub, 2},
+	[OP_HASH('s', 'u', 'v', 4)] = {"subv", do_subv, 2},
+	[OP_HASH('w', 'a', 't', 4)] = {"wait", do_wait, 1},
+	[OP_HASH('x', 'o', 'r', 3)] = {"xor", do_xor, 2},
+	[OP_HASH('h', 'l', 't', 3)] = {"hlt", do_hlt, 0},
+	/* pesudo op */
+	[OP_HASH('.', 'b', 'e', 5)] = {".byte", do_byte, 2},
+};
+
+static const struct op *find_op(const char *str)
+{
+	size_t len = strlen(str);
+	const struct op *ope;
+
+	ope = &optables[OP_HASH((u8)str[0], (u8)str[1], (u8)str[len - 1], len)];
+	if (ope->name && !strcmp(ope->name, str))
+		return ope;
+	return NULL;
+}
+
+/*
+ * Split line into tokens in place: each token is a view into the line,
+ * terminated by overwriting the separator after it. The token array is
+ * reused for every line. Returns the number of tokens.
+ */
+static int lex(struct chip8_asm *as, char *line)
+{
+	char *s = line;
+	size_t n = 0;
+
+	while (1) {
+		while (*s == ' ' || *s == '\t' || *s == '\r')
+			s++;
+		if (*s == '\n' || *s == '\0')
+			break;
+		if (grow(&as->tok, &as->tok_cap, n + 1, sizeof(*as->tok))) {
+			error(as, "out of memory");
+			return 0;
+		}
+		as->tok[n++] = s;
+		while (*s != ' ' && *s != '\t' && *s != '\r' && *s != '\n' && *s != '\0')
+			s++;
+		if (*s == '\0')
+			break;
+		*s++ = '\0';
+	}
+	return n;
+}
+static void emit(struct chip8_asm *as, u16 opcode)
+{
+	if (as->len + 2 > as->cap) {
+		if (as->fixed) {
+			if (!as->overflow)
+				error(as, "program larger than %zu bytes", as->cap);
+			as->overflow = 1;
+			return;
+		}
+		if (grow(&as->code, &as->cap, as->len + 2, 1)) {
+			error(as, "out of memory");
+			return;
+		}
+	}
+	if (as->optimize || as->symbols) {
+		if (grow(&as->words, &as->words_cap, as->len / 2 + 1, sizeof(*as->words))) {
+			error(as, "out of memory");
+			return;
+		}
+		as->words[as->len / 2].ref = as->ref;
+		as->words[as->len / 2].flags = as->wflags;
+		as->words[as->len / 2].lineno = as->lineno;
+	}
+	memcpy(&as->code[as->len], &opcode, 2);
+	as->len += 2;
+}
+
+/* code is assembled into buf if given, else into a buffer that grows */
+void chip8_asm_init(struct chip8_asm *as, uint8_t *buf, size_t cap)
+{
+	memset(as, 0, sizeof(*as));
+	if (buf) {
+		as->code = buf;
+		as->cap = cap;
+		as->fixed = 1;
+	}
+}
+static void free_macro(struct c8asm_macro *m)
+{
+	size_t i;
+
+	if (!m)
+		return;
+	for (i = 0; i < m->nlines; i++)
+		free(m->lines[i]);
+	for (i = 0; i < (size_t)m->nparams; i++)
+		free(m->params[i]);
+	free(m->lines);
+	free(m->params);
+	free(m->name);
+	free(m);
+}
+static struct c8asm_macro *find_macro(struct chip8_asm *as, const char *name)
+{
+	struct c8asm_macro *m;
+
+	for (m = as->macros; m; m = m->next)
+		if (!strcmp(m->name, name))
+			return m;
+	return NULL;
+}
+
+static void assemble_line(struct chip8_asm *as, char *line);
+
+/* runs line through the assembler as if it came from the current line */
+static void assemble_copy(struct chip8_asm *as, const char *line)
+{
+	char *copy;
+
+	if (as->depth >= MACRO_DEPTH) {
+		error(as, "macros nested more than %d deep", MACRO_DEPTH);
+		return;
+	}
+	copy = strdup(line);
+	if (!copy) {
+		error(as, "out of memory");
+		return;
+	}
+	as->depth++;
+	assemble_line(as, copy);
+	as->depth--;
+	free(copy);
+}
+/*
+ * A macro body line with \param replaced by its argument and \@ by a
+ * number unique to this expansion, for labels local to it.
+ */
+static char *substitute(struct c8asm_macro *m, const char *line, char **args, unsigned unique)
+{
+	const char *p = line, *id;
+	char *out = NULL;
+	size_t len = 0, n;
+	FILE *fp = open_memstream(&out, &len);
+	int i;
+
+	if (!fp)
+		return NULL;
+	while (*p) {
+		if (*p != '\\') {
+			fputc(*p++, fp);
+			continue;
+		}
+		p++;
+		if (*p == '@') {
+			fprintf(fp, "%u", unique);
+			p++;
+			continue;
+		}
+		id = p;
+		while (isalnum((u8)*p) || *p == '_')
+			p++;
+		n = p - id;
+		for (i = 0; i < m->nparams; i++)
+			if (strlen(m->params[i]) == n && !strncmp(m->params[i], id, n))
+				break;
+		if (i < m->nparams)
+			fputs(args[i], fp);
+		else
+			fprintf(fp, "\\%.*s", (int)n, id);
+	}
+	if (fclose(fp)) {
+		free(out);
+		return NULL;
+	}
+	return out;
+}
+static void expand_macro(struct chip8_asm *as, struct c8asm_macro *m, int n)
+{
+	char **args;
+	char *line;
+	unsigned unique = as->expansions++;
+	size_t i;
+	int a;
+
+	if (n - 1 != m->nparams) {
+		error(as, "%s takes %d operand%s", m->name, m->nparams, m->nparams == 1 ? "" : "s");
+		return;
+	}
+	/* the tokens are overwritten by the body lines */
+	args = (char **)calloc(m->nparams + 1, sizeof(*args));
+	for (a = 0; args && a < m->nparams; a++)
+		if (!(args[a] = strdup(as->tok[a + 1])))
+			break;
+	if (!args || a < m->nparams) {
+		error(as, "out of memory");
+		goto out;
+	}
+	for (i = 0; i < m->nlines; i++) {
+		line = substitute(m, m->lines[i], args, unique);
+		if (!line) {
+			error(as, "out of memory");
+			break;
+		}
+		assemble_copy(as, line);
+		free(line);
+	}
+out:
+	for (a = 0; args && a < m->nparams; a++)
+		free(args[a]);
+	free(args);
+}
+/* .endm or .endr at the outer level: keep the macro, run the .rept */
+static void end_block(struct chip8_asm *as, int is_macro)
+{
+	struct c8asm_macro *m = as->defining;
+	long r;
+	size_t i;
+
+	as->defining = NULL;
+	if (is_macro != (m->name != NULL)) {
+		error(as, "%s at line %d closed by %s", m->name ? ".macro" : ".rept", m->lineno,
+				is_macro ? ".endm" : ".endr");
+		free_macro(m);
+		return;
+	}
+	if (m->broken) {
+		free_macro(m);
+		return;
+	}
+	if (m->name) {
+		m->next = as->macros;
+		as->macros = m;
+		return;
+	}
+	for (r = 0; r < m->count; r++)
+		for (i = 0; i < m->nlines; i++)
+			assemble_copy(as, m->lines[i]);
+	free_macro(m);
+}
+/* keeps a body line of the .macro or .rept being defined */
+static void collect(struct chip8_asm *as, const char *line)
+{
+	struct c8asm_macro *m = as->defining;
+	const char *s = line + strspn(line, " \t\r");
+	size_t n = strcspn(s, " \t\r\n");
+
+	if ((n == 6 && !strncmp(s, ".macro", 6)) || (n == 5 && !strncmp(s, ".rept", 5))) {
+		as->nesting++;
+	} else if (n == 5 && (!strncmp(s, ".endm", 5) || !strncmp(s, ".endr", 5))) {
+		if (!as->nesting) {
+			end_block(as, s[4] == 'm');
+			return;
+		}
+		as->nesting--;
+	}
+	if (grow(&m->lines, &m->lines_cap, m->nlines + 1, sizeof(*m->lines)) ||
+			!(m->lines[m->nlines] = strdup(line))) {
+		error(as, "out of memory");
+		return;
+	}
+	m->nlines++;
+}
+/* a section starting here, or a new name for an empty one */
+static void add_section(struct chip8_asm *as, const char *name)
+{
+	struct c8asm_section *sec;
+	char *copy = strdup(name);
+
+	if (!copy)
+		goto oom;
+	if (as->nsections && as->sections[as->nsections - 1].addr == PROGRAM_MEM + as->len) {
+		sec = &as->sections[as->nsections - 1];
+		free(sec->name);
+	} else {
+		if (grow(&as->sections, &as->sections_cap, as->nsections + 1, sizeof(*as->sections)))
+			goto oom;
+		sec = &as->sections[as->nsections++];
+	}
+	sec->name = copy;
+	sec->addr = PROGRAM_MEM + as->len;
+	return;
+oom:
+	free(copy);
+	error(as, "out of memory");
+}
+static int is_name(struct chip8_asm *as, const char *str)
+{
+	if (!is_ident(str) || is_cooked_label(str) || is_register(str) || find_op(str)) {
+		error(as, "bad name: %s", str);
+		return 0;
+	}
+	return 1;
+}
+/* .equ, .define, .macro and .rept; 0 if tok[0] is none of them */
+static int directive(struct chip8_asm *as, int n)
+{
+	char **tok = as->tok;
+	struct c8asm_label *sym;
+	struct c8asm_macro *m;
+	long v;
+	int i;
+
+	if (!strcmp(tok[0], ".equ") || !strcmp(tok[0], ".define")) {
+		if (n != 3) {
+			error(as, "%s takes a name and a value", tok[0]);
+			return 1;
+		}
+		if (!is_name(as, tok[1]) || eval_const(as, tok[2], &v))
+			return 1;
+		sym = intern_label(as, tok[1], strlen(tok[1]));
+		if (!sym)
+			return 1;
+		/* .define may change a value, .equ sets it once */
+		if (sym->defined && tok[0][1] == 'e') {
+			error(as, "%s already defined at line %d", sym->str, sym->lineno);
+			return 1;
+		}
+		sym->defined = sym->constant = 1;
+		sym->value = v;
+		sym->lineno = as->lineno;
+		return 1;
+	}
+	if (!strcmp(tok[0], ".macro") || !strcmp(tok[0], ".rept")) {
+		m = (struct c8asm_macro *)calloc(1, sizeof(*m));
+		if (!m) {
+			error(as, "out of memory");
+			return 1;
+		}
+		m->lineno = as->lineno;
+		as->defining = m;
+		/* a broken header still collects the body, so it is not assembled */
+		if (tok[0][1] == 'r') {
+			if (n != 2) {
+				error(as, ".rept takes a count");
+				m->broken = 1;
+			} else {
+				m->count = get_const(as, tok[1], 0xffff);
+			}
+			return 1;
+		}
+		m->name = strdup(n > 1 ? tok[1] : "?");
+		if (!m->name) {
+			error(as, "out of memory");
+			as->defining = NULL;
+			free(m);
+			return 1;
+		}
+		if (n < 2 || !is_name(as, tok[1])) {
+			m->broken = 1;
+		} else if (find_macro(as, tok[1])) {
+			error(as, "macro %s already defined", tok[1]);
+			m->broken = 1;
+		} else {
+			m->nparams = n - 2;
+			m->params = (char **)calloc(n, sizeof(*m->params));
+			for (i = 0; m->params && i < m->nparams; i++)
+				if (!is_ident(tok[i + 2]) || !(m->params[i] = strdup(tok[i + 2])))
+					break;
+			if (!m->params || i < m->nparams) {
+				error(as, "bad .macro parameter");
+				m->broken = 1;
+			}
+		}
+		as->nesting = 0;
+		return 1;
+	}
+	if (!strcmp(tok[0], ".global")) {
+		for (i = 1; i < n; i++) {
+			if (!is_cooked_label(tok[i]) || !is_ident(tok[i])) {
+				error(as, "bad label: %s", tok[i]);
+				continue;
+			}
+			sym = intern_label(as, tok[i], strlen(tok[i]));
+			if (sym)
+				sym->global = 1;
+		}
+		return 1;
+	}
+	if (!strcmp(tok[0], ".section")) {
+		if (n > 2) {
+			error(as, ".section takes a name");
+			return 1;
+		}
+		add_section(as, n > 1 ? tok[1] : "-");
+		return 1;
+	}
+	if (!strcmp(tok[0], ".endm") || !strcmp(tok[0], ".endr")) {
+		error(as, "%s without %s", tok[0], tok[0][4] == 'm' ? ".macro" : ".rept");
+		return 1;
+	}
+	return 0;
+}
+/* a source line, or one out of a macro or .rept body */
+static void assemble_line(struct chip8_asm *as, char *line)
+{
+	const struct op *ope;
+	struct c8asm_macro *m;
+	int n;
+
+	if (as->defining) {
+		collect(as, line);
+		return;
+	}
+	as->ref = NULL;
+	as->wflags = 0;
+	n = lex(as, line);
+	if (!n)
+		return;
+	if (is_raw_label(as->tok[0])) {
+		if (n > 1)
+			error(as, "junk after label: %s", as->tok[1]);
+		add_label(as, as->tok[0], PROGRAM_MEM + as->len);
+		return;
+	}
+
+	if (as->tok[0][0] == '.' && directive(as, n))
+		return;
+	ope = find_op(as->tok[0]);
+	if (!ope) {
+		m = find_macro(as, as->tok[0]);
+		if (m)
+			expand_macro(as, m, n);
+		else
+			error(as, "bad op: %s", as->tok[0]);
+		return;
+	}
+	if (n - 1 != ope->nargs) {
+		error(as, "%s takes %d operand%s", ope->name, ope->nargs, ope->nargs == 1 ? "" : "s");
+		/* keep the addresses of the following labels right */
+		emit(as, 0);
+		return;
+	}
+	emit(as, ope->fun(as, &as->tok[1]));
+}
+/* assembles the next line of source, line is modified */
+void chip8_asm_line(struct chip8_asm *as, char *line)
+{
+	as->lineno++;
+	as->line_failed = 0;
+	assemble_line(as, line);
+}
+static int is_skip(u16 op)
+{
+	return chip8_insns[chip8_decode_table[op]].flags & IF_SKIP;
+}
+/* 3XNN <-> 4XNN, 5XY0 <-> 9XY0, EX9E <-> EXA1 */
+static u16 invert_skip(u16 op)
+{
+	switch (op >> 12) {
+		case 0x3:
+			return op + 0x1000;
+		case 0x4:
+			return op - 0x1000;
+		case 0x5:
+			return op + 0x4000;
+		case 0x9:
+			return op - 0x4000;
+	}
+	return (op & 0xff00) | ((op & 0xff) == 0x9e ? 0xa1 : 0x9e);
+}
+#define WORD(addr)	(((addr) - PROGRAM_MEM) / 2)
+#define IS_CODE(i)	(!(w[i].flags & W_DATA))
+#define IS_JUMP(op)	((op) >> 12 == 0x1)
+
+/*
+ * Peephole pass for -O, run over the resolved program until nothing
+ * changes:
+ *  - a jump or call to a jump goes straight to the final target
+ *  - code after an unconditional jump, ret or hlt is dropped up to the
+ *    next label or .byte
+ *  - a jump to the next instruction is dropped
+ *  - runs of 7XNN on the same register fold into the 6XNN or 7XNN before
+ *  - a skip over a jump over one instruction becomes the inverted skip
+ * Nothing is changed right after a skip, or after a .byte that might be
+ * one. Dropping code moves everything after it and the labels with it,
+ * which a numeric address into the program or a BNNN table would not
+ * survive, so then only jumps are threaded.
+ */
+static void optimize(struct chip8_asm *as)
+{
+	struct c8asm_word *w = as->words;
+	struct c8asm_label *lbl;
+	size_t n = as->len / 2, i, k, kept;
+	long prev;
+	int movable = 1, changed, hops;
+	u8 *target = NULL, *dead = NULL;
+	size_t *pos = NULL;
+	u16 *op = NULL, o;
+
+	op = (u16 *)malloc((n + 1) * sizeof(*op));
+	pos = (size_t *)malloc((n + 1) * sizeof(*pos));
+	target = (u8 *)malloc(n + 1);
+	dead = (u8 *)malloc(n + 1);
+	/* the program is fine as it is */
+	if (!op || !pos || !target || !dead || !n)
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		op[i] = (as->code[2 * i] << 8) | as->code[2 * i + 1];
+		if (w[i].flags & W_ABS || (IS_CODE(i) && op[i] >> 12 == 0xb))
+			movable = 0;
+	}
+	do {
+		changed = 0;
+		memset(target, 0, n + 1);
+		for (lbl = as->labels; lbl; lbl = lbl->next)
+			if (lbl->defined && !lbl->constant && WORD(lbl->insn) <= n)
+				target[WORD(lbl->insn)] = 1;
+
+		for (i = 0; i < n; i++) {
+			if (!IS_CODE(i) || !w[i].ref || (op[i] >> 12 != 0x1 && op[i] >> 12 != 0x2))
+				continue;
+			lbl = w[i].ref;
+			for (hops = 0; hops < 16; hops++) {
+				k = WORD(lbl->insn);
+				if (k >= n || !IS_CODE(k) || !IS_JUMP(op[k]) || !w[k].ref || w[k].ref == lbl)
+					break;
+				lbl = w[k].ref;
+				/* a loop of jumps, any of them is as good */
+				if (lbl == w[i].ref)
+					break;
+			}
+			if (lbl != w[i].ref) {
+				w[i].ref = lbl;
+				op[i] = (op[i] & 0xf000) | lbl->insn;
+				changed = 1;
+			}
+		}
+		if (!movable)
+			continue;
+
+		memset(dead, 0, n);
+		prev = -1;
+		for (i = 0; i < n; i++) {
+			if (dead[i] || !IS_CODE(i)) {
+				if (!dead[i])
+					prev = i;
+				continue;
+			}
+			o = op[i];
+			if (prev >= 0 && (!IS_CODE(prev) || is_skip(op[prev]))) {
+				prev = i;
+				continue;
+			}
+			if (IS_JUMP(o) && w[i].ref && WORD(w[i].ref->insn) == i + 1) {
+				dead[i] = changed = 1;
+				continue;
+			}
+			if (IS_JUMP(o) || o == 0x00ee || o == 0x00ff) {
+				for (k = i + 1; k < n && !target[k] && IS_CODE(k); k++)
+					dead[k] = changed = 1;
+			} else if (o >> 12 == 0x6 || o >> 12 == 0x7) {
+				for (k = i + 1; k < n && !target[k] && IS_CODE(k) &&
+						(op[k] & 0xff00) == (0x7000 | (o & 0x0f00)); k++) {
+					o = (o & 0xff00) | ((o + op[k]) & 0xff);
+					dead[k] = changed = 1;
+				}
+				op[i] = o;
+			} else if (is_skip(o) && i + 2 < n && IS_CODE(i + 1) && IS_CODE(i + 2) &&
+					!target[i + 1] && IS_JUMP(op[i + 1]) && w[i + 1].ref &&
+					WORD(w[i + 1].ref->insn) == i + 3) {
+				op[i] = invert_skip(o);
+				dead[i + 1] = changed = 1;
+			}
+			prev = i;
+		}
+
+		/* squeeze out the dead words, labels and references follow */
+		for (i = kept = 0; i < n; i++) {
+			pos[i] = kept;
+			if (dead[i])
+				continue;
+			op[kept] = op[i];
+			w[kept] = w[i];
+			kept++;
+		}
+		pos[n] = kept;
+		if (kept == n)
+			continue;
+		for (lbl = as->labels; lbl; lbl = lbl->next)
+			if (lbl->defined && !lbl->constant && WORD(lbl->insn) <= n)
+				lbl->insn = PROGRAM_MEM + 2 * pos[WORD(lbl->insn)];
+		n = kept;
+		for (i = 0; i < n; i++)
+			if (w[i].ref)
+				op[i] = (op[i] & 0xf000) | w[i].ref->insn;
+	} while (changed);
+
+	for (i = 0; i < n; i++) {
+		as->code[2 * i] = op[i] >> 8;
+		as->code[2 * i + 1] = op[i] & 0xff;
+	}
+	/* a caller's buffer is left as if the removed code was never there */
+	memset(&as->code[2 * n], 0, as->len - 2 * n);
+	as->len = 2 * n;
+out:
+	free(op);
+	free(pos);
+	free(target);
+	free(dead);
+}
+
+static void add_reloc(struct chip8_asm *as, struct c8asm_fixup *f, struct c8asm_label *sym, long addend)
+{
+	struct c8asm_reloc *r;
+
+	if (grow(&as->relocs, &as->relocs_cap, as->nrelocs + 1, sizeof(*as->relocs))) {
+		error(as, "out of memory");
+		return;
+	}
+	r = &as->relocs[as->nrelocs++];
+	r->addr = f->pc;
+	r->mask = f->max;
+	r->sym = sym;
+	r->addend = addend;
+}
+static long eval_moved(struct chip8_asm *as, struct c8asm_fixup *f, struct expr *e, long bias, long ext_bias)
+{
+	memset(e, 0, sizeof(*e));
+	e->as = as;
+	e->p = f->expr;
+	e->pc = f->pc;
+	e->final = e->imports = 1;
+	e->bias = bias;
+	e->ext_bias = ext_bias;
+	return eval(e);
+}
+/*
+ * The value of a fixup in a module, 0 if there is something to patch.
+ * A plain label is a relocation against this module or an import. An
+ * expression is evaluated again with the module, then its import,
+ * moved: a result that moves with neither is a constant, one that moves
+ * with exactly one of them becomes a relocation, anything else cannot
+ * be linked.
+ */
+static int relocate(struct chip8_asm *as, struct c8asm_fixup *f, unsigned *v)
+{
+	struct expr e;
+	long v0, dl, de = 0;
+
+	*v = 0;
+	if (!f->expr) {
+		if (!f->lbl->defined) {
+			add_reloc(as, f, f->lbl, 0);
+			return 0;
+		}
+		if (f->lbl->insn > 0xfff) {
+			error(as, "label %s at %#x is out of reach", f->lbl->str, f->lbl->insn);
+			return -1;
+		}
+		add_reloc(as, f, NULL, f->lbl->insn);
+		*v = f->lbl->insn;
+		return 0;
+	}
+	v0 = eval_moved(as, f, &e, 0, 0);
+	if (e.error)
+		return -1;
+	dl = eval_moved(as, f, &e, RELOC_PROBE, 0) - v0;
+	if (e.ext)
+		de = eval_moved(as, f, &e, 0, RELOC_PROBE) - v0;
+	if (!dl && !de) {
+		*v = in_range(as, f->expr, v0, f->max);
+	} else if (dl == RELOC_PROBE && !de && v0 >= 0) {
+		*v = in_range(as, f->expr, v0, f->max);
+		add_reloc(as, f, NULL, v0);
+	} else if (!dl && de == RELOC_PROBE && e.exts == 1) {
+		add_reloc(as, f, e.ext, v0);
+	} else {
+		error(as, "%s cannot be relocated", f->expr);
+	}
+	return as->line_failed ? -1 : 0;
+}
+/*
+ * Resolves forward references and runs the optimizer if asked to.
+ * Returns the number of diagnostics.
+ */
+int chip8_asm_finish(struct chip8_asm *as)
+{
+	struct c8asm_fixup *f;
+	struct c8asm_label *lbl;
+	struct expr e;
+	unsigned v;
+	size_t i;
+	int lineno = as->lineno;
+
+	if (as->defining)
+		diag_at(as, as->defining->lineno, "%s without %s", as->defining->name ? ".macro" : ".rept",
+				as->defining->name ? ".endm" : ".endr");
+	for (i = 0; i < as->nfixups; i++) {
+		f = &as->fixups[i];
+		if (as->relocatable) {
+			as->lineno = f->lineno;
+			as->line_failed = 0;
+			if (relocate(as, f, &v))
+				continue;
+		} else if (f->expr) {
+			/* report against the line the expression is on */
+			as->lineno = f->lineno;
+			as->line_failed = 0;
+			memset(&e, 0, sizeof(e));
+			e.as = as;
+			e.p = f->expr;
+			e.pc = f->pc;
+			e.final = 1;
+			v = in_range(as, f->expr, eval(&e), f->max);
+			if (e.error || as->line_failed)
+				continue;
+		} else if (!f->lbl->defined) {
+			diag_at(as, f->lineno, "undefined label: %s", f->lbl->str);
+			continue;
+		} else if (f->lbl->insn > 0xfff) {
+			diag_at(as, f->lineno, "label %s at %#x is out of reach", f->lbl->str, f->lbl->insn);
+			continue;
+		} else {
+			v = f->lbl->insn;
+		}
+		if (f->off + 2 > as->len)
+			continue;
+		as->code[f->off] = (as->code[f->off] & ~(f->max >> 8)) | v >> 8;
+		as->code[f->off + 1] = (as->code[f->off + 1] & ~f->max) | (v & 0xff);
+	}
+	as->lineno = lineno;
+	for (lbl = as->labels; lbl; lbl = lbl->next)
+		if (lbl->global && !lbl->defined)
+			diag_at(as, lbl->lineno, "global label %s is not defined", lbl->str);
+	/* the linker places modules, code in them cannot move */
+	if (as->optimize && !as->relocatable && !as->ndiags)
+		optimize(as);
+	return as->ndiags;
+}
+static int label_cmp(const void *a, const void *b)
+{
+	const struct c8asm_label *la = *(struct c8asm_label * const *)a;
+	const struct c8asm_label *lb = *(struct c8asm_label * const *)b;
+
+	if (la->insn != lb->insn)
+		return (int)la->insn - (int)lb->insn;
+	return la->lineno - lb->lineno;
+}
+/*
+ * Writes the debug symbols chip8_sym_read() loads: labels by address,
+ * the source line of each word that is not on the line after the word
+ * before and the runs of .byte data. Needs symbols set before
+ * assembling. Returns 0 on success.
+ */
+int chip8_asm_write_symbols(struct chip8_asm *as, FILE *fp, const char *src)
+{
+	struct c8asm_label **sorted, *lbl;
+	size_t i, k, n = 0;
+	int line = -1;
+
+	if (!as->symbols)
+		return -1;
+	sorted = (struct c8asm_label **)malloc((as->nlabels + 1) * sizeof(*sorted));
+	if (!sorted)
+		return -1;
+	for (lbl = as->labels; lbl; lbl = lbl->next)
+		if (lbl->defined && !lbl->constant)
+			sorted[n++] = lbl;
+	qsort(sorted, n, sizeof(*sorted), label_cmp);
+
+	fprintf(fp, "f %s\n", src);
+	for (i = 0; i < n; i++)
+		fprintf(fp, "l %x %s\n", sorted[i]->insn, sorted[i]->str);
+	for (i = 0; i < as->len / 2; i++, line++) {
+		if (as->words[i].lineno == line)
+			continue;
+		line = as->words[i].lineno;
+		fprintf(fp, "s %zx %d\n", PROGRAM_MEM + 2 * i, line);
+	}
+	for (i = 0; i < as->len / 2; i = k) {
+		for (k = i; k < as->len / 2 && (as->words[k].flags & W_DATA); k++)
+			;
+		if (k > i)
+			fprintf(fp, "d %zx %zx\n", PROGRAM_MEM + 2 * i, PROGRAM_MEM + 2 * k);
+		else
+			k++;
+	}
+	fprintf(fp, "e %zx\n", PROGRAM_MEM + as->len);
+	free(sorted);
+	return ferror(fp) ? -1 : 0;
+}
+/*
+ * Writes a finished relocatable module for chip8ld, text, one record a
+ * line, addresses in hex as assembled from PROGRAM_MEM:
+ *
+ *	c8obj 1
+ *	m <source file>
+ *	s <address> <name>		sections in address order
+ *	e <address>			end of the module
+ *	x <address> <label>		.global labels
+ *	r <address> <mask> <target>	patch the bits under mask of the word
+ *					at address with target, a module
+ *					address or label+offset
+ *	d <address> <bytes>		code, 32 bytes a line
+ *
+ * Returns 0 on success.
+ */
+int chip8_asm_write_object(struct chip8_asm *as, FILE *fp, const char *src)
+{
+	struct c8asm_reloc *r;
+	struct c8asm_label *lbl;
+	size_t i, k;
+
+	if (!as->relocatable)
+		return -1;
+	fprintf(fp, "%s\nm %s\n", CHIP8_OBJ_MAGIC, src);
+	if (!as->nsections || as->sections[0].addr != PROGRAM_MEM)
+		fprintf(fp, "s %x -\n", PROGRAM_MEM);
+	for (i = 0; i < as->nsections; i++)
+		fprintf(fp, "s %x %s\n", as->sections[i].addr, as->sections[i].name);
+	fprintf(fp, "e %zx\n", PROGRAM_MEM + as->len);
+	for (lbl = as->labels; lbl; lbl = lbl->next)
+		if (lbl->global && lbl->defined)
+			fprintf(fp, "x %x %s\n", lbl->insn, lbl->str);
+	for (i = 0; i < as->nrelocs; i++) {
+		r = &as->relocs[i];
+		if (!r->sym)
+			fprintf(fp, "r %x %x %lx\n", r->addr, r->mask, r->addend);
+		else if (r->addend)
+			fprintf(fp, "r %x %x %s%c%lx\n", r->addr, r->mask, r->sym->str,
+					r->addend < 0 ? '-' : '+', labs(r->addend));
+		else
+			fprintf(fp, "r %x %x %s\n", r->addr, r->mask, r->sym->str);
+	}
+	for (i = 0; i < as->len; i += 32) {
+		fprintf(fp, "d %zx ", PROGRAM_MEM + i);
+		for (k = i; k < as->len && k < i + 32; k++)
+			fprintf(fp, "%02x", as->code[k]);
+		fputc('\n', fp);
+	}
+	return ferror(fp) ? -1 : 0;
+}
+/*
+ * Assembles a whole source held in memory. Lines are copied out before
+ * being split, so src is left alone. Returns the number of diagnostics.
+ */
+int chip8_assemble(struct chip8_asm *as, const char *src, size_t len)
+{
+	const char *p = src, *end = src + len, *nl;
+	size_t n;
+
+	while (p < end) {
+		nl = memchr(p, '\n', end - p);
+		n = nl ? (size_t)(nl - p) : (size_t)(end - p);
+		if (grow(&as->linebuf, &as->linebuf_cap, n + 1, 1)) {
+			error(as, "out of memory");
+			break;
+		}
+		memcpy(as->linebuf, p, n);
+		as->linebuf[n] = '\0';
+		chip8_asm_line(as, as->linebuf);
+		p += n + 1;
+	}
+	return chip8_asm_finish(as);
+}
+void chip8_asm_free(struct chip8_asm *as)
+{
+	struct c8asm_macro *m;
+	size_t i;
+
+	if (!as->fixed)
+		free(as->code);
+	free(as->diag);
+	for (i = 0; i < as->nfixups; i++)
+		free(as->fixups[i].expr);
+	free(as->fixups);
+	free_macro(as->defining);
+	while ((m = as->macros)) {
+		as->macros = m->next;
+		free_macro(m);
+	}
+	free(as->tok);
+	free(as->linebuf);
+	free(as->words);
+	for (i = 0; i < as->nsections; i++)
+		free(as->sections[i].name);
+	free(as->sections);
+	free(as->relocs);
+	free_labels(as);
+	memset(as, 0, sizeof(*as));
+}
+
+/*
+ * Assembles a .c8 source straight into program memory and makes its
+ * labels and lines the debug symbols. Diagnostics go to stderr as
+ * file:line: message. Returns 0 on success.
+ */
+int chip8_load_source(struct chip8_state *c8, const char *file)
+{
+	struct chip8_asm as;
+	char *src = NULL;
+	uint8_t *code;
+	size_t len = 0, cap = 0, rc;
+	FILE *fp;
+	int i, errors;
+
+	fp = fopen(file, "r");
+	if (!fp) {
+		fprintf(stderr, "cannot open %s\n", file);
+		return -1;
+	}
+	do {
+		if (grow(&src, &cap, len + 4096, 1)) {
+			fclose(fp);
+			free(src);
+			fprintf(stderr, "%s: out of memory\n", file);
+			return -1;
+		}
+		rc = fread(src + len, 1, cap - len, fp);
+		len += rc;
+	} while (rc);
+	if (ferror(fp)) {
+		fclose(fp);
+		free(src);
+		fprintf(stderr, "cannot read %s\n", file);
+		return -1;
+	}
+	fclose(fp);
+
+	code = (uint8_t *)malloc(MEM_SIZE - PROGRAM_MEM);
+	if (!code) {
+		free(src);
+		fprintf(stderr, "%s: out of memory\n", file);
+		return -1;
+	}
+	chip8_asm_init(&as, code, MEM_SIZE - PROGRAM_MEM);
+	as.symbols = 1;
+	errors = chip8_assemble(&as, src, len);
+	for (i = 0; i < as.ndiags; i++)
+		fprintf(stderr, "%s:%d: %s\n", file, as.diag[i].line, as.diag[i].msg);
+	free(src);
+	if (!errors)
+		chip8_write(c8, PROGRAM_MEM, code, as.len);
+	free(code);
+	/* symbols go through the sidecar format, a memory file holds them */
+	if (!errors) {
+		src = NULL;
+		fp = open_memstream(&src, &len);
+		if (fp && !chip8_asm_write_symbols(&as, fp, file) && !fflush(fp)) {
+			fclose(fp);
+			fp = fmemopen(src, len, "r");
+			if (fp)
+				chip8_sym_read(fp);
+		}
+		if (fp)
+			fclose(fp);
+		free(src);
+	}
+	chip8_asm_free(&as);
+	return errors ? -1 : 0;
+}
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "chip8.h"
+
+/*
+ * Drives a ROM through the environment API the way a training loop
+ * would: every machine gets random keys each frame, machines that fault
+ * or exit are reset, and observations are written every step. Reports
+ * frames per second over all machines.
+ */
+
+static uint8_t rom[MEM_SIZE - PROGRAM_MEM];
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(void)
+{
+	die("usage: c8bench [-c core] [-q profile] [-n machines] [-f frames] [-t threads]\n"
+	    "               [-i insns] [-b] [-r addr] [-w frames] [-v|-V] [-T cachedir]\n"
+	    "               [-m socket] [-M secs] romfile\n");
+}
+int main(int argc, char **argv)
+{
+	struct chip8_env_config cfg = { 0 };
+	struct chip8_env *env;
+	uint32_t reward[16];
+	unsigned n = 1024, frames = 1000, f, i, resets = 0;
+	uint16_t *keys;
+	uint8_t *obs, *rew, *done;
+	uint32_t rng = 1;
+	size_t len;
+	double t;
+	const char *sockpath = NULL;
+	unsigned summary = 0;
+	FILE *fp;
+	int opt;
+
+	cfg.obs = C8_OBS_BITS;
+	while ((opt = getopt(argc, argv, "c:q:n:f:t:i:br:w:vVT:m:M:")) != -1) {
+		switch (opt) {
+			case 'c':
+				cfg.core = chip8_find_core(optarg);
+				if (!cfg.core)
+					die("unknown core: %s\n", optarg);
+				break;
+			case 'q':
+				cfg.profile = chip8_find_profile(optarg);
+				if (cfg.profile < 0)
+					die("unknown profile: %s\n", optarg);
+				break;
+			case 'n':
+				n = strtoul(optarg, NULL, 0);
+				break;
+			case 'f':
+				frames = strtoul(optarg, NULL, 0);
+				break;
+			case 't':
+				cfg.threads = strtoul(optarg, NULL, 0);
+				break;
+			case 'i':
+				cfg.insns_per_frame = strtoul(optarg, NULL, 0);
+				break;
+			case 'b':
+				cfg.obs = C8_OBS_BYTES;
+				break;
+			case 'w':
+				cfg.watchdog = strtoul(optarg, NULL, 0);
+				break;
+			case 'v':
+				cfg.vip_timing = 1;
+				break;
+			case 'V':
+				cfg.vip_timing = 2;
+				break;
+			case 'T':
+				cfg.cache_dir = optarg;
+				break;
+			case 'm':
+				sockpath = optarg;
+				break;
+			case 'M':
+				summary = strtoul(optarg, NULL, 0);
+				break;
+			case 'r':
+				/* vN reads a register */
+				if (cfg.nreward == 16)
+					die("at most 16 rewards\n");
+				reward[cfg.nreward++] = optarg[0] == 'v' ? C8_ENV_V(strtoul(optarg + 1, NULL, 16)) :
+						strtoul(optarg, NULL, 0);
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind != argc - 1 || !n)
+		usage();
+	cfg.reward = reward;
+	if (cfg.cache_dir && mkdir(cfg.cache_dir, 0777) && errno != EEXIST)
+		die("cannot create %s\n", cfg.cache_dir);
+	if (sockpath || summary) {
+		cfg.metrics = "c8bench";
+		if (chip8_metrics_serve(sockpath, summary))
+			die("cannot serve metrics on %s\n", sockpath);
+	}
+
+	fp = fopen(argv[optind], "rb");
+	if (!fp)
+		die("cannot open %s\n", argv[optind]);
+	len = fread(rom, 1, sizeof(rom), fp);
+	fclose(fp);
+
+	env = chip8_env_new(n, rom, len, &cfg);
+	if (!env)
+		die("cannot create %u machines\n", n);
+	keys = (uint16_t *)malloc(n * sizeof(*keys));
+	obs = (uint8_t *)malloc(n * chip8_env_obs_size(env));
+	rew = (uint8_t *)malloc(n * cfg.nreward + 1);
+	done = (uint8_t *)malloc(n);
+	if (!keys || !obs || !rew || !done)
+		die("out of memory\n");
+
+	t = now();
+	for (f = 0; f < frames; f++) {
+		for (i = 0; i < n; i++) {
+			rng ^= rng << 13;
+			rng ^= rng >> 17;
+			rng ^= rng << 5;
+			keys[i] = 1 << (rng & 0xf);
+		}
+		chip8_env_step(env, keys, obs, rew, done);
+		for (i = 0; i < n && !done[i]; i++)
+			;
+		if (i < n) {
+			for (; i < n; i++)
+				resets += done[i];
+			chip8_env_reset(env, done, NULL);
+		}
+	}
+	t = now() - t;
+	printf("%u machines, %u frames, %u resets: %.3f s, %.0f frames/s\n",
+			n, frames, resets, t, (double)n * frames / t);
+	if (cfg.vip_timing) {
+		uint64_t vip_frames, cycles = chip8_env_cycles(env, &vip_frames);
+
+		printf("VIP: %llu cycles, %.1f s emulated, %.0fx real time\n",
+				(unsigned long long)cycles, vip_frames / 60.0, vip_frames / 60.0 / t);
+	}
+	if (cfg.nreward) {
+		printf("machine 0 rewards:");
+		for (i = 0; i < cfg.nreward; i++)
+			printf(" %u", rew[i]);
+		printf("\n");
+	}
+	chip8_env_free(env);
+	free(keys);
+	free(obs);
+	free(rew);
+	free(done);
+	return 0;
+}
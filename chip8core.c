@@ -0,0 +1,833 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "chip8.h"
+
+static const uint8_t fonts[] = {
+	0xF0, 0x90, 0x90, 0x90, 0xF0,  /* 0 */
+	0x20, 0x60, 0x20, 0x20, 0x70,  /* 1 */
+	0xF0, 0x10, 0xF0, 0x80, 0xF0,  /* 2 */
+	0xF0, 0x10, 0xF0, 0x10, 0xF0,  /* 3 */
+	0x90, 0x90, 0xF0, 0x10, 0x10,  /* 4 */
+	0xF0, 0x80, 0xF0, 0x10, 0xF0,  /* 5 */
+	0xF0, 0x80, 0xF0, 0x90, 0xF0,  /* 6 */
+	0xF0, 0x10, 0x20, 0x40, 0x40,  /* 7 */
+	0xF0, 0x90, 0xF0, 0x90, 0xF0,  /* 8 */
+	0xF0, 0x90, 0xF0, 0x10, 0xF0,  /* 9 */
+	0xF0, 0x90, 0xF0, 0x90, 0x90,  /* A */
+	0xE0, 0x90, 0xE0, 0x90, 0xE0,  /* B */
+	0xF0, 0x80, 0x80, 0x80, 0xF0,  /* C */
+	0xE0, 0x90, 0x90, 0x90, 0xE0,  /* D */
+	0xF0, 0x80, 0xF0, 0x80, 0xF0,  /* E */
+	0xF0, 0x80, 0xF0, 0x80, 0x80, /* F */
+};
+
+/* 8x10 digits for FX30, SUPER-CHIP has 0-9, XO-CHIP adds A-F */
+static const uint8_t bigfonts[] = {
+	0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF,  /* 0 */
+	0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF,  /* 1 */
+	0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF,  /* 2 */
+	0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF,  /* 3 */
+	0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03,  /* 4 */
+	0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF,  /* 5 */
+	0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF,  /* 6 */
+	0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18,  /* 7 */
+	0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF,  /* 8 */
+	0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF,  /* 9 */
+	0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3,  /* A */
+	0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC,  /* B */
+	0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C,  /* C */
+	0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC,  /* D */
+	0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF,  /* E */
+	0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0,  /* F */
+};
+
+/* c8 must be zeroed, or a machine chip8_init() was called on before */
+void chip8_init(struct chip8_state *c8, uint32_t seed)
+{
+	chip8_release(c8);
+	memset(c8, 0, offsetof(struct chip8_state, mem_private));
+
+	c8->ip = PROGRAM_MEM;
+	c8->mp = 0;
+	c8->sp = 0;
+	/* xorshift must not start from zero */
+	c8->rng = seed ? seed : 0x2545f491;
+	c8->planes = 1;
+
+	chip8_write(c8, FONT_MEM, fonts, sizeof(fonts));
+	chip8_write(c8, BIGFONT_MEM, bigfonts, sizeof(bigfonts));
+}
+static const char *profile_names[C8_NPROFILES] = {
+	"modern",
+	"vip",
+	"schip",
+	"xochip",
+};
+
+int chip8_find_profile(const char *name)
+{
+	int i;
+
+	for (i = 0; i < C8_NPROFILES; i++) {
+		if (!strcmp(profile_names[i], name))
+			return i;
+	}
+	return -1;
+}
+const char *chip8_profile_name(int profile)
+{
+	return profile_names[profile];
+}
+int chip8_load(struct chip8_state *c8, const void *prog, size_t len)
+{
+	if (len > MEM_SIZE - PROGRAM_MEM)
+		return -1;
+	chip8_write(c8, PROGRAM_MEM, prog, len);
+	return 0;
+}
+void chip8_load_prog(struct chip8_state *c8, const char *file)
+{
+	FILE * fp;
+	uint8_t buf[256];
+	unsigned mem = PROGRAM_MEM, end = MEM_SIZE;
+	int rc;
+
+	assert(file);
+
+	fp = fopen(file, "r");
+	if (!fp)
+		die("cannot open %s\n", file);
+	while (!feof(fp) && mem < end) {
+		rc = fread(buf, 1, end - mem < 256 ? end - mem : 256, fp);
+		if (rc == 0) {
+			if (ferror(fp)) {
+				die("cannot load program\n");
+			} else {	/* eof ? */
+				break;
+			}
+		}
+		chip8_write(c8, mem, buf, rc);
+		mem += rc;
+	}
+	fclose(fp);
+}
+/* called at 60Hz by the frontend */
+void chip8_tick(struct chip8_state *c8)
+{
+	if (c8->dt > 0)
+		c8->dt--;
+	if (c8->st > 0)
+		c8->st--;
+}
+/*
+ * Counts the frames in a row in which memory and the display stayed the
+ * same with both timers stopped; whatever its registers do, a program
+ * like that shows nothing new. Hashing them is most of the cost, so it
+ * compares every limit / 8 + 1 frames: a picture that cycles through
+ * the same states in exactly that period without using a timer looks
+ * stuck too. At limit the machine faults C8_STUCK and it returns 1.
+ */
+int chip8_watchdog(struct chip8_watchdog *wd, struct chip8_state *c8)
+{
+	uint64_t h;
+
+	if (!wd->limit || c8->fault)
+		return 0;
+	if (c8->dt || c8->st) {
+		wd->idle = 0;
+		wd->hash = 0;
+		return 0;
+	}
+	if (++wd->idle % (wd->limit / 8 + 1) && wd->idle < wd->limit)
+		return 0;
+	h = chip8_hash_output(c8);
+	if (h != wd->hash) {
+		wd->hash = h;
+		wd->idle = 0;
+		return 0;
+	}
+	if (wd->idle < wd->limit)
+		return 0;
+	chip8_set_fault(c8, C8_STUCK, chip8_fetch(c8));
+	return 1;
+}
+void chip8_dump(const struct chip8_state *c8)
+{
+	printf("CHIP8 State\n");
+	printf("IP 0x%x MP 0x%x SP 0x%x DT %d ST %d\n",
+		c8->ip, c8->mp, c8->sp, c8->dt, c8->st);
+	printf("V0 %d V1 %d V2 %d V3 %d V4 %d V5 %d V6 %d V7 %d\n",
+		c8->v[0], c8->v[1], c8->v[2], c8->v[3], c8->v[4], c8->v[5], c8->v[6], c8->v[7]);
+	printf("V8 %d V9 %d VA %d VB %d VC %d VD %d VE %d VF %d \n",
+		c8->v[8], c8->v[9], c8->v[0xa], c8->v[0xb], c8->v[0xc], c8->v[0xd], c8->v[0xe], c8->v[0xf]);
+	printf("HIRES %d PLANES %d\n", c8->hires, c8->planes);
+	if (chip8_sym_loaded()) {
+		char buf[128];
+		int i;
+
+		printf("AT %s\n", chip8_sym_str(c8->ip, buf, sizeof(buf)));
+		for (i = c8->sp - 1; i >= 0 && i < STACK_DEPTH; i--)
+			printf("  called from %s\n", chip8_sym_str(c8->stack[i] - 2, buf, sizeof(buf)));
+	}
+}
+const char *chip8_fault_str(const struct chip8_state *c8)
+{
+	switch (c8->fault) {
+		case C8_OK:
+			return "ok";
+		case C8_BAD_OP:
+			return "bad op";
+		case C8_STACK_OVERFLOW:
+			return "stack overflow";
+		case C8_STACK_UNDERFLOW:
+			return "stack underflow";
+		case C8_EXIT:
+			return "exit";
+		case C8_HALT:
+			return "halt";
+		case C8_STUCK:
+			return "no progress";
+	}
+	return "unknown fault";
+}
+
+/* clears the selected bitplanes */
+void chip8_clear_screen(struct chip8_state *c8)
+{
+	int p;
+
+	for (p = 0; p < PLANES; p++) {
+		if (c8->planes & (1 << p))
+			memset(c8->fb[p], 0, sizeof(c8->fb[p]));
+	}
+	c8->fb_dirty = 1;
+}
+/*
+ * Sprites are drawn a row at a time: the sprite row is placed at the top
+ * of a display word and rotated (wrapping) or shifted (clipping) into
+ * position, so each row is a single xor whatever the resolution. With
+ * both bitplanes selected the sprite data for the second plane follows
+ * the first.
+ */
+static inline __attribute__((always_inline)) int draw_sprite(struct chip8_state *c8, uint8_t x, uint8_t y,
+		unsigned n, const int wide, const int clip)
+{
+	unsigned width = c8->hires ? SCREEN_WIDTH : LORES_WIDTH;
+	unsigned height = c8->hires ? SCREEN_HEIGHT : LORES_HEIGHT;
+	unsigned shift = x % width;
+	unsigned top = y % height;
+	unsigned stride = wide ? 2 : 1;
+	unsigned i;
+	int p, collision = 0;
+	uint16_t addr, line;
+	uint64_t lo;
+	fb_row_t bits, *row;
+
+	for (p = 0; p < PLANES; p++) {
+		if (!(c8->planes & (1 << p)))
+			continue;
+		addr = c8->mp + (p && (c8->planes & 1) ? n * stride : 0);
+		for (i = 0; i < n; i++, addr += stride) {
+			if (clip && top + i >= height)
+				break;
+			line = chip8_peek(c8, addr) << 8;
+			if (wide)
+				line |= chip8_peek(c8, addr + 1);
+			if (c8->hires) {
+				bits = (fb_row_t)line << 112;
+				if (clip)
+					bits >>= shift;
+				else if (shift)
+					bits = (bits >> shift) | (bits << (128 - shift));
+			} else {
+				lo = (uint64_t)line << 48;
+				if (clip)
+					lo >>= shift;
+				else if (shift)
+					lo = (lo >> shift) | (lo << (64 - shift));
+				bits = (fb_row_t)lo << 64;
+			}
+			row = &c8->fb[p][clip ? top + i : (y + i) % height];
+			if (*row & bits)
+				collision = 1;
+			*row ^= bits;
+		}
+	}
+	c8->fb_dirty = 1;
+	return collision;
+}
+/* DXYN, sprites wrap around both edges */
+int chip8_draw(struct chip8_state *c8, uint8_t x, uint8_t y, uint8_t n)
+{
+	return draw_sprite(c8, x, y, n, 0, 0);
+}
+/* like chip8_draw(), but pixels past the right and bottom edges are dropped */
+int chip8_draw_clip(struct chip8_state *c8, uint8_t x, uint8_t y, uint8_t n)
+{
+	return draw_sprite(c8, x, y, n, 0, 1);
+}
+/* DXY0 on SUPER-CHIP and XO-CHIP: a 16x16 sprite, two bytes per row */
+int chip8_draw16(struct chip8_state *c8, uint8_t x, uint8_t y)
+{
+	return draw_sprite(c8, x, y, 16, 1, 0);
+}
+int chip8_draw16_clip(struct chip8_state *c8, uint8_t x, uint8_t y)
+{
+	return draw_sprite(c8, x, y, 16, 1, 1);
+}
+/* 00FE/00FF, switching resolution clears the display */
+void chip8_set_hires(struct chip8_state *c8, int hires)
+{
+	c8->hires = hires;
+	memset(c8->fb, 0, sizeof(c8->fb));
+	c8->fb_dirty = 1;
+}
+/* scrolls move the selected planes by pixels of the current resolution */
+void chip8_scroll_down(struct chip8_state *c8, unsigned n)
+{
+	unsigned height = c8->hires ? SCREEN_HEIGHT : LORES_HEIGHT;
+	int p;
+
+	if (n > height)
+		n = height;
+	for (p = 0; p < PLANES; p++) {
+		if (!(c8->planes & (1 << p)))
+			continue;
+		memmove(&c8->fb[p][n], &c8->fb[p][0], (height - n) * sizeof(fb_row_t));
+		memset(&c8->fb[p][0], 0, n * sizeof(fb_row_t));
+	}
+	c8->fb_dirty = 1;
+}
+void chip8_scroll_up(struct chip8_state *c8, unsigned n)
+{
+	unsigned height = c8->hires ? SCREEN_HEIGHT : LORES_HEIGHT;
+	int p;
+
+	if (n > height)
+		n = height;
+	for (p = 0; p < PLANES; p++) {
+		if (!(c8->planes & (1 << p)))
+			continue;
+		memmove(&c8->fb[p][0], &c8->fb[p][n], (height - n) * sizeof(fb_row_t));
+		memset(&c8->fb[p][height - n], 0, n * sizeof(fb_row_t));
+	}
+	c8->fb_dirty = 1;
+}
+void chip8_scroll_left(struct chip8_state *c8)
+{
+	int p, y;
+
+	/* the low half of a low resolution row is always clear */
+	for (p = 0; p < PLANES; p++) {
+		if (!(c8->planes & (1 << p)))
+			continue;
+		for (y = 0; y < SCREEN_HEIGHT; y++)
+			c8->fb[p][y] <<= 4;
+	}
+	c8->fb_dirty = 1;
+}
+void chip8_scroll_right(struct chip8_state *c8)
+{
+	fb_row_t mask = c8->hires ? ~(fb_row_t)0 : ~(fb_row_t)0 << 64;
+	int p, y;
+
+	for (p = 0; p < PLANES; p++) {
+		if (!(c8->planes & (1 << p)))
+			continue;
+		for (y = 0; y < SCREEN_HEIGHT; y++)
+			c8->fb[p][y] = (c8->fb[p][y] >> 4) & mask;
+	}
+	c8->fb_dirty = 1;
+}
+/* 0xff means no key pressed */
+uint8_t chip8_wait_input(struct chip8_state *c8)
+{
+	uint8_t i;
+
+	for (i = 0; i < 0x0f; i++) {
+		if (c8->key[i])
+			return i;
+	}
+	return 0xff;
+}
+uint16_t chip8_rand16(struct chip8_state *c8)
+{
+	uint32_t x = c8->rng;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	c8->rng = x;
+	return (uint16_t)(x & 0xffff);
+}
+void chip8_sub_call(struct chip8_state *c8, uint16_t addr)
+{
+	if (c8->sp >= STACK_DEPTH) {
+		chip8_set_fault(c8, C8_STACK_OVERFLOW, 0x2000 | addr);
+		return;
+	}
+	c8->stack[c8->sp++] = c8->ip + 2;
+	c8->ip = addr;
+}
+void chip8_sub_return(struct chip8_state *c8)
+{
+	if (c8->sp < 1) {
+		chip8_set_fault(c8, C8_STACK_UNDERFLOW, 0x00ee);
+		return;
+	}
+	c8->ip = c8->stack[--c8->sp];
+}
+
+/*
+ * Reference interpreter: one handler per high nibble, each returning the
+ * number of instructions to advance ip by. Other cores are checked
+ * against this one. Handlers whose behaviour depends on the profile take
+ * it as a constant and are specialised per profile below.
+ */
+static inline int op0(struct chip8_state *c8, uint16_t op, const int q)
+{
+	switch (opNNN) {
+		case 0x0e0:
+			chip8_clear_screen(c8);
+			return 1;
+		case 0x0ee:
+			chip8_sub_return(c8);
+			return 0;
+		case 0x0fb:
+			if (!(QUIRKS(q) & Q_HIRES))
+				break;
+			chip8_scroll_right(c8);
+			return 1;
+		case 0x0fc:
+			if (!(QUIRKS(q) & Q_HIRES))
+				break;
+			chip8_scroll_left(c8);
+			return 1;
+		case 0x0fd:
+			if (!(QUIRKS(q) & Q_HIRES))
+				break;
+			chip8_set_fault(c8, C8_EXIT, op);
+			return 0;
+		case 0x0fe:
+			if (!(QUIRKS(q) & Q_HIRES))
+				break;
+			chip8_set_hires(c8, 0);
+			return 1;
+		case 0x0ff:
+			/* hlt, where it is not SUPER-CHIP's hires */
+			if (!(QUIRKS(q) & Q_HIRES)) {
+				chip8_set_fault(c8, C8_HALT, op);
+				return 0;
+			}
+			chip8_set_hires(c8, 1);
+			return 1;
+		default:
+			if ((QUIRKS(q) & Q_HIRES) && (opNNN & 0xff0) == 0x0c0) {
+				chip8_scroll_down(c8, opN);
+				return 1;
+			}
+			if ((QUIRKS(q) & Q_XO) && (opNNN & 0xff0) == 0x0d0) {
+				chip8_scroll_up(c8, opN);
+				return 1;
+			}
+			break;
+	};
+
+	chip8_set_fault(c8, C8_BAD_OP, op);
+	return 0;
+}
+
+static int op1(struct chip8_state *c8, uint16_t op)
+{
+	if (chip8_jump_halts(c8, op)) {
+		chip8_set_fault(c8, C8_HALT, op);
+		return 0;
+	}
+	c8->ip = opNNN;
+	return 0;
+}
+
+static int op2(struct chip8_state *c8, uint16_t op)
+{
+	chip8_sub_call(c8, opNNN);
+	return 0;
+}
+
+/* skips return 1 + the size of the skipped instruction in words */
+static inline int op3(struct chip8_state *c8, uint16_t op, const int q)
+{
+	if (c8->v[opX] == opNN) {
+		return 1 + chip8_skip_size(c8, q) / 2;
+	}
+	return 1;
+}
+
+static inline int op4(struct chip8_state *c8, uint16_t op, const int q)
+{
+	if (c8->v[opX] != opNN)
+		return 1 + chip8_skip_size(c8, q) / 2;
+	return 1;
+}
+
+static inline int op5(struct chip8_state *c8, uint16_t op, const int q)
+{
+	int i, d = opX <= opY ? 1 : -1;
+
+	switch (opN) {
+		case 0:
+			if (c8->v[opX] == c8->v[opY])
+				return 1 + chip8_skip_size(c8, q) / 2;
+			return 1;
+		case 2:
+			if (!(QUIRKS(q) & Q_XO))
+				break;
+			/* VX..VY, in either direction, I is left alone */
+			for (i = 0; opX + i * d != opY + d; i++)
+				chip8_poke(c8, c8->mp + i, c8->v[opX + i * d]);
+			return 1;
+		case 3:
+			if (!(QUIRKS(q) & Q_XO))
+				break;
+			for (i = 0; opX + i * d != opY + d; i++)
+				c8->v[opX + i * d] = chip8_peek(c8, c8->mp + i);
+			return 1;
+	}
+	chip8_set_fault(c8, C8_BAD_OP, op);
+	return 0;
+}
+
+static int op6(struct chip8_state *c8, uint16_t op)
+{
+	c8->v[opX] = opNN;
+	return 1;
+}
+
+static int op7(struct chip8_state *c8, uint16_t op)
+{
+	c8->v[opX] += opNN;
+	return 1;
+}
+
+static inline int op8(struct chip8_state *c8, uint16_t op, const int q)
+{
+	uint8_t *vx, *vy, *vf;
+
+	vx = &c8->v[opX];
+	vy = &c8->v[opY];
+	vf = &c8->v[0xf];
+
+	switch (opN) {
+		case 0:
+			*vx = *vy;
+			break;
+		case 1:
+			*vx |= *vy;
+			if (QUIRKS(q) & Q_VF_RESET)
+				*vf = 0;
+			break;
+		case 2:
+			*vx &= *vy;
+			if (QUIRKS(q) & Q_VF_RESET)
+				*vf = 0;
+			break;
+		case 3:
+			*vx ^= *vy;
+			if (QUIRKS(q) & Q_VF_RESET)
+				*vf = 0;
+			break;
+		case 4:
+			*vx += *vy;
+			/* carry ? */
+			if (*vx < *vy) {
+				*vf= 1;
+			}
+			else {
+				*vf = 0;
+			}
+			break;
+		case 5:
+			/* borrow ? */
+			if (*vx < *vy) {
+				*vf = 1;
+			} else {
+				*vf = 0;
+			}
+			*vx -= *vy;
+			break;
+		case 6:
+			if (QUIRKS(q) & Q_SHIFT_VY) {
+				uint8_t src = *vy;
+				*vx = src >> 1;
+				*vf = src & 0x1;
+				break;
+			}
+			*vf = (*vx & 0x1);
+			*vx = (*vx >> 1);
+			break;
+		case 7:
+			/* borrow ? */
+			if (*vy < *vx) {
+				*vf = 1;
+			} else {
+				*vf = 0;
+			}
+			*vx = *vy - *vx;
+			break;
+		case 0xE:
+			if (QUIRKS(q) & Q_SHIFT_VY) {
+				uint8_t src = *vy;
+				*vx = src << 1;
+				*vf = (src & 0x80) >> 7;
+				break;
+			}
+			*vf = ((*vx & 0x80) >> 7);
+			*vx = (*vx << 1);
+			break;
+		default:
+			chip8_set_fault(c8, C8_BAD_OP, op);
+			return 0;
+	}
+	return 1;
+}
+
+static inline int op9(struct chip8_state *c8, uint16_t op, const int q)
+{
+	if (opN != 0) {
+		chip8_set_fault(c8, C8_BAD_OP, op);
+		return 0;
+	}
+	if (c8->v[opX] != c8->v[opY])
+		return 1 + chip8_skip_size(c8, q) / 2;
+	return 1;
+}
+
+static int opa(struct chip8_state *c8, uint16_t op)
+{
+	c8->mp = opNNN;
+	return 1;
+}
+
+static inline int opb(struct chip8_state *c8, uint16_t op, const int q)
+{
+	if (QUIRKS(q) & Q_JUMP_VX)
+		c8->ip = c8->v[opX] + opNNN;
+	else
+		c8->ip = c8->v[0] + opNNN;
+	return 0;
+}
+
+static int opc(struct chip8_state *c8, uint16_t op)
+{
+	c8->v[opX] = opNN & chip8_rand16(c8);
+	return 1;
+}
+
+static inline int opd(struct chip8_state *c8, uint16_t op, const int q)
+{
+	if ((QUIRKS(q) & Q_HIRES) && opN == 0) {
+		if (QUIRKS(q) & Q_CLIP)
+			c8->v[0xf] = chip8_draw16_clip(c8, c8->v[opX], c8->v[opY]);
+		else
+			c8->v[0xf] = chip8_draw16(c8, c8->v[opX], c8->v[opY]);
+	} else if (QUIRKS(q) & Q_CLIP)
+		c8->v[0xf] = chip8_draw_clip(c8, c8->v[opX], c8->v[opY], opN);
+	else
+		c8->v[0xf] = chip8_draw(c8, c8->v[opX], c8->v[opY], opN);
+	return 1;
+}
+
+static inline int ope(struct chip8_state *c8, uint16_t op, const int q)
+{
+	uint8_t key = c8->v[opX] & 0xf;
+
+	switch (opNN) {
+		case 0x9e:
+			if (c8->key[key] != 0) {
+				return 1 + chip8_skip_size(c8, q) / 2;
+			}
+			break;
+		case 0xa1:
+			if (c8->key[key] == 0) {
+				return 1 + chip8_skip_size(c8, q) / 2;
+			}
+			break;
+		default:
+			chip8_set_fault(c8, C8_BAD_OP, op);
+			return 0;
+	}
+
+	return 1;
+}
+
+static inline int opf(struct chip8_state *c8, uint16_t op, const int q)
+{
+	uint8_t *vx = &c8->v[opX];
+	int i;
+
+	switch (opNN) {
+		case 0x00:
+			/* F000 NNNN: I = NNNN, the only 4 byte instruction */
+			if (!(QUIRKS(q) & Q_XO) || opX)
+				goto bad_op;
+			c8->mp = (chip8_peek(c8, c8->ip + 2) << 8) | chip8_peek(c8, c8->ip + 3);
+			return 2;
+		case 0x01:
+			if (!(QUIRKS(q) & Q_XO) || opX >= (1 << PLANES))
+				goto bad_op;
+			c8->planes = opX;
+			return 1;
+		case 0x02:
+			if (!(QUIRKS(q) & Q_XO) || opX)
+				goto bad_op;
+			for (i = 0; i < 16; i++)
+				c8->pattern[i] = chip8_peek(c8, c8->mp + i);
+			return 1;
+		case 0x07:
+			*vx = c8->dt;
+			break;
+		case 0x0a:
+			*vx = chip8_wait_input(c8);
+			/*if no key was pressed, redo this instruction */
+			if (*vx == 0xff)
+				c8->ip -= 2;
+			break;
+		case 0x15:
+			c8->dt = *vx;
+			break;
+		case 0x18:
+			c8->st = *vx;
+			break;
+		case 0x1e:
+			c8->mp += *vx;
+			break;
+		case 0x29:
+			c8->mp = (*vx) * 5;
+			break;
+		case 0x30:
+			if (!(QUIRKS(q) & Q_HIRES))
+				goto bad_op;
+			c8->mp = BIGFONT_MEM + (*vx) * 10;
+			break;
+		case 0x33:
+			chip8_poke(c8, c8->mp, (*vx) / 100);
+			chip8_poke(c8, c8->mp + 1, ((*vx) % 100) / 10);
+			chip8_poke(c8, c8->mp + 2, (*vx) % 10);
+			break;
+		case 0x3a:
+			if (!(QUIRKS(q) & Q_XO))
+				goto bad_op;
+			c8->pitch = *vx;
+			break;
+		case 0x55:
+			for (i = 0; i <= opX; i++) {
+				chip8_poke(c8, c8->mp + i, c8->v[i]);
+			}
+			if (QUIRKS(q) & Q_MEM_INC)
+				c8->mp += opX + 1;
+			break;
+		case 0x65:
+			for (i = 0; i <= opX; i++) {
+				c8->v[i] = chip8_peek(c8, c8->mp + i);
+			}
+			if (QUIRKS(q) & Q_MEM_INC)
+				c8->mp += opX + 1;
+			break;
+		case 0x75:
+			if (!(QUIRKS(q) & Q_HIRES))
+				goto bad_op;
+			memcpy(c8->flags, c8->v, opX + 1);
+			break;
+		case 0x85:
+			if (!(QUIRKS(q) & Q_HIRES))
+				goto bad_op;
+			memcpy(c8->v, c8->flags, opX + 1);
+			break;
+		default:
+			goto bad_op;
+	}
+	return 1;
+bad_op:
+	chip8_set_fault(c8, C8_BAD_OP, op);
+	return 0;
+}
+
+typedef int (*op_fun_t) (struct chip8_state *, uint16_t);
+
+#define SPECIALISE(fn, p, suffix) \
+static int fn##_##suffix(struct chip8_state *c8, uint16_t op) \
+{ \
+	return fn(c8, op, p); \
+}
+#define OPTABLES(p, suffix) \
+SPECIALISE(op0, p, suffix) \
+SPECIALISE(op3, p, suffix) \
+SPECIALISE(op4, p, suffix) \
+SPECIALISE(op5, p, suffix) \
+SPECIALISE(op8, p, suffix) \
+SPECIALISE(op9, p, suffix) \
+SPECIALISE(opb, p, suffix) \
+SPECIALISE(opd, p, suffix) \
+SPECIALISE(ope, p, suffix) \
+SPECIALISE(opf, p, suffix) \
+static op_fun_t optables_##suffix[] = { \
+	op0_##suffix, op1, op2, op3_##suffix, op4_##suffix, op5_##suffix, op6, op7, \
+	op8_##suffix, op9_##suffix, opa, opb_##suffix, opc, opd_##suffix, ope_##suffix, opf_##suffix, \
+};
+
+OPTABLES(C8_MODERN, modern)
+OPTABLES(C8_VIP, vip)
+OPTABLES(C8_SCHIP, schip)
+OPTABLES(C8_XOCHIP, xochip)
+
+static op_fun_t *const optables[C8_NPROFILES] = {
+	optables_modern,
+	optables_vip,
+	optables_schip,
+	optables_xochip,
+};
+
+static void chip8_decode(struct chip8_state *c8, uint16_t op, op_fun_t *table)
+{
+	uint16_t n;
+
+	/*
+	 * c8->ip += 2 * table[opC](op);
+	 * This is wrong because op_fun may modify c8->ip !
+	 */
+	n = table[opC](c8, op);
+	c8->ip += 2 * n;
+}
+
+unsigned chip8_run_optables(struct chip8_state *c8, unsigned n)
+{
+	op_fun_t *table = optables[c8->profile];
+	unsigned i;
+
+	for (i = 0; i < n && !c8->fault; i++)
+		chip8_decode(c8, chip8_fetch(c8), table);
+	return i;
+}
+
+const struct chip8_core chip8_cores[] = {
+	{"optables", chip8_run_optables},
+	{"switch", chip8_run_switch},
+	{"fused", chip8_run_fused, chip8_fused_report, chip8_fused_open, chip8_fused_save,
+		chip8_fused_release},
+	{"cover", chip8_run_cover},
+	{NULL, NULL},
+};
+
+const struct chip8_core *chip8_find_core(const char *name)
+{
+	const struct chip8_core *core;
+
+	for (core = chip8_cores; core->name; core++) {
+		if (!strcmp(core->name, name))
+			return core;
+	}
+	return NULL;
+}
@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "chip8.h"
+
+/*
+ * Coverage maps the cover core fills, a bit per address: instructions
+ * run there, skips there taken and skips there not taken. Files are
+ * text, a line per map word with any bit set:
+ *
+ *	c8cov 1
+ *	x <hex address> <hex bits>	executed, bit n is address + n
+ *	t <hex address> <hex bits>	skip taken
+ *	n <hex address> <hex bits>	skip not taken
+ *
+ * so reading one merges it into what is already there.
+ */
+
+#define COV_MAGIC	"c8cov 1"
+
+uint64_t chip8_cov_exec[C8_COV_WORDS];
+uint64_t chip8_cov_taken[C8_COV_WORDS];
+uint64_t chip8_cov_not_taken[C8_COV_WORDS];
+
+static int cov_bit(const uint64_t *map, unsigned addr)
+{
+	addr &= ADDR_MASK;
+	return (map[addr >> 6] >> (addr & 63)) & 1;
+}
+
+void chip8_cov_clear(void)
+{
+	memset(chip8_cov_exec, 0, sizeof(chip8_cov_exec));
+	memset(chip8_cov_taken, 0, sizeof(chip8_cov_taken));
+	memset(chip8_cov_not_taken, 0, sizeof(chip8_cov_not_taken));
+}
+/* merges a coverage file into the maps, returns 0 on success */
+int chip8_cov_read(FILE *fp)
+{
+	char *line = NULL;
+	size_t cap = 0;
+	unsigned addr;
+	unsigned long long bits;
+	uint64_t *map;
+	int rc = 0;
+
+	if (getline(&line, &cap, fp) == -1 || strncmp(line, COV_MAGIC, strlen(COV_MAGIC)))
+		rc = -1;
+	while (!rc && getline(&line, &cap, fp) != -1) {
+		switch (line[0]) {
+			case 'x':
+				map = chip8_cov_exec;
+				break;
+			case 't':
+				map = chip8_cov_taken;
+				break;
+			case 'n':
+				map = chip8_cov_not_taken;
+				break;
+			default:
+				continue;
+		}
+		if (sscanf(line + 1, "%x %llx", &addr, &bits) != 2 || addr >= MEM_SIZE || (addr & 63))
+			rc = -1;
+		else
+			map[addr >> 6] |= bits;
+	}
+	free(line);
+	return rc || ferror(fp) ? -1 : 0;
+}
+int chip8_cov_load(const char *file)
+{
+	FILE *fp = fopen(file, "r");
+	int rc;
+
+	if (!fp)
+		return -1;
+	rc = chip8_cov_read(fp);
+	fclose(fp);
+	if (rc)
+		errno = EINVAL;
+	return rc;
+}
+int chip8_cov_write(FILE *fp)
+{
+	static const struct {
+		char tag;
+		const uint64_t *map;
+	} maps[] = {
+		{ 'x', chip8_cov_exec },
+		{ 't', chip8_cov_taken },
+		{ 'n', chip8_cov_not_taken },
+	};
+	unsigned m, i;
+
+	fprintf(fp, "%s\n", COV_MAGIC);
+	for (m = 0; m < sizeof(maps) / sizeof(maps[0]); m++)
+		for (i = 0; i < C8_COV_WORDS; i++)
+			if (maps[m].map[i])
+				fprintf(fp, "%c %x %llx\n", maps[m].tag, i * 64,
+						(unsigned long long)maps[m].map[i]);
+	return ferror(fp) ? -1 : 0;
+}
+/* writes through a temporary file, so a crash never leaves half a file */
+int chip8_cov_save(const char *file)
+{
+	size_t len = strlen(file) + 5;
+	char *tmp = (char *)malloc(len);
+	FILE *fp;
+	int rc = -1;
+
+	if (!tmp)
+		return -1;
+	snprintf(tmp, len, "%s.tmp", file);
+	fp = fopen(tmp, "w");
+	if (fp) {
+		rc = chip8_cov_write(fp);
+		if (fclose(fp))
+			rc = -1;
+		if (!rc)
+			rc = rename(tmp, file);
+		if (rc)
+			remove(tmp);
+	}
+	free(tmp);
+	return rc;
+}
+/*
+ * Adds the maps to what file already holds, creating it. Runs sharing a
+ * file one after another accumulate; concurrent ones should each have
+ * their own and merge them with c8cover.
+ */
+int chip8_cov_merge(const char *file)
+{
+	if (chip8_cov_load(file) && errno != ENOENT)
+		return -1;
+	return chip8_cov_save(file);
+}
+
+/* what the report knows about a source line */
+struct cov_line {
+	unsigned code;		/* words of instructions */
+	unsigned exec;		/* of those, executed */
+	unsigned skips;		/* skip instructions executed */
+	unsigned taken;		/* of those, taken */
+	unsigned not_taken;	/* and not taken */
+};
+
+/*
+ * Summary of the coverage of the program in [start, end) and then,
+ * with symbols whose source can be read, the source annotated line by
+ * line: "#####" for code never executed, "+" for code executed, and
+ * for skips "t" and "n" for the ways they went. Without a source it
+ * lists the skips that only ever went one way. Data words from .byte
+ * do not count as code.
+ */
+void chip8_cov_report(FILE *fp, const struct chip8_state *c8, uint16_t start, uint16_t end)
+{
+	struct cov_line *lines = NULL;
+	unsigned addr, code = 0, exec = 0, skips = 0, dirs = 0;
+	int line, nlines = 0, kind;
+	char *text = NULL, buf[128];
+	size_t cap = 0;
+	FILE *src = NULL;
+	uint16_t op;
+
+	if (chip8_sym_end() && chip8_sym_source())
+		src = fopen(chip8_sym_source(), "r");
+	if (src) {
+		nlines = chip8_sym_line(chip8_sym_end() - 2) + 1;
+		if (nlines > 0)
+			lines = (struct cov_line *)calloc(nlines, sizeof(*lines));
+	}
+	for (addr = start; addr < end; addr += 2) {
+		if (chip8_sym_is_data(addr))
+			continue;
+		code++;
+		line = lines ? chip8_sym_line(addr) : -1;
+		if (line >= 0 && line < nlines)
+			lines[line].code++;
+		if (!cov_bit(chip8_cov_exec, addr))
+			continue;
+		exec++;
+		if (line >= 0 && line < nlines)
+			lines[line].exec++;
+		op = chip8_peek(c8, addr) << 8 | chip8_peek(c8, addr + 1);
+		kind = chip8_insn_kind(op, c8->profile);
+		/* the address word is not an instruction of its own */
+		if (kind == I_LDI16) {
+			addr += 2;
+			code++;
+			exec++;
+			continue;
+		}
+		if (!(chip8_insns[kind].flags & IF_SKIP))
+			continue;
+		skips++;
+		dirs += cov_bit(chip8_cov_taken, addr) + cov_bit(chip8_cov_not_taken, addr);
+		if (line >= 0 && line < nlines) {
+			lines[line].skips++;
+			lines[line].taken += cov_bit(chip8_cov_taken, addr);
+			lines[line].not_taken += cov_bit(chip8_cov_not_taken, addr);
+		}
+	}
+	fprintf(fp, "instructions: %u of %u executed (%.1f%%)\n", exec, code,
+			code ? 100.0 * exec / code : 0.0);
+	fprintf(fp, "skips: %u of %u directions taken (%.1f%%)\n", dirs, 2 * skips,
+			skips ? 50.0 * dirs / skips : 0.0);
+
+	for (addr = start; !lines && addr < end; addr += 2) {
+		if (!cov_bit(chip8_cov_exec, addr) ||
+				cov_bit(chip8_cov_taken, addr) == cov_bit(chip8_cov_not_taken, addr))
+			continue;
+		op = chip8_peek(c8, addr) << 8 | chip8_peek(c8, addr + 1);
+		if (chip8_insns[chip8_insn_kind(op, c8->profile)].flags & IF_SKIP)
+			fprintf(fp, "%s: %04x only ever %s\n", chip8_sym_str(addr, buf, sizeof(buf)), op,
+					cov_bit(chip8_cov_taken, addr) ? "taken" : "not taken");
+	}
+
+	if (lines) {
+		fprintf(fp, "\n");
+		for (line = 1; getline(&text, &cap, src) != -1; line++) {
+			struct cov_line *l = line < nlines ? &lines[line] : NULL;
+			const char *mark = "-", *dir = "";
+
+			text[strcspn(text, "\r\n")] = '\0';
+			if (l && l->code)
+				mark = l->exec ? "+" : "#####";
+			if (l && l->skips)
+				dir = l->taken && l->not_taken ? "tn" : l->taken ? "t" : l->not_taken ? "n" : "";
+			fprintf(fp, "%5s %2s %5d: %s\n", mark, dir, line, text);
+		}
+		free(text);
+	}
+	if (src)
+		fclose(src);
+	free(lines);
+}
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "chip8.h"
+
+/*
+ * Merges the coverage files runs with -C left and reports on them
+ * against the program they ran, annotating its source when there are
+ * symbols.
+ */
+
+static struct chip8_state chip8;
+
+static void usage(void)
+{
+	die("usage: c8cover [-q profile] [-s symfile] [-o covfile] covfile... romfile|srcfile.c8\n");
+}
+int main(int argc, char **argv)
+{
+	const char *symfile = NULL, *out = NULL, *prog;
+	int profile = C8_MODERN, opt, i;
+	unsigned end;
+	char *name;
+	size_t len;
+	FILE *fp;
+
+	while ((opt = getopt(argc, argv, "q:s:o:")) != -1) {
+		switch (opt) {
+			case 'q':
+				profile = chip8_find_profile(optarg);
+				if (profile < 0)
+					die("unknown profile: %s\n", optarg);
+				break;
+			case 's':
+				symfile = optarg;
+				break;
+			case 'o':
+				out = optarg;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind > argc - 2)
+		usage();
+	prog = argv[argc - 1];
+
+	for (i = optind; i < argc - 1; i++)
+		if (chip8_cov_load(argv[i]))
+			die("cannot read coverage from %s\n", argv[i]);
+	if (out && chip8_cov_save(out))
+		die("cannot write %s\n", out);
+
+	chip8_init(&chip8, 1);
+	chip8.profile = profile;
+	len = strlen(prog);
+	if (len > 3 && !strcmp(prog + len - 3, ".c8")) {
+		if (chip8_load_source(&chip8, prog))
+			exit(1);
+	} else
+		chip8_load_prog(&chip8, prog);
+	if (symfile) {
+		if (chip8_sym_load(symfile))
+			die("cannot load symbols from %s\n", symfile);
+	} else if (!chip8_sym_loaded()) {
+		name = (char *)malloc(len + 5);
+		if (name) {
+			snprintf(name, len + 5, "%s.sym", prog);
+			chip8_sym_load(name);
+			free(name);
+		}
+	}
+
+	end = chip8_sym_end();
+	if (!end) {
+		fp = fopen(prog, "rb");
+		if (!fp)
+			die("cannot open %s\n", prog);
+		fseek(fp, 0, SEEK_END);
+		end = PROGRAM_MEM + ftell(fp);
+		fclose(fp);
+		if (end > MEM_SIZE)
+			end = MEM_SIZE;
+	}
+	chip8_cov_report(stdout, &chip8, PROGRAM_MEM, end);
+	chip8_release(&chip8);
+	return 0;
+}
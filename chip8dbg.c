@@ -0,0 +1,712 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "chip8.h"
+
+/*
+ * Debugger: breakpoints on ip and read, write or access watchpoints on
+ * memory, driven from a command console on stdin or by a GDB remote
+ * protocol client on a Unix socket. Points are kept as bitmaps over the
+ * address space. With none set the core runs a frame at a time as
+ * usual; with breakpoints only ip is tested before each instruction,
+ * and only watchpoints make the debugger work out the addresses an
+ * instruction reads or writes (sprites and FX65 through I, FX33, FX55
+ * and so on) before it runs.
+ *
+ * Time is counted in instructions, insns_per_frame of them to a 60 Hz
+ * timer tick, so a session replays the same way every time.
+ */
+
+#define MAX_POINTS	64
+#define BITMAP_WORDS	(MEM_SIZE / 64)
+
+#define P_READ		0x01
+#define P_WRITE		0x02
+#define P_ACCESS	(P_READ | P_WRITE)
+#define P_BREAK		0x04
+
+enum { STOP_DONE, STOP_BREAK, STOP_WATCH, STOP_FAULT, STOP_INTR };
+
+struct point {
+	int kind;
+	uint16_t addr;
+	uint16_t len;
+};
+
+struct stop {
+	int why;
+	int kind;		/* watchpoints: P_READ or P_WRITE */
+	uint16_t addr;
+};
+
+static struct chip8_state chip8;
+static const struct chip8_core *core;
+static unsigned insns_per_frame = 10, frame_pos;
+static uint16_t keys;
+
+static struct point points[MAX_POINTS];
+static int npoints, nwatches;
+static uint64_t exec_map[BITMAP_WORDS], read_map[BITMAP_WORDS], write_map[BITMAP_WORDS];
+
+static volatile sig_atomic_t interrupted;
+static int gdb_fd = -1;
+static const char *covfile;
+
+static int test_bit(const uint64_t *map, unsigned addr)
+{
+	addr &= ADDR_MASK;
+	return (map[addr / 64] >> (addr % 64)) & 1;
+}
+static void set_bits(uint64_t *map, unsigned addr, unsigned len)
+{
+	for (; len; len--, addr++)
+		map[(addr & ADDR_MASK) / 64] |= 1ull << (addr % 64);
+}
+static void rebuild_maps(void)
+{
+	const struct point *p;
+	int i;
+
+	memset(exec_map, 0, sizeof(exec_map));
+	memset(read_map, 0, sizeof(read_map));
+	memset(write_map, 0, sizeof(write_map));
+	nwatches = 0;
+	for (i = 0; i < npoints; i++) {
+		p = &points[i];
+		if (p->kind & P_BREAK)
+			set_bits(exec_map, p->addr, 1);
+		if (p->kind & P_READ)
+			set_bits(read_map, p->addr, p->len);
+		if (p->kind & P_WRITE)
+			set_bits(write_map, p->addr, p->len);
+		nwatches += !(p->kind & P_BREAK);
+	}
+}
+static int add_point(int kind, unsigned addr, unsigned len)
+{
+	if (npoints == MAX_POINTS || !len || len > MEM_SIZE)
+		return -1;
+	points[npoints].kind = kind;
+	points[npoints].addr = addr;
+	points[npoints].len = len;
+	npoints++;
+	rebuild_maps();
+	return npoints - 1;
+}
+static int remove_point(int kind, unsigned addr, unsigned len)
+{
+	int i;
+
+	for (i = 0; i < npoints; i++)
+		if (points[i].kind == kind && points[i].addr == addr && (kind == P_BREAK || points[i].len == len))
+			break;
+	if (i == npoints)
+		return -1;
+	memmove(&points[i], &points[i + 1], (npoints - i - 1) * sizeof(*points));
+	npoints--;
+	rebuild_maps();
+	return 0;
+}
+
+/* the memory the instruction at ip reads or writes, 0 if none */
+static unsigned accesses(const struct chip8_state *c8, uint16_t op, int *kind)
+{
+	int q = QUIRKS(c8->profile);
+	unsigned bytes, planes;
+
+	switch (chip8_insn_kind(op, c8->profile)) {
+		case I_DRW:
+			/* DXY0 is 16 rows of 2 bytes where there is high resolution */
+			bytes = opN ? opN : (q & Q_HIRES) ? 32 : 0;
+			planes = (q & Q_XO) ? __builtin_popcount(c8->planes & 3) : 1;
+			*kind = P_READ;
+			return bytes * planes;
+		case I_BCD:
+			*kind = P_WRITE;
+			return 3;
+		case I_STORE:
+			*kind = P_WRITE;
+			return opX + 1;
+		case I_LOAD:
+			*kind = P_READ;
+			return opX + 1;
+		case I_SAVE:
+		case I_RESTORE:
+			*kind = chip8_insn_kind(op, c8->profile) == I_SAVE ? P_WRITE : P_READ;
+			return (opX > opY ? opX - opY : opY - opX) + 1;
+		case I_AUDIO:
+			*kind = P_READ;
+			return 16;
+	}
+	return 0;
+}
+static int watched(const struct chip8_state *c8, struct stop *st)
+{
+	const uint64_t *map;
+	unsigned len, i;
+	int kind;
+
+	len = accesses(c8, chip8_fetch(c8), &kind);
+	map = kind == P_READ ? read_map : write_map;
+	for (i = 0; i < len; i++)
+		if (test_bit(map, c8->mp + i)) {
+			st->why = STOP_WATCH;
+			st->kind = kind;
+			st->addr = (c8->mp + i) & ADDR_MASK;
+			return 1;
+		}
+	return 0;
+}
+
+/* 0x03 from the GDB client while running */
+static int gdb_interrupt(void)
+{
+	struct pollfd pfd = { gdb_fd, POLLIN, 0 };
+	char c;
+
+	if (gdb_fd < 0 || poll(&pfd, 1, 0) <= 0)
+		return 0;
+	if (read(gdb_fd, &c, 1) != 1)
+		return 1;
+	return c == 0x03;
+}
+
+/*
+ * Runs up to steps instructions, or until something stops it if steps
+ * is 0. A point at ip when it starts does not stop it again.
+ */
+static void run(uint64_t steps, struct stop *st)
+{
+	struct chip8_state *c8 = &chip8;
+	uint64_t done = 0;
+	unsigned n, frames = 0;
+	int k, first = 1;
+
+	memset(st, 0, sizeof(*st));
+	interrupted = 0;
+	while (!steps || done < steps) {
+		if (c8->fault) {
+			st->why = STOP_FAULT;
+			return;
+		}
+		if (interrupted || (!(++frames & 0xff) && gdb_interrupt())) {
+			st->why = STOP_INTR;
+			return;
+		}
+		for (k = 0; k < 16; k++)
+			c8->key[k] = (keys >> k) & 1;
+		n = insns_per_frame - frame_pos;
+		if (steps && n > steps - done)
+			n = steps - done;
+		if (!npoints) {
+			n = core->run(c8, n);
+		} else {
+			for (k = 0; k < (int)n && !c8->fault; k++, first = 0) {
+				if (!first && test_bit(exec_map, c8->ip)) {
+					st->why = STOP_BREAK;
+					break;
+				}
+				if (!first && nwatches && watched(c8, st))
+					break;
+				core->run(c8, 1);
+			}
+			n = k;
+		}
+		done += n;
+		frame_pos += n;
+		if (frame_pos >= insns_per_frame) {
+			chip8_tick(c8);
+			frame_pos = 0;
+		}
+		if (st->why)
+			return;
+	}
+}
+
+static void print_insn(const struct chip8_state *c8)
+{
+	const struct chip8_insn *in;
+	uint16_t op = chip8_fetch(c8);
+	char buf[128];
+
+	in = &chip8_insns[chip8_insn_kind(op, c8->profile)];
+	printf("%s: %04x %s\n", chip8_sym_str(c8->ip, buf, sizeof(buf)), op, in->name ? in->name : "");
+}
+static void print_stop(const struct stop *st)
+{
+	static const char *why[] = { "stopped", "breakpoint", "watchpoint", "fault", "interrupted" };
+
+	if (st->why == STOP_WATCH)
+		printf("%s %s of 0x%x\n", why[st->why], st->kind == P_READ ? "read" : "write", st->addr);
+	else if (st->why == STOP_FAULT)
+		printf("fault: %s\n", chip8_fault_str(&chip8));
+	else
+		printf("%s\n", why[st->why]);
+	print_insn(&chip8);
+}
+
+/* a number, vN for a register value or a label */
+static int parse_addr(const char *s, unsigned *addr)
+{
+	char *end;
+	int a;
+
+	if (!s)
+		return -1;
+	if (s[0] == 'v' && s[1] && !s[2] && strchr("0123456789abcdef", s[1])) {
+		*addr = chip8.v[strtoul(s + 1, NULL, 16)];
+		return 0;
+	}
+	*addr = strtoul(s, &end, 0);
+	if (end != s && !*end && *addr < MEM_SIZE)
+		return 0;
+	a = chip8_sym_addr(s);
+	if (a < 0)
+		return -1;
+	*addr = a;
+	return 0;
+}
+static void examine(unsigned addr, unsigned len)
+{
+	unsigned i;
+
+	for (i = 0; i < len; i++) {
+		if (!(i % 16))
+			printf("%s%04x:", i ? "\n" : "", (addr + i) & ADDR_MASK);
+		printf(" %02x", chip8_peek(&chip8, addr + i));
+	}
+	printf("\n");
+}
+static void list_points(void)
+{
+	static const char *kinds[] = { "", "rwatch", "watch", "awatch", "break" };
+	char buf[128];
+	int i;
+
+	for (i = 0; i < npoints; i++) {
+		printf("%d %-6s %s", i, kinds[points[i].kind], chip8_sym_str(points[i].addr, buf, sizeof(buf)));
+		if (points[i].kind != P_BREAK)
+			printf(" %u bytes", points[i].len);
+		printf("\n");
+	}
+}
+static int parse_keys(const char *s)
+{
+	keys = 0;
+	for (; s && *s; s++) {
+		if (*s >= '0' && *s <= '9')
+			keys |= 1 << (*s - '0');
+		else if (*s >= 'a' && *s <= 'f')
+			keys |= 1 << (*s - 'a' + 10);
+		else if (*s != '-')
+			return -1;
+	}
+	return 0;
+}
+
+static const char help[] =
+	"break addr            stop before the instruction at addr runs\n"
+	"watch addr [len]      stop before memory at addr is written\n"
+	"rwatch addr [len]     ... is read\n"
+	"awatch addr [len]     ... is read or written\n"
+	"delete [n]            remove point n, or all of them\n"
+	"info                  list the points\n"
+	"continue              run until a point, a fault or ^C\n"
+	"step [n]              run n instructions\n"
+	"regs                  show the registers and call stack\n"
+	"x addr [len]          show memory\n"
+	"set vN|addr value     change a register or a byte of memory\n"
+	"keys [0-f...]         hold these keys down, none without an argument\n"
+	"quit\n"
+	"Addresses are numbers, labels, or vN for the value of a register.\n";
+
+/* runs one console command, 1 once the session is over */
+static int command(char *line)
+{
+	char *cmd, *a1, *a2, *save;
+	unsigned addr, len, val;
+	struct stop st;
+	int kind, n;
+
+	cmd = strtok_r(line, " \t\r\n", &save);
+	a1 = strtok_r(NULL, " \t\r\n", &save);
+	a2 = strtok_r(NULL, " \t\r\n", &save);
+	if (!cmd)
+		return 0;
+	if (!strcmp(cmd, "b") || !strcmp(cmd, "break")) {
+		if (parse_addr(a1, &addr) || (n = add_point(P_BREAK, addr, 1)) < 0)
+			printf("break addr\n");
+		else
+			printf("%d break at 0x%x\n", n, addr);
+	} else if (!strcmp(cmd, "watch") || !strcmp(cmd, "rwatch") || !strcmp(cmd, "awatch")) {
+		kind = cmd[0] == 'w' ? P_WRITE : cmd[0] == 'r' ? P_READ : P_ACCESS;
+		len = a2 ? strtoul(a2, NULL, 0) : 1;
+		if (parse_addr(a1, &addr) || (n = add_point(kind, addr, len)) < 0)
+			printf("%s addr [len]\n", cmd);
+		else
+			printf("%d %s 0x%x, %u bytes\n", n, cmd, addr, len);
+	} else if (!strcmp(cmd, "d") || !strcmp(cmd, "delete")) {
+		if (!a1) {
+			npoints = 0;
+		} else {
+			n = strtoul(a1, NULL, 0);
+			if (n < 0 || n >= npoints) {
+				printf("no point %s\n", a1);
+				return 0;
+			}
+			memmove(&points[n], &points[n + 1], (npoints - n - 1) * sizeof(*points));
+			npoints--;
+		}
+		rebuild_maps();
+	} else if (!strcmp(cmd, "i") || !strcmp(cmd, "info")) {
+		list_points();
+	} else if (!strcmp(cmd, "c") || !strcmp(cmd, "continue")) {
+		run(0, &st);
+		print_stop(&st);
+	} else if (!strcmp(cmd, "s") || !strcmp(cmd, "step")) {
+		run(a1 ? strtoull(a1, NULL, 0) : 1, &st);
+		if (st.why)
+			print_stop(&st);
+		else
+			print_insn(&chip8);
+	} else if (!strcmp(cmd, "r") || !strcmp(cmd, "regs")) {
+		chip8_dump(&chip8);
+		print_insn(&chip8);
+	} else if (!strcmp(cmd, "x")) {
+		if (parse_addr(a1, &addr))
+			printf("x addr [len]\n");
+		else
+			examine(addr, a2 ? strtoul(a2, NULL, 0) : 16);
+	} else if (!strcmp(cmd, "set")) {
+		if (!a1 || !a2) {
+			printf("set vN|addr value\n");
+			return 0;
+		}
+		val = strtoul(a2, NULL, 0);
+		if (a1[0] == 'v' && a1[1] && !a1[2])
+			chip8.v[strtoul(a1 + 1, NULL, 16) & 0xf] = val;
+		else if (!parse_addr(a1, &addr))
+			chip8_poke(&chip8, addr, val);
+		else
+			printf("set vN|addr value\n");
+	} else if (!strcmp(cmd, "keys")) {
+		if (parse_keys(a1))
+			printf("keys [0-f...]\n");
+	} else if (!strcmp(cmd, "q") || !strcmp(cmd, "quit")) {
+		return 1;
+	} else {
+		printf("%s", help);
+	}
+	return 0;
+}
+static void console(void)
+{
+	char *line = NULL;
+	size_t cap = 0;
+	int tty = isatty(0);
+
+	print_insn(&chip8);
+	while (1) {
+		if (tty) {
+			printf("(c8dbg) ");
+			fflush(stdout);
+		}
+		if (getline(&line, &cap, stdin) == -1 || command(line))
+			break;
+		fflush(stdout);
+	}
+	free(line);
+}
+
+/*
+ * GDB remote protocol. Registers, in g packet order: v0-vf a byte each,
+ * then i, pc and sp as 16-bit little endian, then dt and st.
+ */
+#define GDB_REGS_LEN	(16 + 3 * 2 + 2)
+/* the most memory an m or M packet moves, in bytes, twice that in hex */
+#define GDB_MEM_MAX	2048
+
+static void gdb_send(const char *s)
+{
+	char buf[2 * GDB_MEM_MAX + 5];
+	unsigned sum = 0;
+	int n;
+
+	for (n = 0; s[n]; n++)
+		sum += (uint8_t)s[n];
+	n = snprintf(buf, sizeof(buf), "$%s#%02x", s, sum & 0xff);
+	if (write(gdb_fd, buf, n) != n)
+		die("cannot write to the debugger\n");
+}
+/* the next packet, acknowledged; NULL once the client is gone */
+static char *gdb_recv(void)
+{
+	static char buf[4096];
+	size_t len = 0;
+	char c;
+
+	while (1) {
+		if (read(gdb_fd, &c, 1) != 1)
+			return NULL;
+		if (c == '$')
+			break;
+	}
+	while (read(gdb_fd, &c, 1) == 1 && c != '#')
+		if (len < sizeof(buf) - 1)
+			buf[len++] = c;
+	buf[len] = '\0';
+	/* the checksum, trusted on a local socket */
+	if (read(gdb_fd, &c, 1) != 1 || read(gdb_fd, &c, 1) != 1 || write(gdb_fd, "+", 1) != 1)
+		return NULL;
+	return buf;
+}
+static void gdb_hex(char *out, const uint8_t *p, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	for (; len; len--, p++) {
+		*out++ = hex[*p >> 4];
+		*out++ = hex[*p & 0xf];
+	}
+	*out = '\0';
+}
+static void gdb_unhex(uint8_t *p, const char *in, size_t len)
+{
+	for (; len && in[0] && in[1]; len--, in += 2)
+		sscanf(in, "%2hhx", p++);
+}
+/* reads the registers into r, or stores them from it; -1 if sp is bad */
+static int gdb_regs(uint8_t *r, int store)
+{
+	struct chip8_state *c8 = &chip8;
+	uint16_t w[3] = { c8->mp, c8->ip, (uint16_t)c8->sp };
+	int i;
+
+	if (!store) {
+		memcpy(r, c8->v, 16);
+		for (i = 0; i < 3; i++) {
+			r[16 + 2 * i] = w[i];
+			r[17 + 2 * i] = w[i] >> 8;
+		}
+		r[22] = c8->dt;
+		r[23] = c8->st;
+		return 0;
+	}
+	/* ret would index the stack with it */
+	if ((r[20] | r[21] << 8) >= STACK_DEPTH)
+		return -1;
+	memcpy(c8->v, r, 16);
+	c8->mp = r[16] | r[17] << 8;
+	c8->ip = r[18] | r[19] << 8;
+	c8->sp = r[20] | r[21] << 8;
+	c8->dt = r[22];
+	c8->st = r[23];
+	return 0;
+}
+static void gdb_stop(const struct stop *st)
+{
+	static const char *watch[] = { "", "rwatch", "watch" };
+	char buf[64];
+
+	if (st->why == STOP_WATCH)
+		snprintf(buf, sizeof(buf), "T05%s:%x;", watch[st->kind], st->addr);
+	else
+		snprintf(buf, sizeof(buf), "S%02x", st->why == STOP_FAULT ? 11 : st->why == STOP_INTR ? 2 : 5);
+	gdb_send(buf);
+}
+static void gdb_session(void)
+{
+	static const int z_kinds[] = { P_BREAK, P_BREAK, P_WRITE, P_READ, P_ACCESS };
+	char out[2 * GDB_MEM_MAX + 1], *pkt, *p;
+	uint8_t buf[GDB_MEM_MAX];
+	unsigned addr, len, type;
+	struct stop st;
+
+	while ((pkt = gdb_recv())) {
+		switch (pkt[0]) {
+			case '?':
+				gdb_send("S05");
+				break;
+			case 'g':
+				gdb_regs(buf, 0);
+				gdb_hex(out, buf, GDB_REGS_LEN);
+				gdb_send(out);
+				break;
+			case 'G':
+				/* registers the packet leaves out keep their values */
+				gdb_regs(buf, 0);
+				gdb_unhex(buf, pkt + 1, GDB_REGS_LEN);
+				gdb_send(gdb_regs(buf, 1) ? "E01" : "OK");
+				break;
+			case 'm':
+				if (sscanf(pkt + 1, "%x,%x", &addr, &len) != 2 || len > sizeof(buf)) {
+					gdb_send("E01");
+					break;
+				}
+				chip8_read(&chip8, addr, buf, len);
+				gdb_hex(out, buf, len);
+				gdb_send(out);
+				break;
+			case 'M':
+				p = strchr(pkt, ':');
+				if (!p || sscanf(pkt + 1, "%x,%x", &addr, &len) != 2 || len > sizeof(buf)) {
+					gdb_send("E01");
+					break;
+				}
+				gdb_unhex(buf, p + 1, len);
+				chip8_write(&chip8, addr, buf, len);
+				gdb_send("OK");
+				break;
+			case 'c':
+			case 's':
+				run(pkt[0] == 's', &st);
+				gdb_stop(&st);
+				break;
+			case 'Z':
+			case 'z':
+				if (sscanf(pkt + 1, "%u,%x,%x", &type, &addr, &len) != 3 || type > 4) {
+					gdb_send("");
+					break;
+				}
+				if (pkt[0] == 'Z')
+					gdb_send(add_point(z_kinds[type], addr, len) < 0 ? "E01" : "OK");
+				else
+					gdb_send(remove_point(z_kinds[type], addr, len) < 0 ? "E01" : "OK");
+				break;
+			case 'q':
+				gdb_send(strncmp(pkt, "qSupported", 10) ? "" : "PacketSize=1000");
+				break;
+			case 'D':
+				gdb_send("OK");
+				return;
+			case 'k':
+				return;
+			default:
+				gdb_send("");
+		}
+	}
+}
+static void gdb_serve(const char *path)
+{
+	struct sockaddr_un sa;
+	int fd;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sa.sun_path))
+		die("socket path too long: %s\n", path);
+	strcpy(sa.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) || listen(fd, 1))
+		die("cannot listen on %s\n", path);
+	fprintf(stderr, "waiting for a debugger on %s\n", path);
+	gdb_fd = accept(fd, NULL, NULL);
+	if (gdb_fd < 0)
+		die("cannot accept on %s\n", path);
+	gdb_session();
+	close(gdb_fd);
+	close(fd);
+	unlink(path);
+}
+
+static void on_sigint(int sig)
+{
+	(void)sig;
+	interrupted = 1;
+}
+
+static void save_coverage(void)
+{
+	if (chip8_cov_merge(covfile))
+		fprintf(stderr, "cannot merge coverage into %s\n", covfile);
+}
+
+static void usage(void)
+{
+	die("usage: c8dbg [-c core] [-q profile] [-s symfile] [-i insns] [-g socket] [-C covfile]\n"
+	    "             romfile|srcfile.c8\n");
+}
+int main(int argc, char **argv)
+{
+	const char *symfile = NULL, *sock = NULL;
+	int profile = C8_MODERN, opt;
+	struct sigaction sa;
+	char *name;
+	size_t len;
+
+	core = chip8_find_core("switch");
+	while ((opt = getopt(argc, argv, "c:q:s:i:g:C:")) != -1) {
+		switch (opt) {
+			case 'c':
+				core = chip8_find_core(optarg);
+				if (!core)
+					die("unknown core: %s\n", optarg);
+				break;
+			case 'q':
+				profile = chip8_find_profile(optarg);
+				if (profile < 0)
+					die("unknown profile: %s\n", optarg);
+				break;
+			case 's':
+				symfile = optarg;
+				break;
+			case 'i':
+				insns_per_frame = strtoul(optarg, NULL, 0);
+				if (!insns_per_frame)
+					usage();
+				break;
+			case 'g':
+				sock = optarg;
+				break;
+			case 'C':
+				covfile = optarg;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+	if (covfile) {
+		core = chip8_find_core("cover");
+		atexit(save_coverage);
+	}
+
+	chip8_init(&chip8, 1);
+	chip8.profile = profile;
+	len = strlen(argv[optind]);
+	if (len > 3 && !strcmp(argv[optind] + len - 3, ".c8")) {
+		if (chip8_load_source(&chip8, argv[optind]))
+			exit(1);
+	} else
+		chip8_load_prog(&chip8, argv[optind]);
+	if (symfile) {
+		if (chip8_sym_load(symfile))
+			die("cannot load symbols from %s\n", symfile);
+	} else if (!chip8_sym_loaded()) {
+		name = (char *)malloc(len + 5);
+		if (name) {
+			snprintf(name, len + 5, "%s.sym", argv[optind]);
+			chip8_sym_load(name);
+			free(name);
+		}
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_sigint;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGINT, &sa, NULL);
+	if (sock)
+		gdb_serve(sock);
+	else
+		console();
+	return 0;
+}
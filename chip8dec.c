@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+/*
+ * Opcode decoding shared by the cores, c8aot, the assembler's optimizer
+ * and c8dis. chip8_decode_table maps every opcode to its kind, built at
+ * compile time from range initialisers; chip8_insns describes each kind.
+ * Kinds only some profiles have are filtered by chip8_insn_kind().
+ */
+
+#define R2(...)		__VA_ARGS__, __VA_ARGS__
+#define R16(...)	R2(R2(R2(R2(__VA_ARGS__))))
+#define R256(...)	R16(R16(__VA_ARGS__))
+
+/* the same instruction for every X */
+#define EACH_X(m)	m(0x0) m(0x1) m(0x2) m(0x3) m(0x4) m(0x5) m(0x6) m(0x7) \
+			m(0x8) m(0x9) m(0xa) m(0xb) m(0xc) m(0xd) m(0xe) m(0xf)
+#define ROW_E(x)	[0xe09e | (x) << 8] = I_SKP, [0xe0a1 | (x) << 8] = I_SKNP,
+#define ROW_F(x)	[0xf007 | (x) << 8] = I_LDDT, [0xf00a | (x) << 8] = I_WAITK, \
+			[0xf015 | (x) << 8] = I_SETDT, [0xf018 | (x) << 8] = I_SETST, \
+			[0xf01e | (x) << 8] = I_ADDI, [0xf029 | (x) << 8] = I_FONT, \
+			[0xf030 | (x) << 8] = I_BIGFONT, [0xf033 | (x) << 8] = I_BCD, \
+			[0xf03a | (x) << 8] = I_PITCH, [0xf055 | (x) << 8] = I_STORE, \
+			[0xf065 | (x) << 8] = I_LOAD, [0xf075 | (x) << 8] = I_SAVEFLAGS, \
+			[0xf085 | (x) << 8] = I_LOADFLAGS,
+
+const uint8_t chip8_decode_table[0x10000] = {
+	[0x00c0 ... 0x00cf] = I_SCD,
+	[0x00d0 ... 0x00df] = I_SCU,
+	[0x00e0] = I_CLS,
+	[0x00ee] = I_RET,
+	[0x00fb] = I_SCR,
+	[0x00fc] = I_SCL,
+	[0x00fd] = I_EXIT,
+	[0x00fe] = I_LORES,
+	[0x00ff] = I_HIRES,
+	[0x1000 ... 0x1fff] = I_JP,
+	[0x2000 ... 0x2fff] = I_CALL,
+	[0x3000 ... 0x3fff] = I_SE,
+	[0x4000 ... 0x4fff] = I_SNE,
+	[0x5000] = R256(I_SER, I_BAD, I_SAVE, I_RESTORE, I_BAD, I_BAD, I_BAD, I_BAD,
+			I_BAD, I_BAD, I_BAD, I_BAD, I_BAD, I_BAD, I_BAD, I_BAD),
+	[0x6000 ... 0x6fff] = I_LD,
+	[0x7000 ... 0x7fff] = I_ADD,
+	[0x8000] = R256(I_MOV, I_OR, I_AND, I_XOR, I_ADDR, I_SUB, I_SHR, I_SUBN,
+			I_BAD, I_BAD, I_BAD, I_BAD, I_BAD, I_BAD, I_SHL, I_BAD),
+	[0x9000] = R256(I_SNER, I_BAD, I_BAD, I_BAD, I_BAD, I_BAD, I_BAD, I_BAD,
+			I_BAD, I_BAD, I_BAD, I_BAD, I_BAD, I_BAD, I_BAD, I_BAD),
+	[0xa000 ... 0xafff] = I_LDI,
+	[0xb000 ... 0xbfff] = I_JP0,
+	[0xc000 ... 0xcfff] = I_RND,
+	[0xd000 ... 0xdfff] = I_DRW,
+	EACH_X(ROW_E)
+	[0xf000] = I_LDI16,
+	[0xf001] = I_PLANE, [0xf101] = I_PLANE, [0xf201] = I_PLANE, [0xf301] = I_PLANE,
+	[0xf002] = I_AUDIO,
+	EACH_X(ROW_F)
+};
+
+/*
+ * 00FF is hlt to chip8as: SUPER-CHIP and XO-CHIP switch to high
+ * resolution, the other profiles halt, so chip8_insn_kind() makes it
+ * I_HLT there. The decode table itself only has I_HIRES. DXY0 is a DRW
+ * everywhere, the cores draw it 16x16 where the profile has Q_HIRES.
+ */
+const struct chip8_insn chip8_insns[I_NKINDS] = {
+	[I_BAD] =	{ NULL },
+	[I_CLS] =	{ "cs", 0x00e0, A_NONE },
+	[I_RET] =	{ "ret", 0x00ee, A_NONE },
+	[I_SCD] =	{ NULL, 0x00c0, A_N, Q_HIRES },
+	[I_SCU] =	{ NULL, 0x00d0, A_N, Q_XO },
+	[I_SCR] =	{ NULL, 0x00fb, A_NONE, Q_HIRES },
+	[I_SCL] =	{ NULL, 0x00fc, A_NONE, Q_HIRES },
+	[I_EXIT] =	{ NULL, 0x00fd, A_NONE, Q_HIRES },
+	[I_LORES] =	{ NULL, 0x00fe, A_NONE, Q_HIRES },
+	[I_HIRES] =	{ "hlt", 0x00ff, A_NONE, Q_HIRES },
+	[I_HLT] =	{ "hlt", 0x00ff, A_NONE },
+	[I_JP] =	{ "j", 0x1000, A_NNN },
+	[I_CALL] =	{ "call", 0x2000, A_NNN },
+	[I_SE] =	{ "je", 0x3000, A_X_NN, 0, IF_SKIP },
+	[I_SNE] =	{ "jne", 0x4000, A_X_NN, 0, IF_SKIP },
+	[I_SER] =	{ "je", 0x5000, A_X_Y, 0, IF_SKIP },
+	[I_SAVE] =	{ NULL, 0x5002, A_X_Y, Q_XO },
+	[I_RESTORE] =	{ NULL, 0x5003, A_X_Y, Q_XO },
+	[I_LD] =	{ "mov", 0x6000, A_NN_X },
+	[I_ADD] =	{ "add", 0x7000, A_NN_X },
+	[I_MOV] =	{ "mov", 0x8000, A_Y_X },
+	[I_OR] =	{ "or", 0x8001, A_Y_X },
+	[I_AND] =	{ "and", 0x8002, A_Y_X },
+	[I_XOR] =	{ "xor", 0x8003, A_Y_X },
+	[I_ADDR] =	{ "add", 0x8004, A_Y_X },
+	[I_SUB] =	{ "sub", 0x8005, A_Y_X },
+	[I_SHR] =	{ "shr", 0x8006, A_X },
+	[I_SUBN] =	{ "subv", 0x8007, A_Y_X },
+	[I_SHL] =	{ "shl", 0x800e, A_X },
+	[I_SNER] =	{ "jne", 0x9000, A_X_Y, 0, IF_SKIP },
+	[I_LDI] =	{ "i", 0xa000, A_NNN },
+	[I_JP0] =	{ "j0", 0xb000, A_NNN },
+	[I_RND] =	{ "rand", 0xc000, A_NN_X },
+	[I_DRW] =	{ "draw", 0xd000, A_X_Y_N },
+	[I_SKP] =	{ "jk", 0xe09e, A_X, 0, IF_SKIP },
+	[I_SKNP] =	{ "jnk", 0xe0a1, A_X, 0, IF_SKIP },
+	[I_LDI16] =	{ NULL, 0xf000, A_NONE, Q_XO },
+	[I_PLANE] =	{ NULL, 0xf001, A_N_X, Q_XO },
+	[I_AUDIO] =	{ NULL, 0xf002, A_NONE, Q_XO },
+	[I_LDDT] =	{ "ldelay", 0xf007, A_X },
+	[I_WAITK] =	{ "wait", 0xf00a, A_X },
+	[I_SETDT] =	{ "delay", 0xf015, A_X },
+	[I_SETST] =	{ "sound", 0xf018, A_X },
+	[I_ADDI] =	{ "ix", 0xf01e, A_X },
+	[I_FONT] =	{ "is", 0xf029, A_X },
+	[I_BIGFONT] =	{ NULL, 0xf030, A_X, Q_HIRES },
+	[I_BCD] =	{ "bcd", 0xf033, A_X },
+	[I_PITCH] =	{ NULL, 0xf03a, A_X, Q_XO },
+	[I_STORE] =	{ "store", 0xf055, A_N_X },
+	[I_LOAD] =	{ "load", 0xf065, A_N_X },
+	[I_SAVEFLAGS] =	{ NULL, 0xf075, A_N_X, Q_HIRES },
+	[I_LOADFLAGS] =	{ NULL, 0xf085, A_N_X, Q_HIRES },
+};
+
+/* bits of the opcode each operand layout fills in */
+const uint16_t chip8_operand_mask[A_NLAYOUTS] = {
+	[A_NONE] = 0x0000,
+	[A_N] = 0x000f,
+	[A_NNN] = 0x0fff,
+	[A_X] = 0x0f00,
+	[A_N_X] = 0x0f00,
+	[A_NN_X] = 0x0fff,
+	[A_X_NN] = 0x0fff,
+	[A_X_Y] = 0x0ff0,
+	[A_Y_X] = 0x0ff0,
+	[A_X_Y_N] = 0x0fff,
+};
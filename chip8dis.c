@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "chip8.h"
+
+/*
+ * Disassembler: turns a ROM back into chip8as source that assembles to
+ * the same bytes. Every word becomes one line, an instruction when
+ * chip8as has a mnemonic that encodes it exactly and a .byte pair
+ * otherwise, so data and instructions of other profiles survive too.
+ * Jump, call and i targets inside the ROM get labels.
+ *
+ * Lines are formatted by hand into a large buffer rather than through
+ * stdio, which keeps a stream of ROMs going at memory speed.
+ */
+
+#define OUT_SIZE	(1 << 16)
+#define LINE_MAX_LEN	32
+
+static char out[OUT_SIZE + LINE_MAX_LEN];
+static size_t out_len;
+static FILE *fpout;
+static uint8_t labels[0x1000];
+
+static const char hex[] = "0123456789abcdef";
+
+static void flush(void)
+{
+	if (out_len && fwrite(out, 1, out_len, fpout) != out_len)
+		die("cannot write source\n");
+	out_len = 0;
+}
+static char *put_str(char *p, const char *s)
+{
+	while (*s)
+		*p++ = *s++;
+	return p;
+}
+static char *put_hex(char *p, unsigned v)
+{
+	int shift = 12;
+
+	*p++ = '0';
+	*p++ = 'x';
+	while (shift && !(v >> shift))
+		shift -= 4;
+	for (; shift >= 0; shift -= 4)
+		*p++ = hex[(v >> shift) & 0xf];
+	return p;
+}
+static char *put_reg(char *p, unsigned r)
+{
+	*p++ = 'v';
+	*p++ = hex[r];
+	return p;
+}
+static char *put_label(char *p, unsigned addr)
+{
+	*p++ = 'L';
+	*p++ = '_';
+	*p++ = hex[addr >> 8];
+	*p++ = hex[(addr >> 4) & 0xf];
+	*p++ = hex[addr & 0xf];
+	return p;
+}
+static char *put_addr(char *p, unsigned addr)
+{
+	return labels[addr] ? put_label(p, addr) : put_hex(p, addr);
+}
+
+/* the chip8as syntax of kind, if there is one for exactly op */
+static const struct chip8_insn *syntax(uint16_t op)
+{
+	const struct chip8_insn *in = &chip8_insns[chip8_decode_table[op]];
+
+	if (!in->name || (op & ~chip8_operand_mask[in->layout]) != in->op)
+		return NULL;
+	return in;
+}
+static char *put_insn(char *p, uint16_t op)
+{
+	const struct chip8_insn *in = syntax(op);
+
+	if (!in) {
+		p = put_str(p, ".byte ");
+		p = put_hex(p, op >> 8);
+		*p++ = ' ';
+		return put_hex(p, op & 0xff);
+	}
+	p = put_str(p, in->name);
+	*p++ = ' ';
+	switch (in->layout) {
+		case A_NONE:
+			p--;
+			break;
+		case A_NNN:
+			p = put_addr(p, opNNN);
+			break;
+		case A_X:
+			p = put_reg(p, opX);
+			break;
+		case A_N_X:
+			p = put_hex(p, opX);
+			break;
+		case A_NN_X:
+			p = put_hex(p, opNN);
+			*p++ = ' ';
+			p = put_reg(p, opX);
+			break;
+		case A_X_NN:
+			p = put_reg(p, opX);
+			*p++ = ' ';
+			p = put_hex(p, opNN);
+			break;
+		case A_X_Y:
+		case A_X_Y_N:
+			p = put_reg(p, opX);
+			*p++ = ' ';
+			p = put_reg(p, opY);
+			if (in->layout == A_X_Y_N) {
+				*p++ = ' ';
+				p = put_hex(p, opN);
+			}
+			break;
+		case A_Y_X:
+			p = put_reg(p, opY);
+			*p++ = ' ';
+			p = put_reg(p, opX);
+			break;
+	}
+	return p;
+}
+
+static void disassemble(const uint8_t *rom, size_t len)
+{
+	const struct chip8_insn *in;
+	size_t i, end = PROGRAM_MEM + len;
+	uint16_t op;
+	char *p;
+
+	memset(labels, 0, sizeof(labels));
+	for (i = 0; i + 1 < len; i += 2) {
+		op = (rom[i] << 8) | rom[i + 1];
+		in = syntax(op);
+		if (in && in->layout == A_NNN && opNNN >= PROGRAM_MEM && opNNN < end && !(opNNN & 1))
+			labels[opNNN] = 1;
+	}
+	for (i = 0; i < len; i += 2) {
+		p = &out[out_len];
+		if (PROGRAM_MEM + i < sizeof(labels) && labels[PROGRAM_MEM + i]) {
+			p = put_label(p, PROGRAM_MEM + i);
+			*p++ = ':';
+			*p++ = '\n';
+		}
+		/* an odd last byte is padded, chip8as only emits whole words */
+		op = rom[i] << 8 | (i + 1 < len ? rom[i + 1] : 0);
+		p = put_insn(p, op);
+		*p++ = '\n';
+		out_len = p - out;
+		if (out_len >= OUT_SIZE)
+			flush();
+	}
+	flush();
+}
+
+static void usage(void)
+{
+	die("usage: c8dis [-o out.c8] [romfile]\n");
+}
+int main(int argc, char **argv)
+{
+	const char *in = "-", *outname = NULL;
+	uint8_t *rom = NULL, *buf;
+	size_t len = 0, cap = 0;
+	ssize_t rc;
+	struct stat st;
+	int opt, fd, mapped = 0;
+
+	while ((opt = getopt(argc, argv, "o:")) != -1) {
+		switch (opt) {
+			case 'o':
+				outname = optarg;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (argc - optind > 1)
+		usage();
+	if (optind < argc)
+		in = argv[optind];
+
+	fd = strcmp(in, "-") ? open(in, O_RDONLY) : 0;
+	if (fd < 0 || fstat(fd, &st))
+		die("cannot open %s\n", in);
+	if (S_ISREG(st.st_mode) && st.st_size) {
+		rom = (uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (rom == MAP_FAILED)
+			die("cannot map %s\n", in);
+		len = st.st_size;
+		mapped = 1;
+	} else {
+		do {
+			if (len == cap) {
+				cap = cap ? 2 * cap : 1 << 16;
+				buf = (uint8_t *)realloc(rom, cap);
+				if (!buf)
+					die("out of memory\n");
+				rom = buf;
+			}
+			rc = read(fd, rom + len, cap - len);
+			if (rc < 0)
+				die("cannot read %s\n", in);
+			len += rc;
+		} while (rc);
+	}
+	if (len & 1)
+		fprintf(stderr, "%s: odd length, padded with a zero byte\n", in);
+
+	fpout = outname && strcmp(outname, "-") ? fopen(outname, "w") : stdout;
+	if (!fpout)
+		die("cannot open %s\n", outname);
+	disassemble(rom, len);
+	if (fclose(fpout))
+		die("cannot write source\n");
+	if (mapped)
+		munmap(rom, len);
+	else
+		free(rom);
+	return 0;
+}
@@ -0,0 +1,408 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "chip8.h"
+
+/*
+ * Vectorised environments: n machines running the same ROM, stepped a
+ * frame at a time with a batch of key masks. Observations, rewards and
+ * done flags go straight into arrays the caller owns, one record per
+ * machine. Machines are forked from the snapshot, so they share its
+ * font and program pages and only copy those they write; the first such
+ * write after a reset is the only allocation a step makes. With threads
+ * the machines are split into contiguous slices, one per thread, and the
+ * calling thread runs the first slice itself.
+ */
+
+#define ENV_STEP	1
+#define ENV_RESET	2
+#define ENV_QUIT	3
+
+struct chip8_env {
+	struct chip8_state *m;
+	unsigned n;
+	struct chip8_state *snap;	/* what reset copies in */
+	uint32_t *episodes;	/* resets per machine, for their seeds */
+	struct chip8_watchdog *wd;	/* per machine, NULL without a watchdog */
+	struct chip8_vip *vip;		/* per machine, NULL without VIP timing */
+	const char *cache_dir;
+	int metered;			/* metrics registered */
+	struct chip8_metrics metrics;
+	const struct chip8_core *core;
+	unsigned insns_per_frame;
+	int obs;
+	int width, height, planes;
+	size_t obs_size;
+	uint32_t *reward;
+	unsigned nreward;
+	uint32_t seed;
+
+	/* the batch being run, read by every thread */
+	int job;
+	const uint16_t *keys;
+	const uint8_t *which;
+	uint8_t *obs_out, *reward_out, *done_out;
+
+	unsigned nthreads;
+	pthread_t *tids;
+	pthread_barrier_t start, end;
+};
+
+/* byte i of a row, 8 pixels as 8 bytes of 0 or 1, leftmost first */
+static uint64_t expand[256];
+static pthread_once_t expand_once = PTHREAD_ONCE_INIT;
+
+static void init_expand(void)
+{
+	int i, b;
+
+	for (i = 0; i < 256; i++)
+		for (b = 0; b < 8; b++)
+			if (i & (0x80 >> b))
+				expand[i] |= 1ull << (8 * b);
+}
+
+static uint32_t mix(uint32_t a, uint32_t b)
+{
+	uint32_t h = a * 0x9e3779b1u ^ b;
+
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h ? h : 1;
+}
+
+static void observe(const struct chip8_env *env, const struct chip8_state *c8, uint8_t *obs)
+{
+	int bytes = env->width / 8, p, y, i;
+	uint64_t px;
+	fb_row_t row;
+
+	if (env->obs == C8_OBS_BITS) {
+		for (p = 0; p < env->planes; p++)
+			for (y = 0; y < env->height; y++) {
+				row = c8->fb[p][y];
+				for (i = 0; i < bytes; i++)
+					*obs++ = row >> (120 - 8 * i);
+			}
+		return;
+	}
+	for (y = 0; y < env->height; y++)
+		for (i = 0; i < bytes; i++, obs += 8) {
+			px = 0;
+			for (p = 0; p < env->planes; p++)
+				px |= expand[(uint8_t)(c8->fb[p][y] >> (120 - 8 * i))] << p;
+			memcpy(obs, &px, 8);
+		}
+}
+static void read_rewards(const struct chip8_env *env, const struct chip8_state *c8, uint8_t *out)
+{
+	unsigned r;
+	uint32_t addr;
+
+	for (r = 0; r < env->nreward; r++) {
+		addr = env->reward[r];
+		out[r] = addr >= MEM_SIZE ? c8->v[(addr - MEM_SIZE) & 0xf] : chip8_peek(c8, addr);
+	}
+}
+static void reset_one(struct chip8_env *env, unsigned i)
+{
+	struct chip8_state *c8 = &env->m[i];
+
+	chip8_fork(c8, env->snap);
+	c8->rng = mix(env->seed ^ mix(i, 0x5eed), env->episodes[i]++);
+	if (env->wd) {
+		env->wd[i].idle = 0;
+		env->wd[i].hash = 0;
+	}
+	if (env->vip)
+		env->vip[i].budget = 0;
+}
+/* returns the instructions run, 0 if the machine was done */
+static unsigned step_one(struct chip8_env *env, unsigned i)
+{
+	struct chip8_state *c8 = &env->m[i];
+	uint16_t mask = env->keys ? env->keys[i] : 0;
+	unsigned n;
+	int k;
+
+	if (c8->fault)
+		return 0;
+	for (k = 0; k < 16; k++)
+		c8->key[k] = (mask >> k) & 1;
+	if (env->vip) {
+		n = chip8_vip_frame(&env->vip[i], c8, env->core);
+	} else {
+		n = env->core->run(c8, env->insns_per_frame);
+		chip8_tick(c8);
+	}
+	if (env->wd)
+		chip8_watchdog(&env->wd[i], c8);
+	return n;
+}
+/* the records of machine i, after a step or a reset */
+static void output(struct chip8_env *env, unsigned i)
+{
+	const struct chip8_state *c8 = &env->m[i];
+
+	if (env->obs_out)
+		observe(env, c8, env->obs_out + i * env->obs_size);
+	if (env->reward_out)
+		read_rewards(env, c8, env->reward_out + (size_t)i * env->nreward);
+	if (env->done_out)
+		env->done_out[i] = c8->fault != C8_OK;
+}
+static void run_slice(struct chip8_env *env, unsigned t)
+{
+	unsigned i, first = (uint64_t)env->n * t / env->nthreads;
+	unsigned last = (uint64_t)env->n * (t + 1) / env->nthreads;
+	uint64_t insns = 0, frames = 0, resets = 0;
+
+	for (i = first; i < last; i++) {
+		if (env->job == ENV_STEP) {
+			frames += !env->m[i].fault;
+			insns += step_one(env, i);
+		} else {
+			if (env->which && !env->which[i])
+				continue;
+			reset_one(env, i);
+			resets++;
+		}
+		output(env, i);
+	}
+	/* once per slice, the threads share the counters */
+	if (env->metered) {
+		chip8_metrics_add(&env->metrics.insns, insns);
+		chip8_metrics_add(&env->metrics.frames, frames);
+		chip8_metrics_add(&env->metrics.resets, resets);
+	}
+}
+struct env_thread {
+	struct chip8_env *env;
+	unsigned t;
+};
+static void *worker(void *arg)
+{
+	struct env_thread *w = (struct env_thread *)arg;
+	struct chip8_env *env = w->env;
+	unsigned t = w->t;
+
+	free(w);
+	while (1) {
+		pthread_barrier_wait(&env->start);
+		if (env->job == ENV_QUIT)
+			break;
+		run_slice(env, t);
+		pthread_barrier_wait(&env->end);
+	}
+	if (env->core->release)
+		env->core->release();
+	return NULL;
+}
+static void run_job(struct chip8_env *env, int job)
+{
+	env->job = job;
+	if (env->nthreads > 1)
+		pthread_barrier_wait(&env->start);
+	if (job == ENV_QUIT)
+		return;
+	run_slice(env, 0);
+	if (env->nthreads > 1)
+		pthread_barrier_wait(&env->end);
+}
+
+/*
+ * n machines with rom loaded, reset and ready to step. Returns NULL if
+ * the ROM does not fit or memory runs out.
+ */
+struct chip8_env *chip8_env_new(unsigned n, const void *rom, size_t len, const struct chip8_env_config *cfg)
+{
+	struct chip8_env *env;
+	struct env_thread *w;
+	int q = QUIRKS(cfg->profile);
+	unsigned t;
+
+	pthread_once(&expand_once, init_expand);
+	env = (struct chip8_env *)calloc(1, sizeof(*env));
+	if (!env || !n)
+		goto fail;
+	env->n = n;
+	env->core = cfg->core ? cfg->core : chip8_find_core("switch");
+	env->insns_per_frame = cfg->insns_per_frame ? cfg->insns_per_frame : 10;
+	env->obs = cfg->obs;
+	env->width = q & Q_HIRES ? SCREEN_WIDTH : LORES_WIDTH;
+	env->height = q & Q_HIRES ? SCREEN_HEIGHT : LORES_HEIGHT;
+	env->planes = q & Q_XO ? PLANES : 1;
+	env->obs_size = cfg->obs == C8_OBS_BITS ? env->planes * env->height * env->width / 8 :
+			env->height * env->width;
+	env->seed = cfg->seed;
+	env->nreward = cfg->nreward;
+	env->reward = (uint32_t *)malloc((cfg->nreward + 1) * sizeof(*env->reward));
+	env->m = (struct chip8_state *)calloc(n, sizeof(*env->m));
+	env->snap = (struct chip8_state *)calloc(1, sizeof(*env->snap));
+	env->episodes = (uint32_t *)calloc(n, sizeof(*env->episodes));
+	if (!env->reward || !env->m || !env->snap || !env->episodes)
+		goto fail;
+	if (cfg->vip_timing) {
+		env->vip = (struct chip8_vip *)calloc(n, sizeof(*env->vip));
+		if (!env->vip)
+			goto fail;
+		for (t = 0; t < n; t++)
+			env->vip[t].vblank = cfg->vip_timing > 1;
+	}
+	if (cfg->watchdog) {
+		env->wd = (struct chip8_watchdog *)calloc(n, sizeof(*env->wd));
+		if (!env->wd)
+			goto fail;
+		for (t = 0; t < n; t++)
+			env->wd[t].limit = cfg->watchdog;
+	}
+	for (t = 0; t < cfg->nreward; t++) {
+		env->reward[t] = cfg->reward[t];
+		if (env->reward[t] >= MEM_SIZE + 16)
+			goto fail;
+	}
+	chip8_init(env->snap, cfg->seed);
+	env->snap->profile = cfg->profile;
+	if (chip8_load(env->snap, rom, len))
+		goto fail;
+	/* resets fork it from every thread, none of them may write it */
+	env->snap->mem_private = 0;
+	if (cfg->cache_dir && env->core->cache_open)
+		env->core->cache_open(env->snap, cfg->cache_dir);
+	env->cache_dir = cfg->cache_dir;
+
+	env->nthreads = cfg->threads > 1 && cfg->threads <= n ? cfg->threads : 1;
+	if (env->nthreads > 1) {
+		env->tids = (pthread_t *)calloc(env->nthreads, sizeof(*env->tids));
+		if (!env->tids)
+			goto fail;
+		pthread_barrier_init(&env->start, NULL, env->nthreads);
+		pthread_barrier_init(&env->end, NULL, env->nthreads);
+		for (t = 1; t < env->nthreads; t++) {
+			w = (struct env_thread *)malloc(sizeof(*w));
+			if (!w)
+				die("out of memory\n");
+			w->env = env;
+			w->t = t;
+			if (pthread_create(&env->tids[t], NULL, worker, w))
+				die("cannot create thread\n");
+		}
+	}
+	if (cfg->metrics) {
+		chip8_metrics_register(&env->metrics, cfg->metrics);
+		env->metered = 1;
+	}
+	chip8_env_reset(env, NULL, NULL);
+	return env;
+fail:
+	if (env) {
+		if (env->snap)
+			chip8_release(env->snap);
+		free(env->reward);
+		free(env->m);
+		free(env->snap);
+		free(env->episodes);
+		free(env->wd);
+		free(env->vip);
+		free(env);
+	}
+	return NULL;
+}
+void chip8_env_free(struct chip8_env *env)
+{
+	unsigned t;
+
+	if (!env)
+		return;
+	/* what the caller's thread translated, its machines run the same program */
+	if (env->cache_dir && env->core->cache_save)
+		env->core->cache_save(env->snap->profile);
+	if (env->metered)
+		chip8_metrics_unregister(&env->metrics);
+	run_job(env, ENV_QUIT);
+	for (t = 1; t < env->nthreads; t++)
+		pthread_join(env->tids[t], NULL);
+	if (env->nthreads > 1) {
+		pthread_barrier_destroy(&env->start);
+		pthread_barrier_destroy(&env->end);
+	}
+	for (t = 0; t < env->n; t++)
+		chip8_release(&env->m[t]);
+	chip8_release(env->snap);
+	free(env->tids);
+	free(env->reward);
+	free(env->m);
+	free(env->snap);
+	free(env->episodes);
+	free(env->wd);
+	free(env->vip);
+	free(env);
+}
+/* bytes of observation each machine writes */
+size_t chip8_env_obs_size(const struct chip8_env *env)
+{
+	return env->obs_size;
+}
+/* VIP machine cycles and frames run by all machines, 0 without VIP timing */
+uint64_t chip8_env_cycles(const struct chip8_env *env, uint64_t *frames)
+{
+	uint64_t cycles = 0;
+	unsigned i;
+
+	if (frames)
+		*frames = 0;
+	for (i = 0; env->vip && i < env->n; i++) {
+		cycles += env->vip[i].cycles;
+		if (frames)
+			*frames += env->vip[i].frames;
+	}
+	return cycles;
+}
+struct chip8_state *chip8_env_machine(struct chip8_env *env, unsigned i)
+{
+	return i < env->n ? &env->m[i] : NULL;
+}
+/* later resets start from a copy of c8, a machine of this env or not */
+void chip8_env_set_snapshot(struct chip8_env *env, struct chip8_state *c8)
+{
+	chip8_fork(env->snap, c8);
+}
+/*
+ * Runs a frame on every machine that has not faulted: keys[i] holds the
+ * keys down on machine i, bit k for key k. Any of the outputs may be
+ * NULL, otherwise they have room for n records: obs_size bytes, nreward
+ * bytes and a byte that is 1 once the machine faulted, halted, exited or
+ * went the watchdog's frames without progress.
+ */
+void chip8_env_step(struct chip8_env *env, const uint16_t *keys, uint8_t *obs, uint8_t *reward, uint8_t *done)
+{
+	uint64_t t = env->metered ? chip8_metrics_now() : 0;
+
+	env->keys = keys;
+	env->obs_out = obs;
+	env->reward_out = reward;
+	env->done_out = done;
+	run_job(env, ENV_STEP);
+	if (env->metered)
+		chip8_hist_add(&env->metrics.frame, chip8_metrics_now() - t);
+}
+/*
+ * Copies the snapshot into the machines which selects, all of them if it
+ * is NULL, and writes their records as a step would. Each reset gets its
+ * own random seed, derived from the configured one, the machine and how
+ * often it was reset, so runs can be repeated.
+ */
+void chip8_env_reset(struct chip8_env *env, const uint8_t *which, uint8_t *obs)
+{
+	env->which = which;
+	env->obs_out = obs;
+	env->reward_out = NULL;
+	env->done_out = NULL;
+	run_job(env, ENV_RESET);
+}
@@ -0,0 +1,714 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "chip8.h"
+
+/*
+ * Decode-cache core with superinstructions.
+ *
+ * Every address has a cache entry holding the pre-extracted operands of
+ * the instruction there. When the instruction starts one of the common
+ * idioms (skip + jump, ANNN + DXYN, a run of 6XNN, FX29 + DXYN) the entry
+ * covers the whole sequence and runs it in one dispatch. Entries for the
+ * following addresses are decoded on their own, so a jump into the middle
+ * of a fused sequence still runs the right code.
+ *
+ * An entry remembers the words it was decoded from and is checked against
+ * memory on every dispatch, so self-modifying code and several machines
+ * sharing the cache need no invalidation.
+ *
+ * Quirks are resolved when decoding: each profile has its own cache and
+ * instructions whose behaviour differs get their own kinds, so handlers
+ * never test the profile. On XO-CHIP a skip entry also covers the next
+ * word, since skipping over F000 NNNN takes 4 bytes; those skips are
+ * left to the slow path. Scrolling and the other SUPER-CHIP/XO-CHIP
+ * extensions are rare and always take the slow path, except DXY0.
+ */
+
+enum {
+	K_DECODE = 0,	/* empty entry */
+	K_SLOW,		/* run by chip8_run_switch(): FX0A, bad ops */
+	K_CLS, K_RET, K_JP, K_CALL,
+	K_SE, K_SNE, K_SER, K_SNER,
+	K_LD, K_ADD,
+	K_MOV, K_OR, K_AND, K_XOR, K_ADDR, K_SUB, K_SHR, K_SUBN, K_SHL,
+	K_LDI, K_JP0, K_RND, K_DRW, K_SKP, K_SKNP,
+	K_LDDT, K_SETDT, K_SETST, K_ADDI, K_FONT, K_BCD, K_STORE, K_LOAD,
+	/* superinstructions */
+	K_SE_JP, K_SNE_JP, K_SER_JP, K_SNER_JP, K_SKP_JP, K_SKNP_JP,
+	K_LDI_DRW, K_FONT_DRW, K_LD_RUN,
+	/* quirk variants */
+	K_OR_VF, K_AND_VF, K_XOR_VF, K_SHR_VY, K_SHL_VY,
+	K_STORE_INC, K_LOAD_INC, K_JP0_VX,
+	K_DRW_CLIP, K_LDI_DRW_CLIP, K_FONT_DRW_CLIP,
+	K_DRW16, K_DRW16_CLIP,
+	K_MAX,
+};
+
+enum {
+	P_SKIP_JP,
+	P_LDI_DRW,
+	P_LD_RUN,
+	P_FONT_DRW,
+	P_MAX,
+};
+
+static const char *pattern_names[P_MAX] = {
+	"skip+jump",
+	"i+draw",
+	"mov run",
+	"font+draw",
+};
+
+struct c8_insn {
+	uint64_t raw;		/* words decoded from, as loaded from memory */
+	uint64_t mask;		/* bits of raw that belong to this entry */
+	uint8_t kind;
+	uint8_t len;		/* instructions covered */
+	uint8_t x, y, n;	/* operands of the first instruction */
+	uint8_t x2, y2, n2;	/* operands of the second one */
+	uint16_t nnn;		/* NNN or NN of the first instruction */
+	uint16_t nnn2;
+};
+
+#define LD_RUN_MAX	4
+
+static const uint64_t len_mask[LD_RUN_MAX + 1] = {
+	0,
+	0xffff000000000000ULL,
+	0xffffffff00000000ULL,
+	0xffffffffffff0000ULL,
+	0xffffffffffffffffULL,
+};
+
+/* MEM_SIZE entries per profile, allocated on first use */
+static __thread struct c8_insn *cache[C8_NPROFILES];
+
+/*
+ * Decode cache images, so the next run of a ROM starts with the entries
+ * this one decoded. A file per ROM and profile holds a header and the
+ * decoded entries, native endian and only good for the build that wrote
+ * it. Entries are checked against memory on dispatch like any other, so
+ * an image can never run code that is not there; the header and a sum
+ * over the entries catch files from other builds and damaged ones.
+ */
+#define IMAGE_MAGIC	0x3164657375663863ull	/* "c8fused1" */
+#define IMAGE_VERSION	1	/* bump when struct c8_insn, the kinds or decode() change */
+
+struct image_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t insn_size;
+	uint32_t kinds;
+	uint32_t profile;
+	uint64_t rom;		/* chip8_hash_mem() of the machine as loaded */
+	uint64_t sum;		/* FNV-1a of the records */
+	uint32_t count;
+	uint32_t pad;
+};
+
+struct image_record {
+	uint32_t addr;
+	uint32_t pad;
+	struct c8_insn e;
+};
+
+/* the image opened for each profile, mapped read only */
+static struct {
+	const struct image_record *rec;
+	uint32_t count;
+	size_t size;
+	uint64_t rom;
+	char *file;
+} image[C8_NPROFILES];
+static __thread uint64_t pattern_hits[P_MAX];
+static __thread uint64_t pattern_insns[P_MAX];
+static __thread uint64_t total_insns;
+
+static uint64_t load64(const uint8_t *p)
+{
+	uint64_t w;
+
+	memcpy(&w, p, sizeof(w));
+	return w;
+}
+/* the 8 bytes from addr, which may straddle two memory pages */
+static uint64_t load_code(const struct chip8_state *c8, unsigned addr)
+{
+	uint8_t buf[8];
+
+	if ((addr & MEM_PAGE_MASK) <= MEM_PAGE_SIZE - 8)
+		return load64(&c8->page[addr >> MEM_PAGE_SHIFT][addr & MEM_PAGE_MASK]);
+	chip8_read(c8, addr, buf, sizeof(buf));
+	return load64(buf);
+}
+/* kinds of the shared decoder run here, everything else is K_SLOW */
+static const uint8_t fused_kinds[I_NKINDS] = {
+	[I_CLS] = K_CLS, [I_RET] = K_RET, [I_JP] = K_JP, [I_CALL] = K_CALL,
+	[I_SE] = K_SE, [I_SNE] = K_SNE, [I_SER] = K_SER, [I_SNER] = K_SNER,
+	[I_LD] = K_LD, [I_ADD] = K_ADD,
+	[I_MOV] = K_MOV, [I_OR] = K_OR, [I_AND] = K_AND, [I_XOR] = K_XOR,
+	[I_ADDR] = K_ADDR, [I_SUB] = K_SUB, [I_SHR] = K_SHR, [I_SUBN] = K_SUBN, [I_SHL] = K_SHL,
+	[I_LDI] = K_LDI, [I_JP0] = K_JP0, [I_RND] = K_RND, [I_DRW] = K_DRW,
+	[I_SKP] = K_SKP, [I_SKNP] = K_SKNP,
+	[I_LDDT] = K_LDDT, [I_SETDT] = K_SETDT, [I_SETST] = K_SETST, [I_ADDI] = K_ADDI,
+	[I_FONT] = K_FONT, [I_BCD] = K_BCD, [I_STORE] = K_STORE, [I_LOAD] = K_LOAD,
+};
+
+static int single_kind(uint16_t op)
+{
+	return fused_kinds[chip8_decode_table[op]] ?: K_SLOW;
+}
+/* skip kinds that have a fused skip + jump form */
+static int skip_jp_kind(int kind)
+{
+	switch (kind) {
+		case K_SE: return K_SE_JP;
+		case K_SNE: return K_SNE_JP;
+		case K_SER: return K_SER_JP;
+		case K_SNER: return K_SNER_JP;
+		case K_SKP: return K_SKP_JP;
+		case K_SKNP: return K_SKNP_JP;
+	}
+	return 0;
+}
+/* the variant of kind that implements the quirks of profile p */
+static int quirk_kind(int kind, int p)
+{
+	int q = QUIRKS(p);
+
+	switch (kind) {
+		case K_OR: return q & Q_VF_RESET ? K_OR_VF : kind;
+		case K_AND: return q & Q_VF_RESET ? K_AND_VF : kind;
+		case K_XOR: return q & Q_VF_RESET ? K_XOR_VF : kind;
+		case K_SHR: return q & Q_SHIFT_VY ? K_SHR_VY : kind;
+		case K_SHL: return q & Q_SHIFT_VY ? K_SHL_VY : kind;
+		case K_STORE: return q & Q_MEM_INC ? K_STORE_INC : kind;
+		case K_LOAD: return q & Q_MEM_INC ? K_LOAD_INC : kind;
+		case K_JP0: return q & Q_JUMP_VX ? K_JP0_VX : kind;
+		case K_DRW: return q & Q_CLIP ? K_DRW_CLIP : kind;
+		case K_DRW16: return q & Q_CLIP ? K_DRW16_CLIP : kind;
+		case K_LDI_DRW: return q & Q_CLIP ? K_LDI_DRW_CLIP : kind;
+		case K_FONT_DRW: return q & Q_CLIP ? K_FONT_DRW_CLIP : kind;
+	}
+	return kind;
+}
+/* decode the words in raw into e, fusing where possible */
+static void decode(struct c8_insn *e, uint64_t raw, int profile)
+{
+	uint64_t live = __builtin_bswap64(raw);
+	uint16_t op = live >> 48;
+	uint16_t op2 = live >> 32;
+	int kind = single_kind(op);
+	int q = QUIRKS(profile);
+	/* DXY0 is a 16x16 sprite rather than an empty one */
+	int wide2 = (q & Q_HIRES) && (op2 >> 12) == 0xd && (op2 & 0xf) == 0;
+
+	if (kind == K_DRW && (q & Q_HIRES) && opN == 0)
+		kind = K_DRW16;
+
+	memset(e, 0, sizeof(*e));
+	e->kind = kind;
+	e->len = 1;
+	e->x = opX;
+	e->y = opY;
+	e->n = opN;
+	e->nnn = (opC >= 0x3 && opC <= 0x7) || opC == 0xc ? opNN : opNNN;
+
+	e->x2 = (op2 >> 8) & 0xf;
+	e->y2 = (op2 >> 4) & 0xf;
+	e->n2 = op2 & 0xf;
+	e->nnn2 = op2 & 0xfff;
+	if (skip_jp_kind(kind) && (op2 >> 12) == 0x1) {
+		e->kind = skip_jp_kind(kind);
+		e->len = 2;
+	} else if (kind == K_LDI && (op2 >> 12) == 0xd && !wide2) {
+		e->kind = K_LDI_DRW;
+		e->len = 2;
+	} else if (kind == K_FONT && (op2 >> 12) == 0xd && !wide2) {
+		e->kind = K_FONT_DRW;
+		e->len = 2;
+	} else if (kind == K_LD) {
+		while (e->len < LD_RUN_MAX && ((live >> (60 - 16 * e->len)) & 0xf) == 0x6)
+			e->len++;
+		if (e->len > 1)
+			e->kind = K_LD_RUN;
+	}
+	e->kind = quirk_kind(e->kind, profile);
+	e->mask = __builtin_bswap64(len_mask[e->len]);
+	if ((q & Q_XO) && e->len == 1 && skip_jp_kind(kind)) {
+		e->mask = __builtin_bswap64(len_mask[2]);
+		if (op2 == 0xf000)
+			e->kind = K_SLOW;
+	}
+	e->raw = raw & e->mask;
+}
+
+unsigned chip8_run_fused(struct chip8_state *c8, unsigned n)
+{
+	static const void *handlers[K_MAX] = {
+		[K_DECODE] = &&do_decode, [K_SLOW] = &&do_slow,
+		[K_CLS] = &&do_cls, [K_RET] = &&do_ret, [K_JP] = &&do_jp, [K_CALL] = &&do_call,
+		[K_SE] = &&do_se, [K_SNE] = &&do_sne, [K_SER] = &&do_ser, [K_SNER] = &&do_sner,
+		[K_LD] = &&do_ld, [K_ADD] = &&do_add,
+		[K_MOV] = &&do_mov, [K_OR] = &&do_or, [K_AND] = &&do_and, [K_XOR] = &&do_xor,
+		[K_ADDR] = &&do_addr, [K_SUB] = &&do_sub, [K_SHR] = &&do_shr, [K_SUBN] = &&do_subn,
+		[K_SHL] = &&do_shl,
+		[K_LDI] = &&do_ldi, [K_JP0] = &&do_jp0, [K_RND] = &&do_rnd, [K_DRW] = &&do_drw,
+		[K_SKP] = &&do_skp, [K_SKNP] = &&do_sknp,
+		[K_LDDT] = &&do_lddt, [K_SETDT] = &&do_setdt, [K_SETST] = &&do_setst,
+		[K_ADDI] = &&do_addi, [K_FONT] = &&do_font, [K_BCD] = &&do_bcd,
+		[K_STORE] = &&do_store, [K_LOAD] = &&do_load,
+		[K_SE_JP] = &&do_se_jp, [K_SNE_JP] = &&do_sne_jp, [K_SER_JP] = &&do_ser_jp,
+		[K_SNER_JP] = &&do_sner_jp, [K_SKP_JP] = &&do_skp_jp, [K_SKNP_JP] = &&do_sknp_jp,
+		[K_LDI_DRW] = &&do_ldi_drw, [K_FONT_DRW] = &&do_font_drw, [K_LD_RUN] = &&do_ld_run,
+		[K_OR_VF] = &&do_or_vf, [K_AND_VF] = &&do_and_vf, [K_XOR_VF] = &&do_xor_vf,
+		[K_SHR_VY] = &&do_shr_vy, [K_SHL_VY] = &&do_shl_vy,
+		[K_STORE_INC] = &&do_store_inc, [K_LOAD_INC] = &&do_load_inc, [K_JP0_VX] = &&do_jp0_vx,
+		[K_DRW_CLIP] = &&do_drw_clip, [K_LDI_DRW_CLIP] = &&do_ldi_drw_clip,
+		[K_FONT_DRW_CLIP] = &&do_font_drw_clip,
+		[K_DRW16] = &&do_drw16, [K_DRW16_CLIP] = &&do_drw16_clip,
+	};
+	struct c8_insn *entries = cache[c8->profile];
+	int profile = c8->profile;
+	uint8_t *v = c8->v;
+	struct c8_insn *e;
+	uint64_t live;
+	unsigned i = 0;
+	int j;
+
+	if (c8->fault)
+		return 0;
+	if (!entries) {
+		entries = calloc(MEM_SIZE, sizeof(*entries));
+		if (!entries)
+			die("out of memory\n");
+		for (j = 0; j < (int)image[profile].count; j++)
+			entries[image[profile].rec[j].addr] = image[profile].rec[j].e;
+		cache[profile] = entries;
+	}
+
+#define NEXT(insns, step)	do { i += (insns); c8->ip += (step); goto next; } while (0)
+#define JUMP(insns, addr)	do { i += (insns); c8->ip = (addr); goto next; } while (0)
+#define SKIP_IF(cond)		NEXT(1, (cond) ? 4 : 2)
+#define SKIP_JP_IF(cond)	do { \
+	pattern_hits[P_SKIP_JP]++; \
+	if (cond) \
+		NEXT(1, 4); \
+	if (e->nnn2 == c8->ip + 2)	/* a jump to itself, do_jp checks it */ \
+		NEXT(1, 2); \
+	pattern_insns[P_SKIP_JP] += 2; \
+	JUMP(2, e->nnn2); \
+} while (0)
+
+next:
+	if (i >= n) {
+		total_insns += i;
+		return i;
+	}
+	if (c8->ip > MEM_SIZE - 8)
+		goto do_slow;
+	e = &entries[c8->ip];
+	live = load_code(c8, c8->ip);
+	if ((live ^ e->raw) & e->mask)
+		decode(e, live, profile);
+dispatch:
+	if (e->len > n - i)
+		goto do_slow;
+	goto *handlers[e->kind];
+
+do_decode:
+	decode(e, live, profile);
+	goto dispatch;
+do_slow:
+	i += chip8_run_switch(c8, 1);
+	if (c8->fault) {
+		total_insns += i;
+		return i;
+	}
+	goto next;
+
+do_cls:
+	chip8_clear_screen(c8);
+	NEXT(1, 2);
+do_ret:
+	chip8_sub_return(c8);
+	i++;
+	if (c8->fault) {
+		total_insns += i;
+		return i;
+	}
+	goto next;
+do_jp:
+	if (e->nnn == c8->ip && !c8->dt && !c8->st)
+		goto do_slow;
+	JUMP(1, e->nnn);
+do_call:
+	chip8_sub_call(c8, e->nnn);
+	i++;
+	if (c8->fault) {
+		total_insns += i;
+		return i;
+	}
+	goto next;
+do_se:
+	SKIP_IF(v[e->x] == e->nnn);
+do_sne:
+	SKIP_IF(v[e->x] != e->nnn);
+do_ser:
+	SKIP_IF(v[e->x] == v[e->y]);
+do_sner:
+	SKIP_IF(v[e->x] != v[e->y]);
+do_ld:
+	v[e->x] = e->nnn;
+	NEXT(1, 2);
+do_add:
+	v[e->x] += e->nnn;
+	NEXT(1, 2);
+do_mov:
+	v[e->x] = v[e->y];
+	NEXT(1, 2);
+do_or:
+	v[e->x] |= v[e->y];
+	NEXT(1, 2);
+do_and:
+	v[e->x] &= v[e->y];
+	NEXT(1, 2);
+do_xor:
+	v[e->x] ^= v[e->y];
+	NEXT(1, 2);
+do_addr:
+	v[e->x] += v[e->y];
+	v[0xf] = v[e->x] < v[e->y];
+	NEXT(1, 2);
+do_sub:
+	v[0xf] = v[e->x] < v[e->y];
+	v[e->x] -= v[e->y];
+	NEXT(1, 2);
+do_shr:
+	v[0xf] = v[e->x] & 0x1;
+	v[e->x] >>= 1;
+	NEXT(1, 2);
+do_subn:
+	v[0xf] = v[e->y] < v[e->x];
+	v[e->x] = v[e->y] - v[e->x];
+	NEXT(1, 2);
+do_shl:
+	v[0xf] = (v[e->x] & 0x80) >> 7;
+	v[e->x] <<= 1;
+	NEXT(1, 2);
+do_ldi:
+	c8->mp = e->nnn;
+	NEXT(1, 2);
+do_jp0:
+	JUMP(1, v[0] + e->nnn);
+do_rnd:
+	v[e->x] = e->nnn & chip8_rand16(c8);
+	NEXT(1, 2);
+do_drw:
+	v[0xf] = chip8_draw(c8, v[e->x], v[e->y], e->n);
+	NEXT(1, 2);
+do_skp:
+	SKIP_IF(c8->key[v[e->x] & 0xf]);
+do_sknp:
+	SKIP_IF(!c8->key[v[e->x] & 0xf]);
+do_lddt:
+	v[e->x] = c8->dt;
+	NEXT(1, 2);
+do_setdt:
+	c8->dt = v[e->x];
+	NEXT(1, 2);
+do_setst:
+	c8->st = v[e->x];
+	NEXT(1, 2);
+do_addi:
+	c8->mp += v[e->x];
+	NEXT(1, 2);
+do_font:
+	c8->mp = v[e->x] * 5;
+	NEXT(1, 2);
+do_bcd:
+	chip8_poke(c8, c8->mp, v[e->x] / 100);
+	chip8_poke(c8, c8->mp + 1, (v[e->x] % 100) / 10);
+	chip8_poke(c8, c8->mp + 2, v[e->x] % 10);
+	NEXT(1, 2);
+do_store:
+	for (j = 0; j <= e->x; j++)
+		chip8_poke(c8, c8->mp + j, v[j]);
+	NEXT(1, 2);
+do_load:
+	for (j = 0; j <= e->x; j++)
+		v[j] = chip8_peek(c8, c8->mp + j);
+	NEXT(1, 2);
+
+do_se_jp:
+	SKIP_JP_IF(v[e->x] == e->nnn);
+do_sne_jp:
+	SKIP_JP_IF(v[e->x] != e->nnn);
+do_ser_jp:
+	SKIP_JP_IF(v[e->x] == v[e->y]);
+do_sner_jp:
+	SKIP_JP_IF(v[e->x] != v[e->y]);
+do_skp_jp:
+	SKIP_JP_IF(c8->key[v[e->x] & 0xf]);
+do_sknp_jp:
+	SKIP_JP_IF(!c8->key[v[e->x] & 0xf]);
+do_ldi_drw:
+	pattern_hits[P_LDI_DRW]++;
+	pattern_insns[P_LDI_DRW] += 2;
+	c8->mp = e->nnn;
+	v[0xf] = chip8_draw(c8, v[e->x2], v[e->y2], e->n2);
+	NEXT(2, 4);
+do_font_drw:
+	pattern_hits[P_FONT_DRW]++;
+	pattern_insns[P_FONT_DRW] += 2;
+	c8->mp = v[e->x] * 5;
+	v[0xf] = chip8_draw(c8, v[e->x2], v[e->y2], e->n2);
+	NEXT(2, 4);
+do_ld_run:
+	pattern_hits[P_LD_RUN]++;
+	pattern_insns[P_LD_RUN] += e->len;
+	for (j = 0; j < e->len; j++) {
+		uint16_t w = __builtin_bswap64(e->raw) >> (48 - 16 * j);
+		v[(w >> 8) & 0xf] = w & 0xff;
+	}
+	NEXT(e->len, 2 * e->len);
+
+do_or_vf:
+	v[e->x] |= v[e->y];
+	v[0xf] = 0;
+	NEXT(1, 2);
+do_and_vf:
+	v[e->x] &= v[e->y];
+	v[0xf] = 0;
+	NEXT(1, 2);
+do_xor_vf:
+	v[e->x] ^= v[e->y];
+	v[0xf] = 0;
+	NEXT(1, 2);
+do_shr_vy:
+	j = v[e->y];
+	v[e->x] = j >> 1;
+	v[0xf] = j & 0x1;
+	NEXT(1, 2);
+do_shl_vy:
+	j = v[e->y];
+	v[e->x] = j << 1;
+	v[0xf] = (j & 0x80) >> 7;
+	NEXT(1, 2);
+do_store_inc:
+	for (j = 0; j <= e->x; j++)
+		chip8_poke(c8, c8->mp + j, v[j]);
+	c8->mp += e->x + 1;
+	NEXT(1, 2);
+do_load_inc:
+	for (j = 0; j <= e->x; j++)
+		v[j] = chip8_peek(c8, c8->mp + j);
+	c8->mp += e->x + 1;
+	NEXT(1, 2);
+do_jp0_vx:
+	JUMP(1, v[e->x] + e->nnn);
+do_drw_clip:
+	v[0xf] = chip8_draw_clip(c8, v[e->x], v[e->y], e->n);
+	NEXT(1, 2);
+do_ldi_drw_clip:
+	pattern_hits[P_LDI_DRW]++;
+	pattern_insns[P_LDI_DRW] += 2;
+	c8->mp = e->nnn;
+	v[0xf] = chip8_draw_clip(c8, v[e->x2], v[e->y2], e->n2);
+	NEXT(2, 4);
+do_font_drw_clip:
+	pattern_hits[P_FONT_DRW]++;
+	pattern_insns[P_FONT_DRW] += 2;
+	c8->mp = v[e->x] * 5;
+	v[0xf] = chip8_draw_clip(c8, v[e->x2], v[e->y2], e->n2);
+	NEXT(2, 4);
+do_drw16:
+	v[0xf] = chip8_draw16(c8, v[e->x], v[e->y]);
+	NEXT(1, 2);
+do_drw16_clip:
+	v[0xf] = chip8_draw16_clip(c8, v[e->x], v[e->y]);
+	NEXT(1, 2);
+
+#undef NEXT
+#undef JUMP
+#undef SKIP_IF
+#undef SKIP_JP_IF
+}
+
+/* FNV-1a over the records, the header's checksum */
+static uint64_t image_sum(const void *buf, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	uint64_t h = 14695981039346656037ull;
+
+	while (len--)
+		h = (h ^ *p++) * 1099511628211ull;
+	return h;
+}
+/*
+ * The sum only catches damage, anyone who can write the directory can
+ * fix it up, so each entry is checked for what the handlers trust: that
+ * it covers at least one instruction and is compared against memory,
+ * and that its operands are nibbles, registers among them.
+ */
+static int image_entry_valid(const struct image_record *r)
+{
+	const struct c8_insn *e = &r->e;
+
+	if (r->addr > MEM_SIZE - 8 || e->kind >= K_MAX)
+		return 0;
+	if (e->kind == K_DECODE)
+		return 1;
+	return e->len && e->len <= LD_RUN_MAX && e->mask &&
+			e->x < 16 && e->y < 16 && e->n < 16 &&
+			e->x2 < 16 && e->y2 < 16 && e->n2 < 16;
+}
+static int image_valid(const struct image_header *hd, size_t size, int profile, uint64_t rom)
+{
+	const struct image_record *rec = (const struct image_record *)(hd + 1);
+	uint32_t i;
+
+	if (size < sizeof(*hd) || hd->magic != IMAGE_MAGIC || hd->version != IMAGE_VERSION ||
+			hd->insn_size != sizeof(struct c8_insn) || hd->kinds != K_MAX ||
+			hd->profile != (uint32_t)profile || hd->rom != rom ||
+			size != sizeof(*hd) + (size_t)hd->count * sizeof(*rec) ||
+			hd->sum != image_sum(rec, size - sizeof(*hd)))
+		return 0;
+	for (i = 0; i < hd->count; i++)
+		if (!image_entry_valid(&rec[i]))
+			return 0;
+	return 1;
+}
+/*
+ * Opens the image for the program c8 has loaded, in its profile, under
+ * dir: the entries in it seed the decode cache, and chip8_fused_save()
+ * writes back there. Returns 1 if there was a valid image, 0 if not.
+ */
+int chip8_fused_open(const struct chip8_state *c8, const char *dir)
+{
+	int profile = c8->profile, fd;
+	size_t len = strlen(dir) + 48;
+	uint32_t i;
+	struct stat st;
+	void *map;
+
+	if (image[profile].size)
+		munmap((void *)((const struct image_header *)image[profile].rec - 1), image[profile].size);
+	free(image[profile].file);
+	memset(&image[profile], 0, sizeof(image[profile]));
+	image[profile].rom = chip8_hash_mem(c8);
+	image[profile].file = (char *)malloc(len);
+	if (!image[profile].file)
+		return 0;
+	snprintf(image[profile].file, len, "%s/%016llx-%s.fused%d", dir,
+			(unsigned long long)image[profile].rom, chip8_profile_name(profile), IMAGE_VERSION);
+
+	fd = open(image[profile].file, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	map = MAP_FAILED;
+	if (!fstat(fd, &st) && st.st_size > 0)
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+	if (!image_valid((const struct image_header *)map, st.st_size, profile, image[profile].rom)) {
+		munmap(map, st.st_size);
+		return 0;
+	}
+	image[profile].rec = (const struct image_record *)((const struct image_header *)map + 1);
+	image[profile].count = ((const struct image_header *)map)->count;
+	image[profile].size = st.st_size;
+	/* threads that already have a cache take it now, the others when they make theirs */
+	if (cache[profile])
+		for (i = 0; i < image[profile].count; i++)
+			cache[profile][image[profile].rec[i].addr] = image[profile].rec[i].e;
+	return 1;
+}
+/*
+ * Writes the entries this thread has decoded for profile to the image
+ * chip8_fused_open() opened, through a temporary file so readers never
+ * see half of one. Returns 0 on success.
+ */
+int chip8_fused_save(int profile)
+{
+	struct c8_insn *entries = cache[profile];
+	struct image_header hd;
+	struct image_record *rec;
+	size_t len, n = 0;
+	unsigned addr;
+	char *tmp;
+	FILE *fp;
+	int rc = -1;
+
+	if (!image[profile].file || !entries)
+		return -1;
+	rec = (struct image_record *)calloc(MEM_SIZE, sizeof(*rec));
+	len = strlen(image[profile].file) + 24;
+	tmp = (char *)malloc(len);
+	if (!rec || !tmp)
+		goto out;
+	for (addr = 0; addr < MEM_SIZE; addr++) {
+		if (entries[addr].kind == K_DECODE)
+			continue;
+		rec[n].addr = addr;
+		rec[n].e = entries[addr];
+		n++;
+	}
+	memset(&hd, 0, sizeof(hd));
+	hd.magic = IMAGE_MAGIC;
+	hd.version = IMAGE_VERSION;
+	hd.insn_size = sizeof(struct c8_insn);
+	hd.kinds = K_MAX;
+	hd.profile = profile;
+	hd.rom = image[profile].rom;
+	hd.sum = image_sum(rec, n * sizeof(*rec));
+	hd.count = n;
+
+	snprintf(tmp, len, "%s.%ld.tmp", image[profile].file, (long)getpid());
+	fp = fopen(tmp, "wb");
+	if (!fp)
+		goto out;
+	rc = fwrite(&hd, sizeof(hd), 1, fp) == 1 && fwrite(rec, sizeof(*rec), n, fp) == n ? 0 : -1;
+	if (fclose(fp))
+		rc = -1;
+	if (!rc)
+		rc = rename(tmp, image[profile].file);
+	if (rc)
+		unlink(tmp);
+out:
+	free(rec);
+	free(tmp);
+	return rc;
+}
+
+/* frees this thread's decode caches, the next run allocates them again */
+void chip8_fused_release(void)
+{
+	int p;
+
+	for (p = 0; p < C8_NPROFILES; p++) {
+		free(cache[p]);
+		cache[p] = NULL;
+	}
+}
+
+/* per-pattern fusion hit rates for this thread */
+void chip8_fused_report(FILE *fp)
+{
+	int p;
+
+	fprintf(fp, "fused core: %llu instructions\n", (unsigned long long)total_insns);
+	for (p = 0; p < P_MAX; p++) {
+		fprintf(fp, "  %-10s %10llu hits %10llu insns %5.1f%%\n", pattern_names[p],
+			(unsigned long long)pattern_hits[p], (unsigned long long)pattern_insns[p],
+			total_insns ? 100.0 * pattern_insns[p] / total_insns : 0.0);
+	}
+}
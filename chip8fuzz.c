@@ -0,0 +1,518 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "chip8.h"
+
+/*
+ * Differential fuzzer: runs generated or mutated ROMs on two cores in
+ * lockstep and compares the whole machine state every few instructions.
+ * Any divergence is minimised to a small reproducer ROM.
+ */
+
+#define MAX_ROM		(MEM_SIZE - PROGRAM_MEM)
+#define MAX_CORPUS	64
+/* 8000 (mov v0 v0) changes nothing, used to blank out words */
+#define NOP		0x8000
+
+struct fuzz_run {
+	const struct chip8_core *a;
+	const struct chip8_core *b;
+	unsigned interval;	/* compare state every N instructions */
+	unsigned frame;		/* instructions per 60Hz timer tick */
+	unsigned budget;	/* instructions per ROM */
+	int profile;		/* quirks profile, -1 picks one per ROM */
+};
+
+struct corpus_rom {
+	uint8_t data[MAX_ROM];
+	size_t len;
+};
+
+static struct corpus_rom corpus[MAX_CORPUS];
+static int ncorpus;
+
+static uint64_t rng_next(uint64_t *s)
+{
+	uint64_t x = *s;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*s = x;
+	return x * 0x2545f4914f6cdd1dULL;
+}
+static unsigned rng_below(uint64_t *s, unsigned n)
+{
+	return (unsigned)(rng_next(s) % n);
+}
+
+/* even 12-bit address inside the generated program most of the time */
+static uint16_t gen_target(uint64_t *s, size_t len)
+{
+	if (len >= 2 && rng_below(s, 8))
+		return ((PROGRAM_MEM + rng_below(s, len)) & ~1) & 0xfff;
+	return rng_below(s, 0x1000);
+}
+/* random opcode, biased towards encodings the reference core accepts */
+static uint16_t gen_op(uint64_t *s, size_t len)
+{
+	static const uint8_t alu[] = {0, 1, 2, 3, 4, 5, 6, 7, 0xe};
+	static const uint8_t fx[] = {0x07, 0x0a, 0x15, 0x18, 0x1e, 0x29, 0x33, 0x55, 0x65};
+	/* SUPER-CHIP and XO-CHIP, bad ops (or for 00FF hlt) on the other profiles */
+	static const uint16_t ext[] = {0x00c0, 0x00d0, 0x00fb, 0x00fc, 0x00fe, 0x00ff,
+		0x5002, 0x5003, 0xf000, 0xf001, 0xf002, 0xf030, 0xf03a, 0xf075, 0xf085, 0x00fd};
+	unsigned x = rng_below(s, 16), y = rng_below(s, 16);
+	uint16_t op;
+
+	switch (rng_below(s, 21)) {
+		case 0:
+			return rng_below(s, 4) ? 0x00e0 : 0x00ee;
+		case 1:
+			return 0x1000 | gen_target(s, len);
+		case 2:
+			return 0x2000 | gen_target(s, len);
+		case 3:
+			return 0x3000 | x << 8 | rng_below(s, 256);
+		case 4:
+			return 0x4000 | x << 8 | rng_below(s, 256);
+		case 5:
+			return 0x5000 | x << 8 | y << 4;
+		case 6:
+		case 7:
+			return 0x6000 | x << 8 | rng_below(s, 256);
+		case 8:
+		case 9:
+			return 0x7000 | x << 8 | rng_below(s, 256);
+		case 10:
+		case 11:
+			return 0x8000 | x << 8 | y << 4 | alu[rng_below(s, sizeof(alu))];
+		case 12:
+			return 0x9000 | x << 8 | y << 4;
+		case 13:
+			return 0xa000 | gen_target(s, len);
+		case 14:
+			return 0xb000 | gen_target(s, len);
+		case 15:
+			return 0xc000 | x << 8 | rng_below(s, 256);
+		case 16:
+			return 0xd000 | x << 8 | y << 4 | rng_below(s, 16);
+		case 17:
+			return 0xe000 | x << 8 | (rng_below(s, 2) ? 0x9e : 0xa1);
+		case 18:
+			return 0xf000 | x << 8 | fx[rng_below(s, sizeof(fx))];
+		case 19:
+			/* 00FD, last in ext[], ends the run: keep it rare */
+			op = ext[rng_below(s, sizeof(ext) / sizeof(ext[0]) - (rng_below(s, 8) ? 1 : 0))];
+			if (op >> 12 == 0x5)
+				return op | x << 8 | y << 4;
+			if (op == 0x00c0 || op == 0x00d0)
+				return op | rng_below(s, 16);
+			if (op == 0xf000 || op == 0xf002)
+				return op;
+			if (op == 0xf001)
+				return op | rng_below(s, 4) << 8;
+			return op | (op >> 12 == 0xf ? x << 8 : 0);
+	}
+	return rng_next(s);
+}
+static void put_op(uint8_t *rom, size_t i, uint16_t op)
+{
+	rom[i] = op >> 8;
+	rom[i + 1] = op & 0xff;
+}
+static size_t gen_rom(uint64_t *s, uint8_t *rom)
+{
+	size_t i, len = 2 * (16 + rng_below(s, 496));
+
+	for (i = 0; i < len; i += 2)
+		put_op(rom, i, gen_op(s, len));
+	return len;
+}
+static size_t mutate_rom(uint64_t *s, uint8_t *rom)
+{
+	const struct corpus_rom *src = &corpus[rng_below(s, ncorpus)];
+	size_t len = src->len & ~1, i;
+	int n;
+
+	memcpy(rom, src->data, src->len);
+	if (len < 4)
+		return src->len;
+	for (n = 1 + rng_below(s, 8); n > 0; n--) {
+		i = rng_below(s, len) & ~1;
+		switch (rng_below(s, 5)) {
+			case 0:
+			case 1:
+				put_op(rom, i, gen_op(s, len));
+				break;
+			case 2:
+				rom[i + rng_below(s, 2)] ^= 1 << rng_below(s, 8);
+				break;
+			case 3:
+				if (len + 2 <= MAX_ROM) {
+					memmove(&rom[i + 2], &rom[i], len - i);
+					put_op(rom, i, gen_op(s, len));
+					len += 2;
+				}
+				break;
+			case 4:
+				/* keep two words, rng_below() needs a length */
+				if (len > 4) {
+					memmove(&rom[i], &rom[i + 2], len - i - 2);
+					len -= 2;
+				}
+				break;
+		}
+	}
+	return len;
+}
+
+static void fuzz_keys(uint64_t *s, struct chip8_state *sa, struct chip8_state *sb)
+{
+	int i;
+
+	for (i = 0; i < 16; i++)
+		sa->key[i] = rng_below(s, 8) == 0;
+	memcpy(sb->key, sa->key, sizeof(sa->key));
+}
+static void fuzz_start(const struct fuzz_run *fr, struct chip8_state *c8, const uint8_t *rom, size_t len, uint64_t seed)
+{
+	chip8_init(c8, (uint32_t)(seed >> 32) | 1);
+	c8->profile = fr->profile < 0 ? seed % C8_NPROFILES : fr->profile;
+	chip8_load(c8, rom, len);
+}
+static int mem_equal(const struct chip8_state *sa, const struct chip8_state *sb)
+{
+	int i;
+
+	for (i = 0; i < MEM_PAGES; i++)
+		if (sa->page[i] != sb->page[i] && memcmp(sa->page[i], sb->page[i], MEM_PAGE_SIZE))
+			return 0;
+	return 1;
+}
+/*
+ * Run both cores in lockstep. Returns the instruction count at which the
+ * states were first seen to differ, or 0 if they agreed for the whole
+ * budget. *executed is set to the number of instructions run per core.
+ * Memory is only compared at frame boundaries and when minimising, the
+ * rest of the state every interval.
+ */
+static unsigned lockstep(const struct fuzz_run *fr, const uint8_t *rom, size_t len, uint64_t seed,
+		struct chip8_state *sa, struct chip8_state *sb, unsigned *executed)
+{
+	uint64_t ks = seed;
+	unsigned done = 0, next_frame = fr->frame, step, na, nb;
+	int with_mem;
+
+	fuzz_start(fr, sa, rom, len, seed);
+	fuzz_start(fr, sb, rom, len, seed);
+	*executed = 0;
+	while (done < fr->budget) {
+		step = fr->budget - done;
+		if (step > fr->interval)
+			step = fr->interval;
+		if (step > next_frame - done)
+			step = next_frame - done;
+		na = fr->a->run(sa, step);
+		nb = fr->b->run(sb, step);
+		*executed += na;
+		with_mem = fr->interval == 1 || done + na >= next_frame || done + na >= fr->budget || sa->fault;
+		if (na != nb || memcmp(sa, sb, offsetof(struct chip8_state, mem_private)) ||
+				(with_mem && !mem_equal(sa, sb)))
+			return done + (na > nb ? na : nb);
+		done += na;
+		if (sa->fault)
+			break;
+		if (done == next_frame) {
+			chip8_tick(sa);
+			chip8_tick(sb);
+			fuzz_keys(&ks, sa, sb);
+			next_frame += fr->frame;
+		}
+	}
+	return 0;
+}
+
+static void state_diff(const struct chip8_state *sa, const struct chip8_state *sb)
+{
+	int i, shown = 0;
+
+#define DIFF(field)	do { \
+	if (sa->field != sb->field) \
+		printf("  %-8s %#x != %#x\n", #field, (unsigned)sa->field, (unsigned)sb->field); \
+} while (0)
+	DIFF(ip);
+	DIFF(mp);
+	DIFF(sp);
+	DIFF(dt);
+	DIFF(st);
+	DIFF(fault);
+	DIFF(fault_op);
+	DIFF(fb_dirty);
+	DIFF(rng);
+	DIFF(hires);
+	DIFF(planes);
+	DIFF(pitch);
+	for (i = 0; i < 16; i++) {
+		if (sa->v[i] != sb->v[i])
+			printf("  v%-7x %#x != %#x\n", i, sa->v[i], sb->v[i]);
+		if (sa->key[i] != sb->key[i])
+			printf("  key%-5x %d != %d\n", i, sa->key[i], sb->key[i]);
+		if (sa->flags[i] != sb->flags[i])
+			printf("  flags%-3x %#x != %#x\n", i, sa->flags[i], sb->flags[i]);
+		if (sa->pattern[i] != sb->pattern[i])
+			printf("  pat%-5x %#x != %#x\n", i, sa->pattern[i], sb->pattern[i]);
+	}
+	for (i = 0; i < STACK_DEPTH; i++) {
+		if (sa->stack[i] != sb->stack[i])
+			printf("  stack%-3d %#x != %#x\n", i, sa->stack[i], sb->stack[i]);
+	}
+	for (i = 0; i < PLANES * SCREEN_HEIGHT; i++) {
+		fb_row_t ra = sa->fb[i / SCREEN_HEIGHT][i % SCREEN_HEIGHT];
+		fb_row_t rb = sb->fb[i / SCREEN_HEIGHT][i % SCREEN_HEIGHT];
+
+		if (ra != rb)
+			printf("  fb%d[%2d]  %016llx%016llx != %016llx%016llx\n", i / SCREEN_HEIGHT, i % SCREEN_HEIGHT,
+				(unsigned long long)(ra >> 64), (unsigned long long)ra,
+				(unsigned long long)(rb >> 64), (unsigned long long)rb);
+	}
+	for (i = 0; i < MEM_SIZE && shown < 16; i++) {
+		if (chip8_peek(sa, i) != chip8_peek(sb, i)) {
+			printf("  mem[%04x] %#x != %#x\n", i, chip8_peek(sa, i), chip8_peek(sb, i));
+			shown++;
+		}
+	}
+#undef DIFF
+}
+
+/*
+ * Shrink a diverging ROM: stop at the first divergence, drop trailing
+ * words, then blank out every word that is not needed to reproduce it.
+ */
+static size_t minimise(const struct fuzz_run *fr, uint8_t *rom, size_t len, uint64_t seed, unsigned *at)
+{
+	struct fuzz_run m = *fr;
+	static struct chip8_state sa, sb;
+	unsigned executed, r;
+	size_t chunk, i;
+	uint8_t save[2];
+	int changed;
+
+	m.interval = 1;
+	m.budget = *at;
+	r = lockstep(&m, rom, len, seed, &sa, &sb, &executed);
+	if (!r)
+		return len;
+	m.budget = r;
+
+	do {
+		changed = 0;
+		for (chunk = len / 2 & ~1; chunk >= 2; chunk = chunk / 2 & ~1) {
+			while (len > chunk && (r = lockstep(&m, rom, len - chunk, seed, &sa, &sb, &executed))) {
+				len -= chunk;
+				m.budget = r;
+				changed = 1;
+			}
+		}
+		for (i = 0; i + 1 < len; i += 2) {
+			if (rom[i] == NOP >> 8 && rom[i + 1] == (NOP & 0xff))
+				continue;
+			memcpy(save, &rom[i], 2);
+			put_op(rom, i, NOP);
+			if ((r = lockstep(&m, rom, len, seed, &sa, &sb, &executed))) {
+				m.budget = r;
+				changed = 1;
+			} else {
+				memcpy(&rom[i], save, 2);
+			}
+		}
+	} while (changed);
+	*at = m.budget;
+	return len;
+}
+
+static void report(const struct fuzz_run *fr, uint8_t *rom, size_t len, uint64_t seed, unsigned at, const char *outdir)
+{
+	static struct chip8_state sa, sb;
+	struct fuzz_run m = *fr;
+	unsigned executed;
+	char path[4096];
+	FILE *fp;
+
+	len = minimise(fr, rom, len, seed, &at);
+	m.interval = 1;
+	m.budget = at;
+	lockstep(&m, rom, len, seed, &sa, &sb, &executed);
+
+	snprintf(path, sizeof(path), "%s/c8fuzz-%016llx.rom", outdir, (unsigned long long)seed);
+	fp = fopen(path, "wb");
+	if (!fp || fwrite(rom, 1, len, fp) != len)
+		die("cannot write %s\n", path);
+	fclose(fp);
+
+	printf("divergence: %s vs %s (%s) after %u instructions, %zu byte reproducer %s\n",
+		fr->a->name, fr->b->name, chip8_profile_name(sa.profile), at, len, path);
+	printf("  replay: c8fuzz -a %s -b %s -q %s -f %u -s 0x%llx -r %s\n",
+		fr->a->name, fr->b->name, chip8_profile_name(sa.profile), fr->frame,
+		(unsigned long long)seed, path);
+	state_diff(&sa, &sb);
+}
+
+static size_t read_rom(const char *file, uint8_t *buf)
+{
+	FILE *fp;
+	size_t len;
+
+	fp = fopen(file, "rb");
+	if (!fp)
+		die("cannot open %s\n", file);
+	len = fread(buf, 1, MAX_ROM, fp);
+	fclose(fp);
+	return len;
+}
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+static const struct chip8_core *get_core(const char *name)
+{
+	const struct chip8_core *core = chip8_find_core(name);
+
+	if (!core)
+		die("unknown core: %s\n", name);
+	return core;
+}
+static void usage(void)
+{
+	die("usage: c8fuzz [-a core] [-b core] [-q profile|all] [-n roms] [-t secs] [-l insns]\n"
+	    "              [-c interval] [-f frame] [-s seed] [-o dir] [-r rom] [corpus.rom...]\n");
+}
+int main(int argc, char **argv)
+{
+	struct fuzz_run fr = {
+		.a = &chip8_cores[0],
+		.b = &chip8_cores[1],
+		.interval = 64,
+		.frame = 500,
+		.budget = 100000,
+		.profile = -1,
+	};
+	static struct chip8_state sa, sb;
+	uint8_t rom[MAX_ROM];
+	const char *outdir = ".", *replay = NULL;
+	unsigned long long nroms = 0, i, insns = 0;
+	double secs = 0, start, last;
+	uint64_t s, seed = 0;
+	unsigned at, executed;
+	int opt, diverged = 0;
+	size_t len;
+
+	while ((opt = getopt(argc, argv, "a:b:q:n:t:l:c:f:s:o:r:")) != -1) {
+		switch (opt) {
+			case 'a':
+				fr.a = get_core(optarg);
+				break;
+			case 'b':
+				fr.b = get_core(optarg);
+				break;
+			case 'q':
+				fr.profile = strcmp(optarg, "all") ? chip8_find_profile(optarg) : -1;
+				if (fr.profile < 0 && strcmp(optarg, "all"))
+					die("unknown profile: %s\n", optarg);
+				break;
+			case 'n':
+				nroms = strtoull(optarg, NULL, 0);
+				break;
+			case 't':
+				secs = strtod(optarg, NULL);
+				break;
+			case 'l':
+				fr.budget = strtoul(optarg, NULL, 0);
+				break;
+			case 'c':
+				fr.interval = strtoul(optarg, NULL, 0);
+				break;
+			case 'f':
+				fr.frame = strtoul(optarg, NULL, 0);
+				break;
+			case 's':
+				seed = strtoull(optarg, NULL, 0);
+				break;
+			case 'o':
+				outdir = optarg;
+				break;
+			case 'r':
+				replay = optarg;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (!fr.interval || !fr.frame)
+		usage();
+	for (; optind < argc && ncorpus < MAX_CORPUS; optind++) {
+		corpus[ncorpus].len = read_rom(argv[optind], corpus[ncorpus].data);
+		ncorpus++;
+	}
+
+	if (replay) {
+		len = read_rom(replay, rom);
+		at = lockstep(&fr, rom, len, seed, &sa, &sb, &executed);
+		if (!at) {
+			printf("no divergence in %u instructions\n", executed);
+			return 0;
+		}
+		report(&fr, rom, len, seed, at, outdir);
+		return 1;
+	}
+
+	if (!seed)
+		seed = time(NULL);
+	if (!nroms && !secs)
+		nroms = 1000;
+	s = seed;
+	start = last = now_sec();
+	for (i = 0; !nroms || i < nroms; i++) {
+		uint64_t rom_seed = rng_next(&s);
+		uint64_t rs = rom_seed;
+
+		if (ncorpus && rng_below(&rs, 2))
+			len = mutate_rom(&rs, rom);
+		else
+			len = gen_rom(&rs, rom);
+
+		at = lockstep(&fr, rom, len, rom_seed, &sa, &sb, &executed);
+		insns += executed;
+		if (at) {
+			report(&fr, rom, len, rom_seed, at, outdir);
+			diverged++;
+		}
+
+		if ((i & 63) == 0) {
+			double t = now_sec();
+
+			if (secs && t - start >= secs)
+				break;
+			if (t - last >= 10) {
+				fprintf(stderr, "%llu roms, %llu insns, %.1f Minsn/s per core, %d divergences\n",
+					i + 1, insns, insns / (t - start) / 1e6, diverged);
+				last = t;
+			}
+		}
+	}
+	if (fr.a->report)
+		fr.a->report(stderr);
+	if (fr.b->report && fr.b != fr.a)
+		fr.b->report(stderr);
+	fprintf(stderr, "seed 0x%llx: %llu roms, %llu insns, %.1f Minsn/s per core, %d divergences\n",
+		(unsigned long long)seed, i, insns, insns / (now_sec() - start) / 1e6, diverged);
+
+	return diverged ? 1 : 0;
+}
@@ -0,0 +1,397 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "chip8.h"
+
+/*
+ * Linker for the modules chip8as -c writes (see chip8_asm_write_object()
+ * for the format). Sections are laid out from PROGRAM_MEM in command line
+ * order, the first section of the first module first since that is where
+ * the program starts. Unless -a is given only the sections reachable
+ * from there through relocations are kept, so code nothing calls or
+ * loads is dropped. A section must not run into the next one.
+ */
+
+struct module;
+
+struct section {
+	struct module *m;
+	char *name;
+	uint16_t start, end;	/* as assembled */
+	uint16_t base;		/* as linked */
+	int live;
+};
+
+struct reloc {
+	uint16_t addr;
+	unsigned mask;
+	char *sym;		/* NULL for an address in the module */
+	long addend;
+};
+
+struct export {
+	char *name;
+	struct module *m;
+	uint16_t addr;
+};
+
+struct module {
+	const char *file;
+	char *src;
+	uint16_t end;
+	uint8_t *code;		/* from PROGRAM_MEM to end */
+	int first, nsections;	/* in sections[] */
+	struct reloc *relocs;
+	size_t nrelocs;
+};
+
+static struct module *modules;
+static int nmodules;
+static struct section *sections;
+static int nsections;
+static struct export *exports;
+static size_t nexports;
+static int errors;
+
+static void *grow(void *p, size_t n, size_t size)
+{
+	/* doubles at powers of two, so callers just pass the new count */
+	if (n & (n - 1))
+		return p;
+	p = realloc(p, (n ? 2 * n : 1) * size);
+	if (!p)
+		die("out of memory\n");
+	return p;
+}
+static void bad_record(const char *file, int lineno)
+{
+	die("%s:%d: bad module record\n", file, lineno);
+}
+
+static void read_module(struct module *m, const char *file)
+{
+	char *line = NULL, *p, *end;
+	size_t cap = 0;
+	unsigned addr, mask;
+	struct section *s;
+	struct reloc *r;
+	struct export *x;
+	int lineno = 0, n;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (!fp)
+		die("cannot open %s\n", file);
+	memset(m, 0, sizeof(*m));
+	m->file = file;
+	m->first = nsections;
+	while (getline(&line, &cap, fp) != -1) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if (lineno == 1) {
+			if (strcmp(line, CHIP8_OBJ_MAGIC))
+				die("%s: not a chip8as module\n", file);
+			continue;
+		}
+		switch (line[0]) {
+			case 'm':
+				free(m->src);
+				m->src = strdup(line + 2);
+				break;
+			case 's':
+				if (m->code || sscanf(line, "s %x %n", &addr, &n) != 1 || !line[n])
+					bad_record(file, lineno);
+				sections = (struct section *)grow(sections, nsections, sizeof(*sections));
+				s = &sections[nsections++];
+				memset(s, 0, sizeof(*s));
+				s->m = m;
+				s->name = strdup(line + n);
+				s->start = addr;
+				m->nsections++;
+				break;
+			case 'e':
+				if (m->code || sscanf(line, "e %x", &addr) != 1 || addr < PROGRAM_MEM || addr > MEM_SIZE)
+					bad_record(file, lineno);
+				m->end = addr;
+				m->code = (uint8_t *)calloc(addr - PROGRAM_MEM + 1, 1);
+				if (!m->code)
+					die("out of memory\n");
+				break;
+			case 'x':
+				if (sscanf(line, "x %x %n", &addr, &n) != 1 || !line[n])
+					bad_record(file, lineno);
+				exports = (struct export *)grow(exports, nexports, sizeof(*exports));
+				x = &exports[nexports++];
+				x->name = strdup(line + n);
+				x->m = m;
+				x->addr = addr;
+				break;
+			case 'r':
+				if (sscanf(line, "r %x %x %n", &addr, &mask, &n) != 2)
+					bad_record(file, lineno);
+				m->relocs = (struct reloc *)grow(m->relocs, m->nrelocs, sizeof(*m->relocs));
+				r = &m->relocs[m->nrelocs++];
+				r->addr = addr;
+				r->mask = mask;
+				r->sym = NULL;
+				p = line + n;
+				if (!strncmp(p, "L_", 2)) {
+					end = p + strcspn(p, "+-");
+					r->addend = *end ? strtol(end, NULL, 16) : 0;
+					*end = '\0';
+					r->sym = strdup(p);
+				} else {
+					r->addend = strtol(p, &end, 16);
+					if (end == p)
+						bad_record(file, lineno);
+				}
+				break;
+			case 'd':
+				if (!m->code || sscanf(line, "d %x %n", &addr, &n) != 1 || addr < PROGRAM_MEM)
+					bad_record(file, lineno);
+				for (p = line + n; p[0] && p[1]; p += 2, addr++) {
+					if (addr >= m->end)
+						bad_record(file, lineno);
+					sscanf(p, "%2hhx", &m->code[addr - PROGRAM_MEM]);
+				}
+				break;
+			default:
+				bad_record(file, lineno);
+		}
+	}
+	free(line);
+	if (ferror(fp) || !m->code || !m->nsections)
+		die("%s: truncated module\n", file);
+	fclose(fp);
+	if (!m->src)
+		m->src = strdup(file);
+	for (n = 0; n < m->nsections; n++) {
+		s = &sections[m->first + n];
+		s->end = n + 1 < m->nsections ? s[1].start : m->end;
+		if (s->end < s->start)
+			die("%s: sections out of order\n", file);
+	}
+}
+
+/* the section of m an address belongs to, the later one where they meet */
+static struct section *find_section(struct module *m, long addr)
+{
+	int i;
+
+	if (addr > m->end)
+		return NULL;
+	for (i = m->nsections - 1; i >= 0; i--)
+		if (sections[m->first + i].start <= addr)
+			return &sections[m->first + i];
+	return NULL;
+}
+static int export_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct export *)a)->name, ((const struct export *)b)->name);
+}
+static struct export *find_export(const char *name)
+{
+	struct export key = { (char *)name };
+
+	return (struct export *)bsearch(&key, exports, nexports, sizeof(*exports), export_cmp);
+}
+/* the section a relocation points into and the address in it */
+static struct section *target(struct module *m, struct reloc *r, long *addr)
+{
+	struct export *x;
+	struct section *s;
+
+	if (!r->sym) {
+		*addr = r->addend;
+		s = find_section(m, *addr);
+		if (!s) {
+			fprintf(stderr, "%s: reference at %#x points outside the module\n", m->src, r->addr);
+			errors++;
+		}
+		return s;
+	}
+	x = find_export(r->sym);
+	if (!x) {
+		fprintf(stderr, "%s: undefined label %s\n", m->src, r->sym);
+		errors++;
+		return NULL;
+	}
+	*addr = x->addr;
+	return find_section(x->m, x->addr);
+}
+
+/* marks the sections reachable from the start of the program */
+static void mark(int keep_all)
+{
+	struct section **work, *s, *t;
+	struct module *m;
+	struct reloc *r;
+	long addr;
+	int nwork = 0;
+	size_t i;
+
+	work = (struct section **)malloc(nsections * sizeof(*work));
+	if (!work)
+		die("out of memory\n");
+	if (keep_all) {
+		for (nwork = 0; nwork < nsections; nwork++) {
+			work[nwork] = &sections[nwork];
+			sections[nwork].live = 1;
+		}
+	} else {
+		work[nwork++] = find_section(&modules[0], PROGRAM_MEM);
+		work[0]->live = 1;
+	}
+	while (nwork) {
+		s = work[--nwork];
+		m = s->m;
+		for (i = 0; i < m->nrelocs; i++) {
+			r = &m->relocs[i];
+			if (find_section(m, r->addr) != s)
+				continue;
+			t = target(m, r, &addr);
+			if (t && !t->live) {
+				t->live = 1;
+				work[nwork++] = t;
+			}
+		}
+	}
+	free(work);
+}
+static void relocate(struct module *m, uint8_t *rom)
+{
+	struct section *s, *t;
+	struct reloc *r;
+	long addr, v;
+	size_t i;
+	uint8_t *p;
+
+	for (i = 0; i < m->nrelocs; i++) {
+		r = &m->relocs[i];
+		s = find_section(m, r->addr);
+		if (!s || !s->live || r->addr + 2 > s->end)
+			continue;
+		t = target(m, r, &addr);
+		if (!t)
+			continue;
+		v = t->base + (addr - t->start) + (r->sym ? r->addend : 0);
+		if (v < 0 || v > (long)r->mask) {
+			fprintf(stderr, "%s: %s%s at %#lx is out of reach of %#x\n", m->src,
+					r->sym ? r->sym : "address", r->sym ? "" : " in module", v, r->addr);
+			errors++;
+			continue;
+		}
+		p = &rom[s->base + (r->addr - s->start) - PROGRAM_MEM];
+		p[0] = (p[0] & ~(r->mask >> 8)) | v >> 8;
+		p[1] = (p[1] & ~r->mask) | (v & 0xff);
+	}
+}
+
+static void usage(void)
+{
+	die("usage: c8ld [-a] [-m] [-o out.rom] module.obj...\n");
+}
+int main(int argc, char **argv)
+{
+	const char *out = NULL;
+	char *name = NULL;
+	uint8_t *rom;
+	struct section *s;
+	size_t i, len = 0, dropped = 0;
+	int opt, keep_all = 0, map = 0, n;
+	FILE *fp;
+
+	while ((opt = getopt(argc, argv, "amo:")) != -1) {
+		switch (opt) {
+			case 'a':
+				keep_all = 1;
+				break;
+			case 'm':
+				map = 1;
+				break;
+			case 'o':
+				out = optarg;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind == argc)
+		usage();
+	nmodules = argc - optind;
+	modules = (struct module *)calloc(nmodules, sizeof(*modules));
+	if (!modules)
+		die("out of memory\n");
+	for (n = 0; n < nmodules; n++)
+		read_module(&modules[n], argv[optind + n]);
+
+	qsort(exports, nexports, sizeof(*exports), export_cmp);
+	for (i = 1; i < nexports; i++) {
+		if (strcmp(exports[i - 1].name, exports[i].name))
+			continue;
+		fprintf(stderr, "%s: %s already defined in %s\n", exports[i].m->src,
+				exports[i].name, exports[i - 1].m->src);
+		errors++;
+	}
+	mark(keep_all);
+	if (errors)
+		return 1;
+
+	for (n = 0; n < nsections; n++) {
+		s = &sections[n];
+		if (!s->live) {
+			dropped += s->end - s->start;
+			continue;
+		}
+		s->base = PROGRAM_MEM + len;
+		len += s->end - s->start;
+	}
+	if (PROGRAM_MEM + len > MEM_SIZE)
+		die("program of %zu bytes does not fit in memory\n", len);
+	rom = (uint8_t *)malloc(len + 1);
+	if (!rom)
+		die("out of memory\n");
+	for (n = 0; n < nsections; n++) {
+		s = &sections[n];
+		if (s->live)
+			memcpy(&rom[s->base - PROGRAM_MEM], &s->m->code[s->start - PROGRAM_MEM], s->end - s->start);
+	}
+	for (n = 0; n < nmodules; n++)
+		relocate(&modules[n], rom);
+	if (errors)
+		return 1;
+
+	if (map) {
+		for (n = 0; n < nsections; n++) {
+			s = &sections[n];
+			if (s->live)
+				fprintf(stderr, "%04x %5u %s %s\n", s->base, s->end - s->start, s->m->src, s->name);
+			else if (s->end > s->start)
+				fprintf(stderr, "---- %5u %s %s dropped\n", s->end - s->start, s->m->src, s->name);
+		}
+		fprintf(stderr, "%zu bytes, %zu dropped\n", len, dropped);
+	}
+
+	/* game.c8.obj links into game.c8.rom, as chip8as would have assembled it */
+	if (!out) {
+		n = strlen(argv[optind]);
+		if (n > 4 && !strcmp(argv[optind] + n - 4, ".obj"))
+			n -= 4;
+		name = (char *)malloc(n + 5);
+		if (!name)
+			die("out of memory\n");
+		snprintf(name, n + 5, "%.*s.rom", n, argv[optind]);
+		out = name;
+	}
+	fp = strcmp(out, "-") ? fopen(out, "wb") : stdout;
+	if (!fp)
+		die("cannot open %s\n", out);
+	if ((len && fwrite(rom, 1, len, fp) != len) || fclose(fp))
+		die("cannot write %s\n", out);
+	free(name);
+	free(rom);
+	return 0;
+}
@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+/*
+ * Pages carry a reference count in front of their bytes; the zero page,
+ * which all untouched memory maps, has none and is never written. A
+ * machine writes a page in place only while it holds the only reference,
+ * noted in mem_private so that further writes skip the check.
+ */
+struct mem_page {
+	unsigned refs;
+	uint64_t hash;		/* of data while shared, 0 until computed */
+	uint8_t data[MEM_PAGE_SIZE] __attribute__((aligned(16)));
+};
+
+static uint8_t zero_page[MEM_PAGE_SIZE];
+
+#define PAGE_OF(p)	((struct mem_page *)((p) - offsetof(struct mem_page, data)))
+
+static void get_page(uint8_t *p)
+{
+	if (p && p != zero_page)
+		__atomic_fetch_add(&PAGE_OF(p)->refs, 1, __ATOMIC_RELAXED);
+}
+static void put_page(uint8_t *p)
+{
+	if (p && p != zero_page && !__atomic_sub_fetch(&PAGE_OF(p)->refs, 1, __ATOMIC_ACQ_REL))
+		free(PAGE_OF(p));
+}
+
+/* drops the memory of c8, which reads as zeroes afterwards */
+void chip8_release(struct chip8_state *c8)
+{
+	int i;
+
+	for (i = 0; i < MEM_PAGES; i++) {
+		put_page(c8->page[i]);
+		c8->page[i] = zero_page;
+	}
+	c8->mem_private = 0;
+}
+/*
+ * Makes dst a copy of src that shares its memory: both copy a page the
+ * first time they write it. Forking from the same src in several
+ * threads at once is fine once src has been forked from before.
+ */
+void chip8_fork(struct chip8_state *dst, struct chip8_state *src)
+{
+	int i;
+
+	if (dst == src)
+		return;
+	for (i = 0; i < MEM_PAGES; i++)
+		get_page(src->page[i]);
+	chip8_release(dst);
+	if (src->mem_private)
+		src->mem_private = 0;
+	memcpy(dst, src, sizeof(*dst));
+}
+/* makes page n writable in place, copying it if it is shared */
+void chip8_own_page(struct chip8_state *c8, unsigned n)
+{
+	uint8_t *old = c8->page[n];
+	struct mem_page *pg;
+
+	if (old != zero_page && __atomic_load_n(&PAGE_OF(old)->refs, __ATOMIC_ACQUIRE) == 1) {
+		PAGE_OF(old)->hash = 0;
+		c8->mem_private |= 1ull << n;
+		return;
+	}
+	pg = (struct mem_page *)malloc(sizeof(*pg));
+	if (!pg)
+		die("out of memory\n");
+	pg->refs = 1;
+	pg->hash = 0;
+	memcpy(pg->data, old, MEM_PAGE_SIZE);
+	put_page(old);
+	c8->page[n] = pg->data;
+	c8->mem_private |= 1ull << n;
+}
+void chip8_read(const struct chip8_state *c8, unsigned addr, void *buf, size_t len)
+{
+	uint8_t *p = (uint8_t *)buf;
+	size_t n;
+
+	for (; len; len -= n, addr += n, p += n) {
+		addr &= ADDR_MASK;
+		n = MEM_PAGE_SIZE - (addr & MEM_PAGE_MASK);
+		if (n > len)
+			n = len;
+		memcpy(p, &c8->page[addr >> MEM_PAGE_SHIFT][addr & MEM_PAGE_MASK], n);
+	}
+}
+void chip8_write(struct chip8_state *c8, unsigned addr, const void *buf, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	size_t n;
+
+	for (; len; len -= n, addr += n, p += n) {
+		addr &= ADDR_MASK;
+		n = MEM_PAGE_SIZE - (addr & MEM_PAGE_MASK);
+		if (n > len)
+			n = len;
+		if (!((c8->mem_private >> (addr >> MEM_PAGE_SHIFT)) & 1))
+			chip8_own_page(c8, addr >> MEM_PAGE_SHIFT);
+		memcpy(&c8->page[addr >> MEM_PAGE_SHIFT][addr & MEM_PAGE_MASK], p, n);
+	}
+}
+/* chip8_mem_cmp() for ranges over more than one page */
+int chip8_mem_cmp_slow(const struct chip8_state *c8, unsigned addr, const void *buf, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	size_t n;
+	int d;
+
+	for (; len; len -= n, addr += n, p += n) {
+		addr &= ADDR_MASK;
+		n = MEM_PAGE_SIZE - (addr & MEM_PAGE_MASK);
+		if (n > len)
+			n = len;
+		d = memcmp(&c8->page[addr >> MEM_PAGE_SHIFT][addr & MEM_PAGE_MASK], p, n);
+		if (d)
+			return d;
+	}
+	return 0;
+}
+
+#define P1	0x9e3779b185ebca87ull
+#define P2	0xc2b2ae3d27d4eb4full
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+/*
+ * A 64-bit hash over 32 bytes a round in four independent lanes, so the
+ * multiplies of one round overlap. The tail is folded in a byte at a time.
+ */
+static uint64_t hash_bytes(const void *buf, size_t len, uint64_t seed)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	uint64_t a0 = seed + P1, a1 = seed + P2, a2 = seed, a3 = seed - P1, w[4], h;
+
+	for (; len >= 32; len -= 32, p += 32) {
+		memcpy(w, p, sizeof(w));
+		a0 = rotl(a0 + w[0] * P2, 31) * P1;
+		a1 = rotl(a1 + w[1] * P2, 31) * P1;
+		a2 = rotl(a2 + w[2] * P2, 31) * P1;
+		a3 = rotl(a3 + w[3] * P2, 31) * P1;
+	}
+	h = rotl(a0, 1) + rotl(a1, 7) + rotl(a2, 12) + rotl(a3, 18);
+	while (len--)
+		h = rotl(h ^ (*p++ * P1), 11) * P2;
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	return h;
+}
+static uint64_t page_hash(const struct chip8_state *c8, int n)
+{
+	static uint64_t zero_hash;
+	struct mem_page *pg;
+	uint64_t h;
+
+	if (c8->page[n] == zero_page) {
+		h = __atomic_load_n(&zero_hash, __ATOMIC_RELAXED);
+		if (!h)
+			__atomic_store_n(&zero_hash, h = hash_bytes(zero_page, MEM_PAGE_SIZE, 0) | 1, __ATOMIC_RELAXED);
+		return h;
+	}
+	/* a shared page cannot change, its hash is kept */
+	pg = PAGE_OF(c8->page[n]);
+	if ((c8->mem_private >> n) & 1)
+		return hash_bytes(pg->data, MEM_PAGE_SIZE, 0) | 1;
+	h = __atomic_load_n(&pg->hash, __ATOMIC_RELAXED);
+	if (!h)
+		__atomic_store_n(&pg->hash, h = hash_bytes(pg->data, MEM_PAGE_SIZE, 0) | 1, __ATOMIC_RELAXED);
+	return h;
+}
+
+static uint64_t mem_hash(const struct chip8_state *c8, uint64_t h)
+{
+	int i;
+
+	for (i = 0; i < MEM_PAGES; i++)
+		h = rotl(h ^ page_hash(c8, i), 27) * P1;
+	return h;
+}
+
+/*
+ * Hashes what the machine does next depends on: registers, timers,
+ * stack, framebuffer and memory. The keys are input and fb_dirty is for
+ * the frontend, both are left out.
+ */
+uint64_t chip8_hash(const struct chip8_state *c8)
+{
+	uint8_t regs[offsetof(struct chip8_state, fb)];
+	uint64_t h;
+
+	memcpy(regs, c8, sizeof(regs));
+	memset(&regs[offsetof(struct chip8_state, key)], 0, sizeof(c8->key));
+	regs[offsetof(struct chip8_state, fb_dirty)] = 0;
+	h = hash_bytes(regs, sizeof(regs), 0);
+	h = hash_bytes(c8->fb, offsetof(struct chip8_state, mem_private) - offsetof(struct chip8_state, fb), h);
+	return mem_hash(c8, h);
+}
+/* hashes memory only, what a program was loaded into */
+uint64_t chip8_hash_mem(const struct chip8_state *c8)
+{
+	return mem_hash(c8, 0);
+}
+/*
+ * Hashes what a program leaves for anyone to see: the framebuffer and
+ * memory. A program that changes neither is only spinning.
+ */
+uint64_t chip8_hash_output(const struct chip8_state *c8)
+{
+	size_t rows = (c8->hires ? SCREEN_HEIGHT : LORES_HEIGHT) * sizeof(fb_row_t);
+	uint64_t h = 0;
+	int i;
+
+	for (i = 0; i < PLANES; i++)
+		h = hash_bytes(c8->fb[i], rows, h);
+	return mem_hash(c8, h);
+}
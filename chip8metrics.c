@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "chip8.h"
+
+/*
+ * Metrics of running emulators. Whoever runs machines owns a struct
+ * chip8_metrics and updates it with relaxed atomics, which cost about
+ * what a plain add does, so they can stay on in production. Readers
+ * take the registry lock only to walk the list; the values they see may
+ * be a few updates apart from each other, never torn.
+ *
+ * chip8_metrics_serve() starts a thread that answers every connection
+ * to a Unix socket with the text format Prometheus scrapes, wrapped in
+ * an HTTP response if the client sent a request, and that prints a
+ * summary line per instance to stderr at an interval.
+ */
+
+static struct chip8_metrics *instances;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char *sock_path;		/* removed at exit */
+
+struct serve_args {
+	int fd;				/* listening socket, -1 without one */
+	unsigned summary_secs;
+};
+
+static uint64_t load(const uint64_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+/* monotonic time in microseconds */
+uint64_t chip8_metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+/* m must be zeroed, name must outlive the registration */
+void chip8_metrics_register(struct chip8_metrics *m, const char *name)
+{
+	m->name = name;
+	m->last_time = chip8_metrics_now();
+	pthread_mutex_lock(&lock);
+	m->next = instances;
+	instances = m;
+	pthread_mutex_unlock(&lock);
+}
+void chip8_metrics_unregister(struct chip8_metrics *m)
+{
+	struct chip8_metrics **p;
+
+	pthread_mutex_lock(&lock);
+	for (p = &instances; *p; p = &(*p)->next)
+		if (*p == m) {
+			*p = m->next;
+			break;
+		}
+	pthread_mutex_unlock(&lock);
+}
+
+static const struct {
+	const char *name, *help;
+	size_t off;
+} counters[] = {
+	{ "insns", "Instructions run.", offsetof(struct chip8_metrics, insns) },
+	{ "frames", "60 Hz frames run.", offsetof(struct chip8_metrics, frames) },
+	{ "dropped_frames", "Frames run more than a frame late.", offsetof(struct chip8_metrics, dropped) },
+	{ "presents", "Frames shown.", offsetof(struct chip8_metrics, presents) },
+	{ "resets", "Machines reset.", offsetof(struct chip8_metrics, resets) },
+};
+
+static const struct {
+	const char *name, *help;
+	size_t off;
+} hists[] = {
+	{ "frame", "Wall time of a frame, or of an environment step.", offsetof(struct chip8_metrics, frame) },
+	{ "present", "Time to show a frame.", offsetof(struct chip8_metrics, present) },
+	{ "poll", "Time to poll input.", offsetof(struct chip8_metrics, poll) },
+	{ "input", "Time from a key event to the next frame shown.", offsetof(struct chip8_metrics, input) },
+};
+
+#define COUNTER(m, i)	((const uint64_t *)((const char *)(m) + counters[i].off))
+#define HIST(m, i)	((const struct chip8_hist *)((const char *)(m) + hists[i].off))
+
+/* all instances in the Prometheus text format, times in seconds */
+int chip8_metrics_write(FILE *fp)
+{
+	const struct chip8_metrics *m;
+	const struct chip8_hist *h;
+	uint64_t cum;
+	unsigned i, b;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+		fprintf(fp, "# HELP chip8_%s_total %s\n# TYPE chip8_%s_total counter\n",
+				counters[i].name, counters[i].help, counters[i].name);
+		for (m = instances; m; m = m->next)
+			fprintf(fp, "chip8_%s_total{instance=\"%s\"} %llu\n", counters[i].name, m->name,
+					(unsigned long long)load(COUNTER(m, i)));
+	}
+	for (i = 0; i < sizeof(hists) / sizeof(hists[0]); i++) {
+		fprintf(fp, "# HELP chip8_%s_seconds %s\n# TYPE chip8_%s_seconds histogram\n",
+				hists[i].name, hists[i].help, hists[i].name);
+		for (m = instances; m; m = m->next) {
+			h = HIST(m, i);
+			for (b = 0, cum = 0; b < C8_HIST_BUCKETS - 1; b++) {
+				cum += load(&h->bucket[b]);
+				fprintf(fp, "chip8_%s_seconds_bucket{instance=\"%s\",le=\"%.9g\"} %llu\n",
+						hists[i].name, m->name, (1 << (b + C8_HIST_MIN)) / 1e6,
+						(unsigned long long)cum);
+			}
+			cum += load(&h->bucket[b]);
+			fprintf(fp, "chip8_%s_seconds_bucket{instance=\"%s\",le=\"+Inf\"} %llu\n",
+					hists[i].name, m->name, (unsigned long long)cum);
+			fprintf(fp, "chip8_%s_seconds_sum{instance=\"%s\"} %g\n", hists[i].name, m->name,
+					load(&h->sum) / 1e6);
+			fprintf(fp, "chip8_%s_seconds_count{instance=\"%s\"} %llu\n", hists[i].name, m->name,
+					(unsigned long long)load(&h->count));
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return ferror(fp) ? -1 : 0;
+}
+
+/* upper bound in us of the bucket holding quantile q, 0 when empty */
+static uint64_t quantile(const struct chip8_hist *h, double q)
+{
+	uint64_t n = 0, want;
+	unsigned b;
+
+	for (b = 0; b < C8_HIST_BUCKETS; b++)
+		n += load(&h->bucket[b]);
+	if (!n)
+		return 0;
+	want = (uint64_t)(q * (n - 1)) + 1;
+	for (b = 0, n = 0; b < C8_HIST_BUCKETS - 1; b++) {
+		n += load(&h->bucket[b]);
+		if (n >= want)
+			break;
+	}
+	return (uint64_t)1 << (b + C8_HIST_MIN);
+}
+
+/*
+ * A line per instance: instructions and frames per second since the
+ * last summary, frames dropped so far, and the median and 99th
+ * percentile of the histograms that have samples, as bucket bounds.
+ */
+void chip8_metrics_summary(FILE *fp)
+{
+	struct chip8_metrics *m;
+	const struct chip8_hist *h;
+	uint64_t now = chip8_metrics_now(), insns, frames;
+	double secs;
+	unsigned i;
+
+	pthread_mutex_lock(&lock);
+	for (m = instances; m; m = m->next) {
+		insns = load(&m->insns);
+		frames = load(&m->frames);
+		secs = (now - m->last_time) / 1e6;
+		if (secs <= 0)
+			secs = 1e-6;
+		fprintf(fp, "%s: %.2f Minsn/s, %.1f frames/s, %llu dropped", m->name,
+				(insns - m->last_insns) / secs / 1e6, (frames - m->last_frames) / secs,
+				(unsigned long long)load(&m->dropped));
+		for (i = 0; i < sizeof(hists) / sizeof(hists[0]); i++) {
+			h = HIST(m, i);
+			if (load(&h->count))
+				fprintf(fp, ", %s p50 %.3g ms p99 %.3g ms", hists[i].name,
+						quantile(h, 0.5) / 1e3, quantile(h, 0.99) / 1e3);
+		}
+		fprintf(fp, "\n");
+		m->last_insns = insns;
+		m->last_frames = frames;
+		m->last_time = now;
+	}
+	pthread_mutex_unlock(&lock);
+	fflush(fp);
+}
+
+/*
+ * Answers one connection, HTTP if the client speaks first. The text is
+ * built in memory and sent without SIGPIPE, so a client that hangs up
+ * early cannot take the emulator down with it.
+ */
+static void answer(int fd)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	char req[512], *buf = NULL;
+	size_t size = 0, off;
+	ssize_t len = 0;
+	FILE *fp;
+
+	if (poll(&pfd, 1, 100) > 0)
+		len = read(fd, req, sizeof(req));
+	fp = open_memstream(&buf, &size);
+	if (fp) {
+		if (len > 0)
+			fprintf(fp, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n");
+		chip8_metrics_write(fp);
+		fclose(fp);
+		for (off = 0; off < size; off += len) {
+			len = send(fd, buf + off, size - off, MSG_NOSIGNAL);
+			if (len <= 0)
+				break;
+		}
+		free(buf);
+	}
+	close(fd);
+}
+static void *serve(void *arg)
+{
+	struct serve_args a = *(struct serve_args *)arg;
+	struct pollfd pfd = { a.fd, POLLIN, 0 };
+	uint64_t next = chip8_metrics_now() + a.summary_secs * 1000000ull, now;
+	int fd, timeout;
+
+	free(arg);
+	while (1) {
+		now = chip8_metrics_now();
+		if (a.summary_secs && now >= next) {
+			chip8_metrics_summary(stderr);
+			next += a.summary_secs * 1000000ull;
+			continue;
+		}
+		timeout = a.summary_secs ? (int)((next - now + 999) / 1000) : -1;
+		if (poll(&pfd, a.fd >= 0, timeout) <= 0)
+			continue;
+		fd = accept(a.fd, NULL, NULL);
+		if (fd >= 0)
+			answer(fd);
+	}
+	return NULL;
+}
+
+static void remove_socket(void)
+{
+	unlink(sock_path);
+}
+
+/*
+ * Starts serving the registered instances on the Unix socket path,
+ * replacing whatever is there, and every summary_secs seconds printing
+ * chip8_metrics_summary() to stderr. Either may be left out with NULL
+ * or 0. The thread runs until the process exits, which removes the
+ * socket. Returns 0 on success.
+ */
+int chip8_metrics_serve(const char *path, unsigned summary_secs)
+{
+	struct sockaddr_un addr = { 0 };
+	struct serve_args *a;
+	pthread_t tid;
+	int fd = -1;
+
+	if (!path && !summary_secs)
+		return 0;
+	if (path) {
+		if (strlen(path) >= sizeof(addr.sun_path))
+			return -1;
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, path);
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return -1;
+		unlink(path);
+		if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 8)) {
+			close(fd);
+			return -1;
+		}
+		if (!sock_path) {
+			sock_path = strdup(path);
+			if (sock_path)
+				atexit(remove_socket);
+		}
+	}
+	a = (struct serve_args *)malloc(sizeof(*a));
+	if (!a)
+		goto fail;
+	a->fd = fd;
+	a->summary_secs = summary_secs;
+	if (pthread_create(&tid, NULL, serve, a)) {
+		free(a);
+		goto fail;
+	}
+	pthread_detach(tid);
+	return 0;
+fail:
+	if (fd >= 0)
+		close(fd);
+	return -1;
+}
@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include <SDL2/SDL.h>
+
+#include "chip8.h"
+
+#define SURFACE_WIDTH	640
+#define SURFACE_HEIGHT	320
+
+struct chip8_video {
+	uint32_t color[1 << PLANES];	/* indexed by the plane bits of a pixel */
+	SDL_Surface *screen;
+	SDL_Surface *surface;
+	SDL_Window *window;
+};
+
+/* instructions run between input polls and presents */
+#define SDL_BATCH	32
+
+static struct chip8_state *c8;
+static const struct chip8_core *c8core;
+static const struct chip8_vip *c8vip;
+static struct chip8_video video;
+static struct chip8_video *c8v = &video;
+static struct chip8_metrics metrics;
+static uint64_t key_time;	/* of the first key event not shown yet, 0 if none */
+
+static void chip8_video_init(void)
+{
+	SDL_Init(SDL_INIT_VIDEO);
+	c8v->window = SDL_CreateWindow("chip8 emulator", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, SURFACE_WIDTH, SURFACE_HEIGHT, SDL_WINDOW_SHOWN);
+	c8v->surface = SDL_GetWindowSurface(c8v->window);
+	c8v->screen = SDL_CreateRGBSurface(0, SCREEN_WIDTH, SCREEN_HEIGHT, 32, 0xff, 0xff00, 0xff0000, 0xff000000);
+	assert(c8v->window);
+	assert(c8v->surface);
+	assert(c8v->screen);
+	c8v->color[0] = SDL_MapRGB(c8v->screen->format, 0x00, 0x00, 0x00);
+	c8v->color[1] = SDL_MapRGB(c8v->screen->format, 0xff, 0xff, 0xff);
+	c8v->color[2] = SDL_MapRGB(c8v->screen->format, 0xaa, 0xaa, 0xaa);
+	c8v->color[3] = SDL_MapRGB(c8v->screen->format, 0x55, 0x55, 0x55);
+}
+static void chip8_video_close(void)
+{
+	SDL_DestroyWindow(c8v->window);
+	SDL_FreeSurface(c8v->screen);
+	SDL_Quit();
+}
+static void chip8_close(void)
+{
+	chip8_video_close();
+	chip8_dump(c8);
+	if (c8core->report)
+		c8core->report(stdout);
+	exit(1);
+}
+/*
+ * Expand the packed bitplanes into the screen surface and scale the part
+ * used by the current resolution up to the window.
+ */
+static void chip8_video_present(void)
+{
+	int x, y;
+	uint32_t *pixel;
+	SDL_Rect src, rect;
+	uint64_t t = chip8_metrics_now(), now;
+
+	src.x = 0;
+	src.y = 0;
+	src.w = c8->hires ? SCREEN_WIDTH : LORES_WIDTH;
+	src.h = c8->hires ? SCREEN_HEIGHT : LORES_HEIGHT;
+	for (y = 0; y < src.h; y++) {
+		pixel = (uint32_t *)((uint8_t *)c8v->screen->pixels + y * c8v->screen->pitch);
+		for (x = 0; x < src.w; x++)
+			pixel[x] = c8v->color[((c8->fb[0][y] << x) >> 127) | ((c8->fb[1][y] << x) >> 127) << 1];
+	}
+
+	rect.x = 0;
+	rect.y = 0;
+	rect.w = SURFACE_WIDTH;
+	rect.h = SURFACE_HEIGHT;
+	SDL_BlitScaled(c8v->screen, &src, c8v->surface, &rect);
+	SDL_UpdateWindowSurface(c8v->window);
+	c8->fb_dirty = 0;
+
+	now = chip8_metrics_now();
+	chip8_metrics_add(&metrics.presents, 1);
+	chip8_hist_add(&metrics.present, now - t);
+	if (key_time) {
+		chip8_hist_add(&metrics.input, now - key_time);
+		key_time = 0;
+	}
+}
+static void chip8_video_key_process(void)
+{
+	int key;
+	SDL_Event e;
+
+	while (SDL_PollEvent(&e)) {
+		if (e.type == SDL_QUIT)
+			chip8_close();
+
+		if (e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) {
+			switch (e.key.keysym.sym) {
+				case SDLK_0:
+				case SDLK_1:
+				case SDLK_2:
+				case SDLK_3:
+				case SDLK_4:
+				case SDLK_5:
+				case SDLK_6:
+				case SDLK_7:
+				case SDLK_8:
+				case SDLK_9:
+					key = e.key.keysym.sym - SDLK_0;
+					break;
+				case SDLK_a:
+				case SDLK_b:
+				case SDLK_c:
+				case SDLK_d:
+				case SDLK_e:
+				case SDLK_f:
+					key = e.key.keysym.sym - SDLK_a + 10;
+					break;
+				case SDLK_ESCAPE:
+					chip8_close();
+					break;
+				default:
+					return;
+					break;
+			}
+			if (e.type == SDL_KEYDOWN)
+				c8->key[key] = 1;
+			else
+				c8->key[key] = 0;
+			if (!key_time)
+				key_time = chip8_metrics_now();
+		}
+	}
+}
+
+/*
+ * Ends the run on a fault: 00FD exits quietly, a halt with the final
+ * state and how many instructions it took, status 0. Anything else is a
+ * failure, status 2 if the watchdog found the program stuck.
+ */
+static void chip8_stop(uint64_t insns)
+{
+	char where[128], vip[96] = "";
+
+	chip8_video_close();
+	if (c8->fault == C8_EXIT)
+		exit(0);
+	chip8_dump(c8);
+	chip8_sym_str(c8->ip, where, sizeof(where));
+	if (c8vip)
+		snprintf(vip, sizeof(vip), ", %llu VIP cycles in %.2f s",
+				(unsigned long long)c8vip->cycles, c8vip->frames / 60.0);
+	if (c8->fault == C8_HALT) {
+		printf("halt: %04x at %s after %llu instructions%s\n", c8->fault_op, where,
+				(unsigned long long)insns, vip);
+		exit(0);
+	}
+	fprintf(stderr, "%s: %04x at %s after %llu instructions%s\n", chip8_fault_str(c8),
+			c8->fault_op, where, (unsigned long long)insns, vip);
+	exit(c8->fault == C8_STUCK ? 2 : 1);
+}
+
+/*
+ * Frontend main loop, shared by c8emu and ROMs compiled with c8aot: runs
+ * the core in small batches so fused and translated code gets a chance to
+ * run, presents the framebuffer when it changes and ticks the timers at
+ * 60Hz. With vip it runs VIP frames instead, 60 a second of wall clock
+ * time whatever the core and the host. With watchdog, that many frames
+ * without progress end the run, see chip8_watchdog(). Keeps metrics
+ * under the name "sdl" for chip8_metrics_serve(): a frame's wall time
+ * is from one timer tick to the next, and a frame counts as dropped
+ * when it runs more than a frame late. Never returns.
+ */
+void chip8_sdl_run(struct chip8_state *state, const struct chip8_core *core, unsigned watchdog,
+		struct chip8_vip *vip)
+{
+	struct chip8_watchdog wd = { watchdog, 0, 0 };
+	uint64_t insns = 0, frame_insns = 0, t, tick, polled;
+	uint32_t start, last, now;
+	unsigned n;
+	int ticked;
+
+	c8 = state;
+	c8core = core;
+	c8vip = vip;
+	chip8_video_init();
+	chip8_metrics_register(&metrics, "sdl");
+
+	start = last = SDL_GetTicks();
+	tick = chip8_metrics_now();
+	while (1) {
+		polled = chip8_metrics_now();
+		chip8_video_key_process();
+		now = SDL_GetTicks();
+		t = chip8_metrics_now();
+		chip8_hist_add(&metrics.poll, t - polled);
+		if (vip) {
+			if (vip->frames >= (uint64_t)(now - start) * 60 / 1000) {
+				SDL_Delay(1);
+				continue;
+			}
+			if (vip->frames + 1 < (uint64_t)(now - start) * 60 / 1000)
+				chip8_metrics_add(&metrics.dropped, 1);
+			n = chip8_vip_frame(vip, c8, core);
+			ticked = 1;
+		} else {
+			n = core->run(c8, SDL_BATCH);
+			ticked = now - last >= 15;
+			if (ticked) {
+				chip8_tick(c8);
+				if (t - tick >= 2 * 16667)
+					chip8_metrics_add(&metrics.dropped, (t - tick) / 16667 - 1);
+				last = now;
+			}
+		}
+		insns += n;
+		frame_insns += n;
+		if (ticked) {
+			chip8_metrics_add(&metrics.insns, frame_insns);
+			chip8_metrics_add(&metrics.frames, 1);
+			frame_insns = 0;
+			chip8_hist_add(&metrics.frame, t - tick);
+			tick = t;
+		}
+		if (c8->fault)
+			chip8_stop(insns);
+		if (c8->fb_dirty)
+			chip8_video_present();
+		if (ticked && chip8_watchdog(&wd, c8))
+			chip8_stop(insns);
+	}
+
+	chip8_close();
+}
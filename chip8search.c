@@ -0,0 +1,524 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "chip8.h"
+
+/*
+ * Searches for key inputs that drive a ROM into a goal state. Every
+ * state is expanded by forking it once per input choice and running
+ * each child for a few frames; children that fault or hash to a state
+ * already seen are dropped. The frontier is taken in BFS, DFS or
+ * best-first order by any number of threads, which share it under one
+ * lock and check visited states in a lock-free hash set.
+ *
+ * Only a (parent, keys) record is kept for each state once expanded, so
+ * the inputs that led to the goal can be printed, one line per frame.
+ */
+
+#define MAX_CHOICES	64
+#define MAX_GOALS	16
+
+enum { BFS, DFS, BEST };
+
+struct goal {
+	uint32_t addr;		/* C8_ENV_V(x) for a register */
+	int op;
+	unsigned value;
+};
+
+struct trace {
+	uint32_t parent;
+	uint16_t keys;
+};
+
+struct node {
+	struct chip8_state c8;
+	uint32_t trace;
+	uint32_t depth;
+	int score;
+};
+
+static const struct chip8_core *core;
+static unsigned insns_per_frame = 10, frames = 1;
+static uint16_t choices[MAX_CHOICES];
+static int nchoices;
+static struct goal goals[MAX_GOALS];
+static int ngoals;
+static int order = BFS;
+static long score_addr = -1;
+static unsigned max_depth = 1000;
+
+static struct trace *traces;
+static uint32_t max_states, ntraces;
+static uint64_t *visited;
+static size_t visited_mask;
+static uint64_t duplicates;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t more = PTHREAD_COND_INITIALIZER;
+static struct node **frontier;
+static size_t head, tail, cap;	/* bfs takes from head, the rest from tail */
+static int busy, stop;
+static long found = -1;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned read_byte(const struct chip8_state *c8, uint32_t addr)
+{
+	return addr >= MEM_SIZE ? c8->v[(addr - MEM_SIZE) & 0xf] : chip8_peek(c8, addr);
+}
+static int reached(const struct chip8_state *c8)
+{
+	unsigned b;
+	int i, ok;
+
+	for (i = 0; i < ngoals; i++) {
+		b = read_byte(c8, goals[i].addr);
+		switch (goals[i].op) {
+			case '=': ok = b == goals[i].value; break;
+			case '!': ok = b != goals[i].value; break;
+			case '<': ok = b < goals[i].value; break;
+			case '>': ok = b > goals[i].value; break;
+			case 'l': ok = b <= goals[i].value; break;
+			default: ok = b >= goals[i].value; break;
+		}
+		if (!ok)
+			return 0;
+	}
+	return 1;
+}
+
+/* 1 if h was not in the set yet */
+static int visit(uint64_t h)
+{
+	size_t i;
+	uint64_t cur;
+
+	h |= !h;
+	for (i = h & visited_mask;; i = (i + 1) & visited_mask) {
+		cur = __atomic_load_n(&visited[i], __ATOMIC_RELAXED);
+		if (!cur && __atomic_compare_exchange_n(&visited[i], &cur, h, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			return 1;
+		if (cur == h)
+			return 0;
+	}
+}
+
+/* the frontier, called with lock held */
+static int before(const struct node *a, const struct node *b)
+{
+	return a->score > b->score || (a->score == b->score && a->depth < b->depth);
+}
+static void push(struct node *n)
+{
+	struct node *t;
+	size_t i;
+
+	if (tail == cap) {
+		if (head) {
+			memmove(frontier, frontier + head, (tail - head) * sizeof(*frontier));
+			tail -= head;
+			head = 0;
+		}
+		if (tail == cap) {
+			cap = cap ? 2 * cap : 1024;
+			frontier = (struct node **)realloc(frontier, cap * sizeof(*frontier));
+			if (!frontier)
+				die("out of memory\n");
+		}
+	}
+	frontier[tail] = n;
+	if (order != BEST) {
+		tail++;
+		return;
+	}
+	for (i = tail++; i && before(frontier[i], frontier[(i - 1) / 2]); i = (i - 1) / 2) {
+		t = frontier[i];
+		frontier[i] = frontier[(i - 1) / 2];
+		frontier[(i - 1) / 2] = t;
+	}
+}
+static struct node *pop(void)
+{
+	struct node *n, *t;
+	size_t i, c;
+
+	if (order == BFS)
+		return frontier[head++];
+	if (order == DFS)
+		return frontier[--tail];
+	n = frontier[0];
+	frontier[0] = frontier[--tail];
+	for (i = 0; (c = 2 * i + 1) < tail; i = c) {
+		if (c + 1 < tail && before(frontier[c + 1], frontier[c]))
+			c++;
+		if (!before(frontier[c], frontier[i]))
+			break;
+		t = frontier[i];
+		frontier[i] = frontier[c];
+		frontier[c] = t;
+	}
+	return n;
+}
+static void drop(struct node *n)
+{
+	chip8_release(&n->c8);
+	free(n);
+}
+
+/*
+ * Runs keys on a fork of parent. NULL if it faults or was seen before,
+ * or with *full set if there is no room for another state.
+ */
+static struct node *child(struct node *parent, uint16_t keys, int *full)
+{
+	struct node *n;
+	uint32_t t;
+	unsigned f;
+	int k;
+
+	n = (struct node *)calloc(1, sizeof(*n));
+	if (!n)
+		die("out of memory\n");
+	chip8_fork(&n->c8, &parent->c8);
+	for (f = 0; f < frames && !n->c8.fault; f++) {
+		for (k = 0; k < 16; k++)
+			n->c8.key[k] = (keys >> k) & 1;
+		core->run(&n->c8, insns_per_frame);
+		chip8_tick(&n->c8);
+	}
+	if (n->c8.fault) {
+		drop(n);
+		return NULL;
+	}
+	if (!visit(chip8_hash(&n->c8))) {
+		__atomic_fetch_add(&duplicates, 1, __ATOMIC_RELAXED);
+		drop(n);
+		return NULL;
+	}
+	t = __atomic_fetch_add(&ntraces, 1, __ATOMIC_RELAXED);
+	if (t >= max_states) {
+		*full = 1;
+		drop(n);
+		return NULL;
+	}
+	traces[t].parent = parent->trace;
+	traces[t].keys = keys;
+	n->trace = t;
+	n->depth = parent->depth + 1;
+	n->score = score_addr >= 0 ? (int)read_byte(&n->c8, score_addr) : 0;
+	return n;
+}
+static void *worker(void *arg)
+{
+	struct node *n, *c, *kids[MAX_CHOICES];
+	int i, nkids, full = 0;
+	long goal = -1;
+
+	(void)arg;
+	pthread_mutex_lock(&lock);
+	while (1) {
+		while (!stop && head == tail && busy)
+			pthread_cond_wait(&more, &lock);
+		if (stop || head == tail)
+			break;
+		n = pop();
+		busy++;
+		pthread_mutex_unlock(&lock);
+
+		nkids = 0;
+		for (i = 0; i < nchoices && !full && !__atomic_load_n(&stop, __ATOMIC_RELAXED); i++) {
+			c = child(n, choices[i], &full);
+			if (!c)
+				continue;
+			if (ngoals && reached(&c->c8)) {
+				goal = c->trace;
+				drop(c);
+				break;
+			}
+			if (c->depth * frames < max_depth)
+				kids[nkids++] = c;
+			else
+				drop(c);
+		}
+		drop(n);
+
+		pthread_mutex_lock(&lock);
+		for (i = 0; i < nkids; i++)
+			push(kids[i]);
+		if (goal >= 0 && found < 0)
+			found = goal;
+		if (goal >= 0 || full)
+			__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+		busy--;
+		pthread_cond_broadcast(&more);
+	}
+	pthread_cond_broadcast(&more);
+	pthread_mutex_unlock(&lock);
+	if (core->release)
+		core->release();
+	return NULL;
+}
+
+/* "==", "!=", "<=", ">=", "<" or ">" as one character */
+static int parse_op(const char **s)
+{
+	const char *p = *s;
+
+	*s += 2;
+	if (p[0] == '=' && p[1] == '=')
+		return '=';
+	if (p[0] == '!' && p[1] == '=')
+		return '!';
+	if (p[1] == '=' && (p[0] == '<' || p[0] == '>'))
+		return p[0] == '<' ? 'l' : 'g';
+	*s -= 1;
+	return p[0] == '<' || p[0] == '>' ? p[0] : 0;
+}
+/* a byte of memory, or vN for a register */
+static uint32_t parse_addr(const char *s, char **end)
+{
+	unsigned long a;
+
+	if (s[0] == 'v') {
+		a = strtoul(s + 1, end, 16);
+		if (*end == s + 1 || a > 0xf)
+			*end = (char *)s;
+		return C8_ENV_V(a);
+	}
+	a = strtoul(s, end, 0);
+	if (a >= MEM_SIZE)
+		*end = (char *)s;
+	return a;
+}
+static void parse_goal(const char *s)
+{
+	struct goal *g = &goals[ngoals];
+	const char *p;
+	char *end;
+
+	if (ngoals == MAX_GOALS)
+		die("at most %d goals\n", MAX_GOALS);
+	g->addr = parse_addr(s, &end);
+	p = end;
+	g->op = end == s ? 0 : parse_op(&p);
+	if (!g->op)
+		die("bad goal %s, want addr|vN followed by == != < > <= >= and a value\n", s);
+	g->value = strtoul(p, &end, 0);
+	if (end == p || *end)
+		die("bad goal %s\n", s);
+	ngoals++;
+}
+/* "-,4,6,46": no key, key 4, key 6, keys 4 and 6 together */
+static void parse_choices(const char *s)
+{
+	const char *p;
+	uint16_t keys = 0;
+	int c;
+
+	nchoices = 0;
+	for (p = s;; p++) {
+		c = *p;
+		if (c == ',' || !c) {
+			if (nchoices == MAX_CHOICES)
+				die("at most %d key choices\n", MAX_CHOICES);
+			choices[nchoices++] = keys;
+			keys = 0;
+			if (!c)
+				break;
+		} else if (c >= '0' && c <= '9') {
+			keys |= 1 << (c - '0');
+		} else if (c >= 'a' && c <= 'f') {
+			keys |= 1 << (c - 'a' + 10);
+		} else if (c != '-') {
+			die("bad key choice in %s\n", s);
+		}
+	}
+}
+static void print_keys(FILE *fp, uint16_t keys)
+{
+	int k;
+
+	if (!keys)
+		fputc('-', fp);
+	for (k = 0; k < 16; k++)
+		if (keys & (1 << k))
+			fputc("0123456789abcdef"[k], fp);
+	fputc('\n', fp);
+}
+
+static void usage(void)
+{
+	die("usage: c8search [-c core] [-q profile] [-i insns] [-f frames] [-k keys] [-o bfs|dfs|best]\n"
+	    "                [-s addr|vN] [-d depth] [-m states] [-t threads] [-w out] [-g goal]... romfile\n");
+}
+int main(int argc, char **argv)
+{
+	static uint8_t rom[MEM_SIZE - PROGRAM_MEM];
+	const char *out = NULL;
+	struct node *root;
+	pthread_t *tids;
+	uint32_t *path, t;
+	unsigned nthreads = 0, depth, i, f;
+	int profile = C8_MODERN, opt;
+	size_t len, size;
+	char *end;
+	double secs;
+	FILE *fp;
+
+	core = chip8_find_core("fused");
+	max_states = 1 << 20;
+	parse_choices("-,0,1,2,3,4,5,6,7,8,9,a,b,c,d,e,f");
+	while ((opt = getopt(argc, argv, "c:q:i:f:k:o:s:d:m:t:w:g:")) != -1) {
+		switch (opt) {
+			case 'c':
+				core = chip8_find_core(optarg);
+				if (!core)
+					die("unknown core: %s\n", optarg);
+				break;
+			case 'q':
+				profile = chip8_find_profile(optarg);
+				if (profile < 0)
+					die("unknown profile: %s\n", optarg);
+				break;
+			case 'i':
+				insns_per_frame = strtoul(optarg, NULL, 0);
+				break;
+			case 'f':
+				frames = strtoul(optarg, NULL, 0);
+				break;
+			case 'k':
+				parse_choices(optarg);
+				break;
+			case 'o':
+				if (!strcmp(optarg, "bfs"))
+					order = BFS;
+				else if (!strcmp(optarg, "dfs"))
+					order = DFS;
+				else if (!strcmp(optarg, "best"))
+					order = BEST;
+				else
+					die("unknown order: %s\n", optarg);
+				break;
+			case 's':
+				score_addr = parse_addr(optarg, &end);
+				if (end == optarg || *end)
+					die("bad score address %s\n", optarg);
+				break;
+			case 'd':
+				max_depth = strtoul(optarg, NULL, 0);
+				break;
+			case 'm':
+				max_states = strtoul(optarg, NULL, 0);
+				break;
+			case 't':
+				nthreads = strtoul(optarg, NULL, 0);
+				break;
+			case 'w':
+				out = optarg;
+				break;
+			case 'g':
+				parse_goal(optarg);
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind != argc - 1 || !frames || !max_states)
+		usage();
+	if (order == BEST && score_addr < 0)
+		die("best-first needs a score, -s\n");
+	if (!nthreads)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+
+	fp = fopen(argv[optind], "rb");
+	if (!fp)
+		die("cannot open %s\n", argv[optind]);
+	len = fread(rom, 1, sizeof(rom), fp);
+	fclose(fp);
+
+	/* the set stays at most half full */
+	for (size = 1024; size < 2 * (size_t)max_states; size *= 2)
+		;
+	visited = (uint64_t *)calloc(size, sizeof(*visited));
+	visited_mask = size - 1;
+	traces = (struct trace *)malloc(max_states * sizeof(*traces));
+	root = (struct node *)calloc(1, sizeof(*root));
+	tids = (pthread_t *)calloc(nthreads, sizeof(*tids));
+	if (!visited || !traces || !root || !tids)
+		die("out of memory\n");
+
+	chip8_init(&root->c8, 1);
+	root->c8.profile = profile;
+	chip8_load(&root->c8, rom, len);
+	visit(chip8_hash(&root->c8));
+	traces[0].parent = 0;
+	traces[0].keys = 0;
+	ntraces = 1;
+	if (ngoals && reached(&root->c8))
+		found = 0;
+	else
+		push(root);
+
+	/* the main thread is worker 0 */
+	secs = now();
+	for (i = 1; i < nthreads; i++)
+		if (pthread_create(&tids[i], NULL, worker, NULL))
+			die("cannot create thread\n");
+	worker(NULL);
+	for (i = 1; i < nthreads; i++)
+		pthread_join(tids[i], NULL);
+	secs = now() - secs;
+	while (head < tail)
+		drop(pop());
+	if (!found)
+		drop(root);
+	free(frontier);
+	free(visited);
+	free(tids);
+
+	if (ntraces > max_states)
+		ntraces = max_states;
+	fprintf(stderr, "%u states, %llu duplicates, %.3f s, %.0f states/s\n", ntraces,
+			(unsigned long long)duplicates, secs, ntraces / secs);
+	if (found < 0) {
+		fprintf(stderr, "no goal state found%s\n", ntraces == max_states ? ", out of states" : "");
+		free(traces);
+		return 1;
+	}
+
+	for (depth = 0, t = found; t; t = traces[t].parent)
+		depth++;
+	path = (uint32_t *)malloc((depth + 1) * sizeof(*path));
+	if (!path)
+		die("out of memory\n");
+	for (i = depth, t = found; t; t = traces[t].parent)
+		path[--i] = t;
+	fprintf(stderr, "goal reached after %u frames\n", depth * frames);
+
+	fp = out && strcmp(out, "-") ? fopen(out, "w") : stdout;
+	if (!fp)
+		die("cannot open %s\n", out);
+	for (i = 0; i < depth; i++)
+		for (f = 0; f < frames; f++)
+			print_keys(fp, traces[path[i]].keys);
+	if (fclose(fp))
+		die("cannot write %s\n", out ? out : "input log");
+	free(path);
+	free(traces);
+	return 0;
+}
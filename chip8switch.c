@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+/*
+ * Single-function core: the optables handlers folded into one switch so
+ * the compiler can keep registers and ip local across instructions.
+ * Must stay bit-for-bit equivalent to chip8_run_optables(), c8fuzz
+ * checks that. Instantiated once per profile, q is always a constant.
+ * With cov it is the cover core, recording coverage in chip8cov.c.
+ */
+
+/* a skip, with cov also which way it went */
+#define SKIP_IF(cond) do { \
+	if (cond) { \
+		if (cov) \
+			chip8_cov_mark(chip8_cov_taken, c8->ip); \
+		c8->ip += chip8_skip_size(c8, q); \
+	} else if (cov) \
+		chip8_cov_mark(chip8_cov_not_taken, c8->ip); \
+} while (0)
+
+static inline __attribute__((always_inline)) unsigned run_switch(struct chip8_state *c8, unsigned n, const int q, const int cov)
+{
+	unsigned i;
+	uint16_t op;
+	uint8_t *v = c8->v;
+	uint8_t *vx, *vy, *vf = &c8->v[0xf];
+
+	for (i = 0; i < n; i++) {
+		if (cov)
+			chip8_cov_mark(chip8_cov_exec, c8->ip);
+		op = chip8_fetch(c8);
+		vx = &v[opX];
+		vy = &v[opY];
+
+		switch (opC) {
+			case 0x0:
+				if (op == 0x00e0) {
+					chip8_clear_screen(c8);
+					break;
+				}
+				if (op == 0x00ee) {
+					chip8_sub_return(c8);
+					if (c8->fault)
+						return i + 1;
+					continue;
+				}
+				if (QUIRKS(q) & Q_HIRES) {
+					if ((op & 0xfff0) == 0x00c0) {
+						chip8_scroll_down(c8, opN);
+						break;
+					}
+					switch (op) {
+						case 0x00fb:
+							chip8_scroll_right(c8);
+							goto next;
+						case 0x00fc:
+							chip8_scroll_left(c8);
+							goto next;
+						case 0x00fd:
+							chip8_set_fault(c8, C8_EXIT, op);
+							return i + 1;
+						case 0x00fe:
+						case 0x00ff:
+							chip8_set_hires(c8, op & 1);
+							goto next;
+					}
+				}
+				if (!(QUIRKS(q) & Q_HIRES) && op == 0x00ff) {
+					chip8_set_fault(c8, C8_HALT, op);
+					return i + 1;
+				}
+				if ((QUIRKS(q) & Q_XO) && (op & 0xfff0) == 0x00d0) {
+					chip8_scroll_up(c8, opN);
+					break;
+				}
+				goto bad_op;
+			case 0x1:
+				if (chip8_jump_halts(c8, op)) {
+					chip8_set_fault(c8, C8_HALT, op);
+					return i + 1;
+				}
+				c8->ip = opNNN;
+				continue;
+			case 0x2:
+				chip8_sub_call(c8, opNNN);
+				if (c8->fault)
+					return i + 1;
+				continue;
+			case 0x3:
+				SKIP_IF(*vx == opNN);
+				break;
+			case 0x4:
+				SKIP_IF(*vx != opNN);
+				break;
+			case 0x5:
+				if (opN == 0) {
+					SKIP_IF(*vx == *vy);
+					break;
+				}
+				if (!(QUIRKS(q) & Q_XO) || (opN != 2 && opN != 3))
+					goto bad_op;
+				{
+					int j, d = opX <= opY ? 1 : -1;
+					for (j = 0; opX + j * d != opY + d; j++) {
+						if (opN == 2)
+							chip8_poke(c8, c8->mp + j, v[opX + j * d]);
+						else
+							v[opX + j * d] = chip8_peek(c8, c8->mp + j);
+					}
+				}
+				break;
+			case 0x6:
+				*vx = opNN;
+				break;
+			case 0x7:
+				*vx += opNN;
+				break;
+			case 0x8:
+				switch (opN) {
+					case 0:
+						*vx = *vy;
+						break;
+					case 1:
+						*vx |= *vy;
+						if (QUIRKS(q) & Q_VF_RESET)
+							*vf = 0;
+						break;
+					case 2:
+						*vx &= *vy;
+						if (QUIRKS(q) & Q_VF_RESET)
+							*vf = 0;
+						break;
+					case 3:
+						*vx ^= *vy;
+						if (QUIRKS(q) & Q_VF_RESET)
+							*vf = 0;
+						break;
+					case 4:
+						*vx += *vy;
+						*vf = *vx < *vy;
+						break;
+					case 5:
+						*vf = *vx < *vy;
+						*vx -= *vy;
+						break;
+					case 6:
+						if (QUIRKS(q) & Q_SHIFT_VY) {
+							uint8_t src = *vy;
+							*vx = src >> 1;
+							*vf = src & 0x1;
+							break;
+						}
+						*vf = *vx & 0x1;
+						*vx >>= 1;
+						break;
+					case 7:
+						*vf = *vy < *vx;
+						*vx = *vy - *vx;
+						break;
+					case 0xe:
+						if (QUIRKS(q) & Q_SHIFT_VY) {
+							uint8_t src = *vy;
+							*vx = src << 1;
+							*vf = (src & 0x80) >> 7;
+							break;
+						}
+						*vf = (*vx & 0x80) >> 7;
+						*vx <<= 1;
+						break;
+					default:
+						goto bad_op;
+				}
+				break;
+			case 0x9:
+				if (opN != 0)
+					goto bad_op;
+				SKIP_IF(*vx != *vy);
+				break;
+			case 0xa:
+				c8->mp = opNNN;
+				break;
+			case 0xb:
+				c8->ip = (QUIRKS(q) & Q_JUMP_VX ? *vx : v[0]) + opNNN;
+				continue;
+			case 0xc:
+				*vx = opNN & chip8_rand16(c8);
+				break;
+			case 0xd:
+				if ((QUIRKS(q) & Q_HIRES) && opN == 0) {
+					if (QUIRKS(q) & Q_CLIP)
+						*vf = chip8_draw16_clip(c8, *vx, *vy);
+					else
+						*vf = chip8_draw16(c8, *vx, *vy);
+				} else if (QUIRKS(q) & Q_CLIP)
+					*vf = chip8_draw_clip(c8, *vx, *vy, opN);
+				else
+					*vf = chip8_draw(c8, *vx, *vy, opN);
+				break;
+			case 0xe:
+				if (opNN == 0x9e) {
+					SKIP_IF(c8->key[*vx & 0xf]);
+				} else if (opNN == 0xa1) {
+					SKIP_IF(!c8->key[*vx & 0xf]);
+				} else {
+					goto bad_op;
+				}
+				break;
+			case 0xf:
+				switch (opNN) {
+					case 0x00:
+						if (!(QUIRKS(q) & Q_XO) || opX)
+							goto bad_op;
+						c8->mp = (chip8_peek(c8, c8->ip + 2) << 8) |
+							chip8_peek(c8, c8->ip + 3);
+						c8->ip += 2;
+						break;
+					case 0x01:
+						if (!(QUIRKS(q) & Q_XO) || opX >= (1 << PLANES))
+							goto bad_op;
+						c8->planes = opX;
+						break;
+					case 0x02:
+						if (!(QUIRKS(q) & Q_XO) || opX)
+							goto bad_op;
+						{
+							int j;
+							for (j = 0; j < 16; j++)
+								c8->pattern[j] = chip8_peek(c8, c8->mp + j);
+						}
+						break;
+					case 0x07:
+						*vx = c8->dt;
+						break;
+					case 0x0a:
+						*vx = chip8_wait_input(c8);
+						if (*vx == 0xff)
+							continue;
+						break;
+					case 0x15:
+						c8->dt = *vx;
+						break;
+					case 0x18:
+						c8->st = *vx;
+						break;
+					case 0x1e:
+						c8->mp += *vx;
+						break;
+					case 0x29:
+						c8->mp = *vx * 5;
+						break;
+					case 0x30:
+						if (!(QUIRKS(q) & Q_HIRES))
+							goto bad_op;
+						c8->mp = BIGFONT_MEM + *vx * 10;
+						break;
+					case 0x3a:
+						if (!(QUIRKS(q) & Q_XO))
+							goto bad_op;
+						c8->pitch = *vx;
+						break;
+					case 0x33:
+						chip8_poke(c8, c8->mp, *vx / 100);
+						chip8_poke(c8, c8->mp + 1, (*vx % 100) / 10);
+						chip8_poke(c8, c8->mp + 2, *vx % 10);
+						break;
+					case 0x55:
+						{
+							int j;
+							for (j = 0; j <= opX; j++)
+								chip8_poke(c8, c8->mp + j, v[j]);
+							if (QUIRKS(q) & Q_MEM_INC)
+								c8->mp += opX + 1;
+						}
+						break;
+					case 0x65:
+						{
+							int j;
+							for (j = 0; j <= opX; j++)
+								v[j] = chip8_peek(c8, c8->mp + j);
+							if (QUIRKS(q) & Q_MEM_INC)
+								c8->mp += opX + 1;
+						}
+						break;
+					case 0x75:
+						if (!(QUIRKS(q) & Q_HIRES))
+							goto bad_op;
+						memcpy(c8->flags, v, opX + 1);
+						break;
+					case 0x85:
+						if (!(QUIRKS(q) & Q_HIRES))
+							goto bad_op;
+						memcpy(v, c8->flags, opX + 1);
+						break;
+					default:
+						goto bad_op;
+				}
+				break;
+		}
+next:
+		c8->ip += 2;
+		continue;
+bad_op:
+		chip8_set_fault(c8, C8_BAD_OP, op);
+		return i + 1;
+	}
+	return i;
+}
+
+#define INSTANCE(name, q, cov) \
+static unsigned name(struct chip8_state *c8, unsigned n) \
+{ \
+	return run_switch(c8, n, q, cov); \
+}
+INSTANCE(run_switch_modern, C8_MODERN, 0)
+INSTANCE(run_switch_vip, C8_VIP, 0)
+INSTANCE(run_switch_schip, C8_SCHIP, 0)
+INSTANCE(run_switch_xochip, C8_XOCHIP, 0)
+INSTANCE(run_cover_modern, C8_MODERN, 1)
+INSTANCE(run_cover_vip, C8_VIP, 1)
+INSTANCE(run_cover_schip, C8_SCHIP, 1)
+INSTANCE(run_cover_xochip, C8_XOCHIP, 1)
+
+unsigned chip8_run_switch(struct chip8_state *c8, unsigned n)
+{
+	static unsigned (*const run[C8_NPROFILES])(struct chip8_state *, unsigned) = {
+		run_switch_modern,
+		run_switch_vip,
+		run_switch_schip,
+		run_switch_xochip,
+	};
+
+	return run[c8->profile](c8, n);
+}
+
+unsigned chip8_run_cover(struct chip8_state *c8, unsigned n)
+{
+	static unsigned (*const run[C8_NPROFILES])(struct chip8_state *, unsigned) = {
+		run_cover_modern,
+		run_cover_vip,
+		run_cover_schip,
+		run_cover_xochip,
+	};
+
+	return run[c8->profile](c8, n);
+}
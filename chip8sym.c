@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+/*
+ * Debug symbols for the running program, read from the sidecar file
+ * chip8as -g writes next to a ROM. Text, one record per line:
+ *
+ *	f <source file>
+ *	l <hex address> <label>		labels, in address order
+ *	s <hex address> <line>		source line of the word at address
+ *	d <hex address> <hex end>	data, not code, up to end
+ *	e <hex address>			end of the program
+ *
+ * A line record covers the words up to the next one, each a line after
+ * the one before, so straight code needs a record per label only.
+ */
+
+struct sym {
+	uint16_t addr;
+	int line;		/* labels: index into names */
+};
+
+static struct sym *labels, *lines, *data;	/* data: line is the end */
+static size_t nlabels, nlines, ndata, labels_cap, lines_cap, data_cap;
+static char **names;
+static char *source;
+static uint16_t end;
+
+static int sym_push(struct sym **tab, size_t *n, size_t *cap, uint16_t addr, int line)
+{
+	struct sym *nt;
+
+	if (*n == *cap) {
+		*cap = *cap ? 2 * *cap : 256;
+		nt = (struct sym *)realloc(*tab, *cap * sizeof(**tab));
+		if (!nt)
+			return -1;
+		*tab = nt;
+	}
+	(*tab)[*n].addr = addr;
+	(*tab)[*n].line = line;
+	(*n)++;
+	return 0;
+}
+static int sym_cmp(const void *a, const void *b)
+{
+	return (int)((const struct sym *)a)->addr - (int)((const struct sym *)b)->addr;
+}
+/* last entry at or before addr */
+static const struct sym *sym_find(const struct sym *tab, size_t n, uint16_t addr)
+{
+	size_t lo = 0, hi = n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (tab[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo ? &tab[lo - 1] : NULL;
+}
+
+void chip8_sym_clear(void)
+{
+	size_t i;
+
+	for (i = 0; i < nlabels; i++)
+		free(names[i]);
+	free(names);
+	free(labels);
+	free(lines);
+	free(data);
+	free(source);
+	names = NULL;
+	labels = lines = data = NULL;
+	source = NULL;
+	nlabels = nlines = ndata = labels_cap = lines_cap = data_cap = 0;
+	end = 0;
+}
+/* replaces the current symbols, returns 0 on success */
+int chip8_sym_read(FILE *fp)
+{
+	char *line = NULL, **nn, name[256];
+	size_t cap = 0, names_cap = 0;
+	unsigned addr, to;
+	int ln, rc = 0;
+
+	chip8_sym_clear();
+	while (!rc && getline(&line, &cap, fp) != -1) {
+		switch (line[0]) {
+			case 'f':
+				line[strcspn(line, "\r\n")] = '\0';
+				free(source);
+				source = strdup(line + 2);
+				break;
+			case 'l':
+				if (sscanf(line, "l %x %255s", &addr, name) != 2) {
+					rc = -1;
+					break;
+				}
+				if (nlabels == names_cap) {
+					names_cap = names_cap ? 2 * names_cap : 256;
+					nn = (char **)realloc(names, names_cap * sizeof(*names));
+					if (!nn) {
+						rc = -1;
+						break;
+					}
+					names = nn;
+				}
+				names[nlabels] = strdup(name);
+				if (!names[nlabels]) {
+					rc = -1;
+					break;
+				}
+				rc = sym_push(&labels, &nlabels, &labels_cap, addr, nlabels);
+				break;
+			case 's':
+				if (sscanf(line, "s %x %d", &addr, &ln) != 2)
+					rc = -1;
+				else
+					rc = sym_push(&lines, &nlines, &lines_cap, addr, ln);
+				break;
+			case 'd':
+				if (sscanf(line, "d %x %x", &addr, &to) != 2)
+					rc = -1;
+				else
+					rc = sym_push(&data, &ndata, &data_cap, addr, to);
+				break;
+			case 'e':
+				if (sscanf(line, "e %x", &addr) == 1)
+					end = addr;
+				else
+					rc = -1;
+				break;
+		}
+	}
+	free(line);
+	if (rc || ferror(fp)) {
+		chip8_sym_clear();
+		return -1;
+	}
+	/* written in address order, but nothing needs to rely on it */
+	qsort(labels, nlabels, sizeof(*labels), sym_cmp);
+	qsort(lines, nlines, sizeof(*lines), sym_cmp);
+	qsort(data, ndata, sizeof(*data), sym_cmp);
+	return 0;
+}
+int chip8_sym_load(const char *file)
+{
+	FILE *fp = fopen(file, "r");
+	int rc;
+
+	if (!fp)
+		return -1;
+	rc = chip8_sym_read(fp);
+	fclose(fp);
+	return rc;
+}
+int chip8_sym_loaded(void)
+{
+	return nlabels || nlines;
+}
+/* the address of a label, -1 if there is none of that name */
+int chip8_sym_addr(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < nlabels; i++)
+		if (!strcmp(names[labels[i].line], name))
+			return labels[i].addr;
+	return -1;
+}
+/* source file the symbols were written for, NULL if unknown */
+const char *chip8_sym_source(void)
+{
+	return source;
+}
+/* end of the program, 0 without symbols */
+uint16_t chip8_sym_end(void)
+{
+	return end;
+}
+/* source line of the word at addr, -1 if the symbols do not know it */
+int chip8_sym_line(uint16_t addr)
+{
+	const struct sym *s = NULL;
+
+	if (addr >= PROGRAM_MEM && addr < end)
+		s = sym_find(lines, nlines, addr);
+	return s ? s->line + (addr - s->addr) / 2 : -1;
+}
+/* whether addr is in .byte data rather than instructions */
+int chip8_sym_is_data(uint16_t addr)
+{
+	const struct sym *d = sym_find(data, ndata, addr);
+
+	return d && addr < d->line;
+}
+/*
+ * addr as L_label+off (file:line), as much of it as the symbols know.
+ * Without symbols it is just the hex address.
+ */
+const char *chip8_sym_str(uint16_t addr, char *buf, size_t len)
+{
+	const struct sym *l = NULL, *s = NULL;
+	int n;
+
+	if (addr >= PROGRAM_MEM && addr < end) {
+		l = sym_find(labels, nlabels, addr);
+		s = sym_find(lines, nlines, addr);
+	}
+	if (l && l->addr == addr)
+		n = snprintf(buf, len, "%s", names[l->line]);
+	else if (l)
+		n = snprintf(buf, len, "%s+%d", names[l->line], addr - l->addr);
+	else
+		n = snprintf(buf, len, "0x%x", addr);
+	if (s && n >= 0 && (size_t)n < len)
+		snprintf(buf + n, len - n, " (%s:%d)", source ? source : "?",
+				s->line + (addr - s->addr) / 2);
+	return buf;
+}
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+/*
+ * COSMAC VIP timing. The VIP's 1802 runs at 1.76 MHz, 8 clocks to a
+ * machine cycle, so a 60 Hz frame is 3668 machine cycles; the CDP1861
+ * display takes 1832 of them for its interrupt routine and DMA, leaving
+ * the interpreter the rest. Instruction costs follow published
+ * disassemblies of the VIP interpreter: 40 cycles to fetch and dispatch
+ * plus the work of the instruction, which for some depends on the data.
+ * Close to the real machine, not exact: what the interpreter's inner
+ * loops do is modelled per iteration, not per 1802 instruction.
+ */
+
+#define VIP_FETCH_CYCLES	40
+
+/* machine cycles op costs when executed in state c8 */
+unsigned chip8_vip_cycles(const struct chip8_state *c8, uint16_t op)
+{
+	const uint8_t *v = c8->v;
+	unsigned c = VIP_FETCH_CYCLES, x, rows;
+
+	switch (opC) {
+		case 0x0:
+			if (op == 0x00e0)
+				return c + 24 + 3078;
+			if (op == 0x00ee)
+				return c + 10;
+			/* machine code on the VIP, SUPER-CHIP and XO-CHIP extras elsewhere */
+			return c + 44;
+		case 0x1:
+			return c + 12;
+		case 0x2:
+			return c + 26;
+		case 0x3:
+			return c + (v[opX] == opNN ? 14 : 10);
+		case 0x4:
+			return c + (v[opX] != opNN ? 14 : 10);
+		case 0x5:
+			if (opN)
+				return c + 14 + 14 * (abs((int)opX - (int)opY) + 1);
+			return c + (v[opX] == v[opY] ? 18 : 14);
+		case 0x6:
+			return c + 6;
+		case 0x7:
+			return c + 10;
+		case 0x8:
+			return c + (opN ? 44 : 12);
+		case 0x9:
+			return c + (v[opX] != v[opY] ? 18 : 14);
+		case 0xa:
+			return c + 12;
+		case 0xb:
+			/* +2 when the add carries into the high byte */
+			return c + 22 + ((opNNN & 0xff) + v[0] > 0xff ? 2 : 0);
+		case 0xc:
+			return c + 36;
+		case 0xd:
+			/*
+			 * Set up, then per row a byte XORed in, and when x is not
+			 * byte aligned a second one and a shift loop that runs
+			 * once per bit of misalignment.
+			 */
+			x = v[opX] & 7;
+			rows = opN ? opN : 32;
+			return c + 26 + rows * (x ? 54 + 4 * x : 34);
+		case 0xe:
+			if (opNN == 0x9e)
+				return c + (c8->key[v[opX] & 0xf] ? 18 : 14);
+			return c + (!c8->key[v[opX] & 0xf] ? 18 : 14);
+		case 0xf:
+			switch (opNN) {
+				case 0x07:
+				case 0x15:
+				case 0x18:
+					return c + 10;
+				case 0x0a:
+					return c + 19;
+				case 0x1e:
+					return c + 16 + ((c8->mp & 0xff) + v[opX] > 0xff ? 6 : 0);
+				case 0x29:
+					return c + 16;
+				case 0x33:
+					/* counts each digit down by repeated subtraction */
+					x = v[opX];
+					return c + 80 + 16 * (x / 100 + x / 10 % 10 + x % 10);
+				case 0x55:
+				case 0x65:
+					return c + 14 + 14 * (opX + 1);
+			}
+			return c + 44;
+	}
+	return c;
+}
+
+/*
+ * Runs one 60 Hz VIP frame with core, an instruction at a time until
+ * their cycles use up what the display leaves, then ticks the timers.
+ * An instruction that runs past the end of the frame takes the cycles
+ * it overran from the next. With vblank set a draw waits for the next
+ * frame, as on the VIP. Returns the instructions run.
+ */
+unsigned chip8_vip_frame(struct chip8_vip *vip, struct chip8_state *c8, const struct chip8_core *core)
+{
+	unsigned n = 0, cost;
+	uint16_t op;
+
+	vip->budget += VIP_FRAME_CYCLES - VIP_DISPLAY_CYCLES;
+	while (vip->budget > 0 && !c8->fault) {
+		op = chip8_fetch(c8);
+		cost = chip8_vip_cycles(c8, op);
+		n += core->run(c8, 1);
+		vip->budget -= cost;
+		vip->cycles += cost;
+		if (vip->vblank && opC == 0xd) {
+			if (vip->budget > 0)
+				vip->budget = 0;
+			break;
+		}
+	}
+	vip->frames++;
+	chip8_tick(c8);
+	return n;
+}
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Disassembles ROMs with c8dis, reassembles the output with chip8as and
+# checks the same bytes come back. An odd ROM comes back padded with a
+# zero byte to a whole word. With no arguments it checks games/*.rom and
+# the ROMs of test/*.c8. Run from the top of the tree, `make check`.
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+fail=0
+n=0
+
+check() {
+	rom=$1
+	out=$tmp/$(basename "$rom" .rom).rom
+	size=$(wc -c < "$rom")
+	if ! ./c8dis -o "$tmp/dis.c8" "$rom" ||
+	   ! ./c8as -C "$tmp/cache" -o "$out" "$tmp/dis.c8" > /dev/null 2>&1; then
+		echo "FAIL $rom: does not disassemble and reassemble"
+		fail=1
+		return
+	fi
+	if [ $((size % 2)) -eq 1 ]; then
+		# the padding must be one zero byte
+		cmp -s "$rom" "$out" -n "$size" && [ "$(wc -c < "$out")" -eq $((size + 1)) ] &&
+			[ "$(tail -c 1 "$out" | od -An -tu1 | tr -d ' ')" = 0 ]
+	else
+		cmp -s "$rom" "$out"
+	fi
+	if [ $? -ne 0 ]; then
+		echo "FAIL $rom: reassembles differently"
+		fail=1
+		return
+	fi
+	n=$((n + 1))
+}
+
+if [ $# -eq 0 ]; then
+	for src in test/*.c8; do
+		rom=$tmp/$(basename "$src" .c8).in.rom
+		if ! ./c8as -C "$tmp/cache" -o "$rom" "$src" > /dev/null 2>&1; then
+			echo "FAIL $src: does not assemble"
+			fail=1
+			continue
+		fi
+		set -- "$@" "$rom"
+	done
+	set -- games/*.rom "$@"
+fi
+for rom in "$@"; do
+	check "$rom"
+done
+echo "$n ROMs round trip through c8dis and chip8as"
+exit $fail